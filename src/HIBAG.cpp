@@ -21,6 +21,7 @@
 #include <memory>
 #include <limits>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <fstream>
 #include <vector>
@@ -395,29 +396,68 @@ SEXP HIBAG_AlleleStrand2(SEXP allele1, SEXP allele2)
 // HIBAG: Attribute Bagging method
 //
 
-/// the number of attribute bagging models allowed
-#define MODEL_NUM_LIMIT    256
-/// the model container
-static CAttrBag_Model* _HIBAG_MODELS_[MODEL_NUM_LIMIT];
+/// the models are held by R external pointers, which are released by
+//    hlaClose(), the finalizer or unloading; the live handles are kept for
+//    unloading
+static set<SEXP> _HIBAG_MODELS_;
 
-/// need a new model
-static int _Need_New_HIBAG_Model()
+/// the tag of the external pointers to HIBAG models
+static SEXP _HIBAG_Model_Tag()
 {
-	for (int i=0; i < MODEL_NUM_LIMIT; i++)
-		if (_HIBAG_MODELS_[i] == NULL) return i;
-	throw ErrHLA("No memory space to store a new HIBAG model, "
-		"please call \"hlaClose\" to release unused HIBAG models.");
+	return install("HIBAG_MODEL");
 }
 
-/// check the model
-static void _Check_HIBAG_Model(int model)
+/// release the model of an external pointer
+static void _HIBAG_Model_Release(SEXP ptr)
 {
-	if ((0 <= model) && (model < MODEL_NUM_LIMIT))
+	CAttrBag_Model *m = (CAttrBag_Model*)R_ExternalPtrAddr(ptr);
+	_HIBAG_MODELS_.erase(ptr);
+	R_ClearExternalPtr(ptr);
+	if (m) delete m;
+}
+
+/// the finalizer of the external pointers, .hlaFinalizer() in R, which is
+//    independent of the shared object since the finalizer may be called
+//    after unloading
+static SEXP _HIBAG_Model_Finalizer()
+{
+	SEXP ns = PROTECT(R_FindNamespace(mkString("HIBAG")));
+	SEXP fun = findVarInFrame(ns, install(".hlaFinalizer"));
+	if (fun == R_UnboundValue)
+		throw ErrHLA("No finalizer of HIBAG model.");
+	if (TYPEOF(fun) == PROMSXP)
 	{
-		if (_HIBAG_MODELS_[model] != NULL)
-			return;
+		PROTECT(fun);
+		fun = eval(fun, ns);
+		UNPROTECT(1);
 	}
-	throw ErrHLA("The handle of HIBAG model has been closed.");
+	UNPROTECT(1);
+	return fun;
+}
+
+/// a new model held by an external pointer, which should be protected
+static SEXP _New_HIBAG_Model()
+{
+	SEXP fun = PROTECT(_HIBAG_Model_Finalizer());
+	SEXP rv = PROTECT(R_MakeExternalPtr(NULL, _HIBAG_Model_Tag(),
+		R_NilValue));
+	R_RegisterFinalizerEx(rv, fun, TRUE);
+	R_SetExternalPtrAddr(rv, new CAttrBag_Model);
+	_HIBAG_MODELS_.insert(rv);
+	UNPROTECT(2);
+	return rv;
+}
+
+/// get the model from an external pointer
+static CAttrBag_Model *_Get_HIBAG_Model(SEXP model)
+{
+	if (TYPEOF(model) != EXTPTRSXP ||
+			R_ExternalPtrTag(model) != _HIBAG_Model_Tag())
+		throw ErrHLA("Invalid handle of HIBAG model.");
+	CAttrBag_Model *m = (CAttrBag_Model*)R_ExternalPtrAddr(model);
+	if (m == NULL)
+		throw ErrHLA("The handle of HIBAG model has been closed.");
+	return m;
 }
 
 
@@ -427,7 +467,7 @@ static void _Check_HIBAG_Model(int model)
  *  \param nSNP       the number of SNPs
  *  \param nSamp      the number of samples
  *  \param nHLA       the number of different HLA alleles
- *  \return a model index
+ *  \return a model handle
 **/
 SEXP HIBAG_New(SEXP nSamp, SEXP nSNP, SEXP nHLA)
 {
@@ -441,10 +481,8 @@ SEXP HIBAG_New(SEXP nSamp, SEXP nSNP, SEXP nHLA)
 	if (NumHLA <= 0) error("Invalid number of unique HLA allele.");
 
 	CORE_TRY
-		int model = _Need_New_HIBAG_Model();
-		_HIBAG_MODELS_[model] = new CAttrBag_Model;
-		_HIBAG_MODELS_[model]->InitTraining(NumSNP, NumSamp, NumHLA);
-		rv_ans = ScalarInteger(model);
+		rv_ans = _New_HIBAG_Model();
+		_Get_HIBAG_Model(rv_ans)->InitTraining(NumSNP, NumSamp, NumHLA);
 	CORE_CATCH
 }
 
@@ -458,35 +496,33 @@ SEXP HIBAG_New(SEXP nSamp, SEXP nSNP, SEXP nHLA)
  *  \param nHLA       the number of different HLA alleles
  *  \param H1         the first HLA allele of a HLA type
  *  \param H2         the second HLA allele of a HLA type
- *  \return the model index
+ *  \return the model handle
 **/
 SEXP HIBAG_Training(SEXP nSNP, SEXP nSamp, SEXP snp_geno,
 	SEXP nHLA, SEXP H1, SEXP H2)
 {
 	CORE_TRY
-		int model = _Need_New_HIBAG_Model();
-		_HIBAG_MODELS_[model] = new CAttrBag_Model;
-		_HIBAG_MODELS_[model]->InitTraining(Rf_asInteger(nSNP),
+		rv_ans = _New_HIBAG_Model();
+		_Get_HIBAG_Model(rv_ans)->InitTraining(Rf_asInteger(nSNP),
 			Rf_asInteger(nSamp), INTEGER(snp_geno),
 			Rf_asInteger(nHLA), INTEGER(H1), INTEGER(H2));
-		rv_ans = ScalarInteger(model);
 	CORE_CATCH
 }
 
 
 /**
- *  Close an existing HIBAG model 
+ *  Close an existing HIBAG model, which is also called by the finalizer
  *
- *  \param model      the index in the model list
+ *  \param model      the model handle
 **/
 SEXP HIBAG_Close(SEXP model)
 {
-	int midx = Rf_asInteger(model);
 	CORE_TRY
-		_Check_HIBAG_Model(midx);
-		CAttrBag_Model *m = _HIBAG_MODELS_[midx];
-		_HIBAG_MODELS_[midx] = NULL;
-		delete m;
+		if (TYPEOF(model) != EXTPTRSXP ||
+				R_ExternalPtrTag(model) != _HIBAG_Model_Tag())
+			throw ErrHLA("Invalid handle of HIBAG model.");
+		// a closed model is ignored
+		_HIBAG_Model_Release(model);
 	CORE_CATCH
 }
 
@@ -494,33 +530,69 @@ SEXP HIBAG_Close(SEXP model)
 /**
  *  Add individual classifiers
  *
- *  \param model           the model index
+ *  \param model           the model handle
  *  \param nclassifier     the total number of individual classifiers to be created
  *  \param mtry            the number of variables randomly sampled as candidates for selection
  *  \param prune           if TRUE, perform a parsimonious forward variable selection
+ *  \param nthreads        the number of threads for building classifiers
+ *  \param em_accel        if TRUE, use the accelerated EM algorithm
  *  \param verbose         show information if TRUE
  *  \param verbose_detail  show more information if TRUE
  *  \param proc_ptr        pointer to functions for an extensible component
+ *  \param trace_fn        the CSV file of the training trace, or NULL
+ *  \param checkpoint      the checkpoint file to append and resume, or NULL
+ *  \param racing          the fraction of out-of-bag samples in the first
+ *                         round, the fraction of candidates kept after a
+ *                         round and the EM reltol of the candidate racing,
+ *                         or NULL for no racing
 **/
 SEXP HIBAG_NewClassifiers(SEXP model, SEXP nclassifier, SEXP mtry,
-	SEXP prune, SEXP verbose, SEXP verbose_detail, SEXP proc_ptr)
+	SEXP prune, SEXP nthreads, SEXP em_accel, SEXP verbose,
+	SEXP verbose_detail, SEXP proc_ptr, SEXP trace_fn, SEXP checkpoint,
+	SEXP racing)
 {
+	int nthread = Rf_asInteger(nthreads);
+	if (nthread == NA_INTEGER || nthread < 1) nthread = 1;
+	const bool accel = (Rf_asLogical(em_accel) == TRUE);
+
 	CORE_TRY
-		int midx = Rf_asInteger(model);
-		_Check_HIBAG_Model(midx);
+		CAttrBag_Model *M = _Get_HIBAG_Model(model);
 		GetRNGstate();
 
+		CTrainingTraceCSV *trace = NULL;
+		if (!Rf_isNull(trace_fn))
+			trace = new CTrainingTraceCSV(CHAR(STRING_ELT(trace_fn, 0)));
+
 		if (!Rf_isNull(proc_ptr))
 			GPUExtProcPtr = (TypeGPUExtProc *)R_ExternalPtrAddr(proc_ptr);
+		EM_Accelerate = accel;
+		TrainingTrace = trace;
+		if (!Rf_isNull(racing))
+		{
+			Search_Racing.Enabled = true;
+			Search_Racing.SampFrac = REAL(racing)[0];
+			Search_Racing.KeepFrac = REAL(racing)[1];
+			Search_Racing.EMRelTol = REAL(racing)[2];
+		}
 		try {
-			_HIBAG_MODELS_[midx]->BuildClassifiers(
+			M->BuildClassifiers(
 				Rf_asInteger(nclassifier), Rf_asInteger(mtry),
 				Rf_asLogical(prune) == TRUE, Rf_asLogical(verbose) == TRUE,
-				Rf_asLogical(verbose_detail) == TRUE);
+				Rf_asLogical(verbose_detail) == TRUE, nthread,
+				Rf_isNull(checkpoint) ? NULL :
+					CHAR(STRING_ELT(checkpoint, 0)));
 			GPUExtProcPtr = NULL;
+			EM_Accelerate = false;
+			TrainingTrace = NULL;
+			Search_Racing.Enabled = false;
+			delete trace;
 		}
 		catch(...) {
 			GPUExtProcPtr = NULL;
+			EM_Accelerate = false;
+			TrainingTrace = NULL;
+			Search_Racing.Enabled = false;
+			delete trace;
 			throw;
 		}
 
@@ -529,26 +601,93 @@ SEXP HIBAG_NewClassifiers(SEXP model, SEXP nclassifier, SEXP mtry,
 }
 
 
+/**
+ *  Open the checkpoint file of the classifiers built by the compute nodes,
+ *    and add the classifiers in the file to the model
+ *
+ *  \param model           the model handle
+ *  \param fn              the checkpoint file to append and resume
+ *  \param nclassifier     the total number of individual classifiers
+ *  \param mtry            the number of variables randomly sampled as candidates for selection
+ *  \param prune           if TRUE, perform a parsimonious forward variable selection
+ *  \param racing          the parameters of the candidate racing, or NULL
+ *  \param seed            the seed of the compute nodes if the file is created
+ *  \return the seed in the file and the indices of the loaded classifiers
+**/
+SEXP HIBAG_OpenCheckpoint(SEXP model, SEXP fn, SEXP nclassifier, SEXP mtry,
+	SEXP prune, SEXP racing, SEXP seed)
+{
+	const char *filename = CHAR(STRING_ELT(fn, 0));
+	const int Seed = Rf_asInteger(seed);
+	if (Seed == NA_INTEGER) error("Invalid 'seed'.");
+
+	CORE_TRY
+		CAttrBag_Model *M = _Get_HIBAG_Model(model);
+		// the parameters of racing are stored in the file
+		if (!Rf_isNull(racing))
+		{
+			Search_Racing.Enabled = true;
+			Search_Racing.SampFrac = REAL(racing)[0];
+			Search_Racing.KeepFrac = REAL(racing)[1];
+			Search_Racing.EMRelTol = REAL(racing)[2];
+		}
+		vector<int> index;
+		uint64_t s = 0;
+		try {
+			s = M->OpenCheckpoint(filename, Rf_asInteger(nclassifier),
+				Rf_asInteger(mtry), Rf_asLogical(prune) == TRUE,
+				(uint32_t)Seed, index);
+			Search_Racing.Enabled = false;
+		}
+		catch(...) {
+			Search_Racing.Enabled = false;
+			throw;
+		}
+
+		rv_ans = PROTECT(NEW_LIST(2));
+		SET_ELEMENT(rv_ans, 0, Rf_ScalarInteger((int)s));
+		SEXP idx = NEW_INTEGER(index.size());
+		SET_ELEMENT(rv_ans, 1, idx);
+		for (size_t i=0; i < index.size(); i++)
+			INTEGER(idx)[i] = index[i] + 1;
+		UNPROTECT(1);
+	CORE_CATCH
+}
+
+
+/**
+ *  Append the last classifier of the model to the checkpoint file
+ *
+ *  \param model        the model handle
+ *  \param idx          the index of the classifier, starting from 1
+**/
+SEXP HIBAG_AppendCheckpoint(SEXP model, SEXP idx)
+{
+	CORE_TRY
+		_Get_HIBAG_Model(model)->AppendCheckpoint(Rf_asInteger(idx) - 1);
+	CORE_CATCH
+}
+
+
 /**
  *  Predict HLA types, output the best-guess and their prob.
  *
- *  \param model        the model index
+ *  \param model        the model handle
  *  \param GenoMat      the pointer to the SNP genotypes
  *  \param nSamp        the number of samples in GenoMat
  *  \param vote_method  the voting method
  *  \param ShowInfo     whether showing information
  *  \param proc_ptr     pointer to functions for an extensible component
+ *  \param nthreads     the number of threads
  *  \return H1, H2 and posterior prob.
 **/
 SEXP HIBAG_Predict_Resp(SEXP model, SEXP GenoMat, SEXP nSamp,
-	SEXP vote_method, SEXP ShowInfo, SEXP proc_ptr)
+	SEXP vote_method, SEXP ShowInfo, SEXP proc_ptr, SEXP nthreads)
 {
-	int midx = Rf_asInteger(model);
 	int NumSamp = Rf_asInteger(nSamp);
 
 	CORE_TRY
-		_Check_HIBAG_Model(midx);
-		CAttrBag_Model &M = *_HIBAG_MODELS_[midx];
+		const CAttrBag_Model &M = *_Get_HIBAG_Model(model);
 
 		rv_ans = PROTECT(NEW_LIST(4));
 		SEXP out_H1 = PROTECT(NEW_INTEGER(NumSamp));
@@ -565,7 +704,8 @@ SEXP HIBAG_Predict_Resp(SEXP model, SEXP GenoMat, SEXP nSamp,
 		try {
 			M.PredictHLA(INTEGER(GenoMat), NumSamp, Rf_asInteger(vote_method),
 				INTEGER(out_H1), INTEGER(out_H2), REAL(out_Prob),
-				REAL(out_PriorProb), NULL, Rf_asLogical(ShowInfo)==TRUE);
+				REAL(out_PriorProb), NULL, Rf_asLogical(ShowInfo)==TRUE, NULL,
+				Rf_asInteger(nthreads));
 			GPUExtProcPtr = NULL;
 		}
 		catch(...) {
@@ -582,23 +722,22 @@ SEXP HIBAG_Predict_Resp(SEXP model, SEXP GenoMat, SEXP nSamp,
  *  Predict HLA types, output the best-guess, their prob. and a matrix
  *      of all posterior probabilities
  *
- *  \param model        the model index
+ *  \param model        the model handle
  *  \param GenoMat      the pointer to the SNP genotypes
  *  \param nSamp        the number of samples in GenoMat
  *  \param vote_method  the voting method
  *  \param ShowInfo     whether showing information
  *  \param proc_ptr     pointer to functions for an extensible component
+ *  \param nthreads     the number of threads
  *  \return H1, H2, prob. and a matrix of all probabilities
 **/
 SEXP HIBAG_Predict_Resp_Prob(SEXP model, SEXP GenoMat, SEXP nSamp,
-	SEXP vote_method, SEXP ShowInfo, SEXP proc_ptr)
+	SEXP vote_method, SEXP ShowInfo, SEXP proc_ptr, SEXP nthreads)
 {
-	int midx = Rf_asInteger(model);
 	int NumSamp = Rf_asInteger(nSamp);
 
 	CORE_TRY
-		_Check_HIBAG_Model(midx);
-		CAttrBag_Model &M = *_HIBAG_MODELS_[midx];
+		const CAttrBag_Model &M = *_Get_HIBAG_Model(model);
 
 		rv_ans = PROTECT(NEW_LIST(5));
 
@@ -620,7 +759,7 @@ SEXP HIBAG_Predict_Resp_Prob(SEXP model, SEXP GenoMat, SEXP nSamp,
 			M.PredictHLA(INTEGER(GenoMat), NumSamp, Rf_asInteger(vote_method),
 				INTEGER(out_H1), INTEGER(out_H2), REAL(out_Prob),
 				REAL(out_PriorProb), REAL(out_MatProb),
-				Rf_asLogical(ShowInfo)==TRUE);
+				Rf_asLogical(ShowInfo)==TRUE, NULL, Rf_asInteger(nthreads));
 			GPUExtProcPtr = NULL;
 		}
 		catch(...) {
@@ -633,10 +772,219 @@ SEXP HIBAG_Predict_Resp_Prob(SEXP model, SEXP GenoMat, SEXP nSamp,
 }
 
 
+/// the number of samples in a chunk when scanning PLINK BED files
+static const int BED_CHUNK_SIZE = 4096;
+
+/// save the sparse posterior probabilities to rv_ans[start ... start+2]
+static void _Set_SparseProb(SEXP rv_ans, int start, const TSparsePostProb &sp)
+{
+	const int NumSamp = sp.SampStart.size() - 1;
+	SEXP out_Start = NEW_INTEGER(NumSamp + 1);
+	SET_ELEMENT(rv_ans, start, out_Start);
+	for (int i=0; i <= NumSamp; i++)
+		INTEGER(out_Start)[i] = sp.SampStart[i];
+
+	const size_t n = sp.Index.size();
+	SEXP out_Index = NEW_INTEGER(n);
+	SET_ELEMENT(rv_ans, start + 1, out_Index);
+	if (n > 0)
+		memcpy(INTEGER(out_Index), &sp.Index[0], sizeof(int)*n);
+
+	SEXP out_SpProb = NEW_NUMERIC(n);
+	SET_ELEMENT(rv_ans, start + 2, out_SpProb);
+	if (n > 0)
+		memcpy(REAL(out_SpProb), &sp.Prob[0], sizeof(double)*n);
+}
+
+/**
+ *  Predict HLA types, output the best-guess, their prob. and the posterior
+ *      probabilities in a sparse format
+ *
+ *  \param model        the model handle
+ *  \param GenoMat      the pointer to the SNP genotypes
+ *  \param nSamp        the number of samples in GenoMat
+ *  \param vote_method  the voting method
+ *  \param TopK         the max number of HLA pairs per sample, no limit if <= 0
+ *  \param Cutoff       the min posterior probability of an HLA pair
+ *  \param ShowInfo     whether showing information
+ *  \param proc_ptr     pointer to functions for an extensible component
+ *  \param nthreads     the number of threads
+ *  \return H1, H2, prob., and the start of each sample, the indices of
+ *      HLA pairs and their probabilities
+**/
+SEXP HIBAG_Predict_Resp_SpProb(SEXP model, SEXP GenoMat, SEXP nSamp,
+	SEXP vote_method, SEXP TopK, SEXP Cutoff, SEXP ShowInfo, SEXP proc_ptr,
+	SEXP nthreads)
+{
+	int NumSamp = Rf_asInteger(nSamp);
+
+	CORE_TRY
+		const CAttrBag_Model &M = *_Get_HIBAG_Model(model);
+
+		rv_ans = PROTECT(NEW_LIST(7));
+
+		SEXP out_H1 = PROTECT(NEW_INTEGER(NumSamp));
+		SET_ELEMENT(rv_ans, 0, out_H1);
+		SEXP out_H2 = PROTECT(NEW_INTEGER(NumSamp));
+		SET_ELEMENT(rv_ans, 1, out_H2);
+		SEXP out_Prob = PROTECT(NEW_NUMERIC(NumSamp));
+		SET_ELEMENT(rv_ans, 2, out_Prob);
+		SEXP out_PriorProb = PROTECT(NEW_NUMERIC(NumSamp));
+		SET_ELEMENT(rv_ans, 3, out_PriorProb);
+
+		TSparsePostProb sp;
+		sp.Init(Rf_asInteger(TopK), Rf_asReal(Cutoff));
+
+		if (!Rf_isNull(proc_ptr))
+			GPUExtProcPtr = (TypeGPUExtProc *)R_ExternalPtrAddr(proc_ptr);
+		try {
+			M.PredictHLA(INTEGER(GenoMat), NumSamp, Rf_asInteger(vote_method),
+				INTEGER(out_H1), INTEGER(out_H2), REAL(out_Prob),
+				REAL(out_PriorProb), NULL, Rf_asLogical(ShowInfo)==TRUE, &sp,
+				Rf_asInteger(nthreads));
+			GPUExtProcPtr = NULL;
+		}
+		catch(...) {
+			GPUExtProcPtr = NULL;
+			throw;
+		}
+
+		_Set_SparseProb(rv_ans, 4, sp);
+		UNPROTECT(5);
+	CORE_CATCH
+}
+
+
+/**
+ *  Compute the allele frequencies of the selected SNPs in a PLINK BED file
+ *
+ *  \param bedfn        the file name of PLINK BED file
+ *  \param n_samp       the number of samples
+ *  \param n_snp        the number of SNPs
+ *  \param snp_idx      the indices of selected SNPs (starting from ZERO),
+ *                      or -1 for a SNP not in the file
+ *  \return the allele frequencies, NaN if no genotype
+**/
+SEXP HIBAG_BEDAlleleFreq(SEXP bedfn, SEXP n_samp, SEXP n_snp, SEXP snp_idx)
+{
+	const char *fn     = CHAR(STRING_ELT(bedfn, 0));
+	const int NumSamp  = Rf_asInteger(n_samp);
+	const int NumSNP   = Rf_asInteger(n_snp);
+	const int NumSel   = Rf_length(snp_idx);
+
+	CORE_TRY
+		CBEDGenoReader reader;
+		reader.Open(fn, NumSamp, NumSNP, NumSel, INTEGER(snp_idx), NULL);
+
+		const int chunk = (NumSamp < BED_CHUNK_SIZE) ? NumSamp : BED_CHUNK_SIZE;
+		vector<int> geno((size_t)chunk * NumSel);
+		vector<double> sum(NumSel, 0);
+		vector<int> cnt(NumSel, 0);
+
+		for (int i=0; i < NumSamp; )
+		{
+			const int n = (NumSamp - i < chunk) ? (NumSamp - i) : chunk;
+			reader.Read(&geno[0], n);
+			const int *p = &geno[0];
+			for (int k=0; k < n; k++)
+			{
+				for (int j=0; j < NumSel; j++, p++)
+				{
+					if ((0 <= *p) && (*p <= 2))
+						{ sum[j] += *p; cnt[j] ++; }
+				}
+			}
+			i += n;
+		}
+
+		rv_ans = NEW_NUMERIC(NumSel);
+		for (int j=0; j < NumSel; j++)
+			REAL(rv_ans)[j] = (cnt[j] > 0) ? (0.5 * sum[j] / cnt[j]) : R_NaN;
+	CORE_CATCH
+}
+
+
+/**
+ *  Predict HLA types from a PLINK BED file in chunks of samples, output the
+ *      best-guess, their prob. and optionally the posterior probabilities
+ *      in a sparse format
+ *
+ *  \param model        the model handle
+ *  \param bedfn        the file name of PLINK BED file
+ *  \param n_samp       the number of samples
+ *  \param n_snp        the number of SNPs
+ *  \param snp_idx      the indices of the SNPs in the model (starting from
+ *                      ZERO), or -1 for a SNP not in the file
+ *  \param snp_flip     whether to switch the alleles of the SNPs
+ *  \param chunk_size   the number of samples in a chunk
+ *  \param vote_method  the voting method
+ *  \param TopK         the max number of HLA pairs per sample, no limit if <= 0
+ *  \param Cutoff       the min posterior probability of an HLA pair
+ *  \param ShowInfo     whether showing information
+ *  \param proc_ptr     pointer to functions for an extensible component
+ *  \param nthreads     the number of threads
+ *  \return H1, H2, prob., and the sparse posterior probabilities if
+ *      TopK > 0 or Cutoff > 0
+**/
+SEXP HIBAG_Predict_BED(SEXP model, SEXP bedfn, SEXP n_samp, SEXP n_snp,
+	SEXP snp_idx, SEXP snp_flip, SEXP chunk_size, SEXP vote_method,
+	SEXP TopK, SEXP Cutoff, SEXP ShowInfo, SEXP proc_ptr, SEXP nthreads)
+{
+	const char *fn     = CHAR(STRING_ELT(bedfn, 0));
+	const int NumSamp  = Rf_asInteger(n_samp);
+	const int NumSNP   = Rf_asInteger(n_snp);
+	const int NumTopK  = Rf_asInteger(TopK);
+	const double MinP  = Rf_asReal(Cutoff);
+	const bool sparse  = (NumTopK > 0) || (MinP > 0);
+
+	CORE_TRY
+		const CAttrBag_Model &M = *_Get_HIBAG_Model(model);
+		if (Rf_length(snp_idx) != M.nSNP())
+			throw ErrHLA("The number of SNPs should be %d.", M.nSNP());
+
+		CBEDGenoReader reader;
+		reader.Open(fn, NumSamp, NumSNP, M.nSNP(), INTEGER(snp_idx),
+			LOGICAL(snp_flip));
+
+		rv_ans = PROTECT(NEW_LIST(sparse ? 7 : 4));
+		SEXP out_H1 = PROTECT(NEW_INTEGER(NumSamp));
+		SET_ELEMENT(rv_ans, 0, out_H1);
+		SEXP out_H2 = PROTECT(NEW_INTEGER(NumSamp));
+		SET_ELEMENT(rv_ans, 1, out_H2);
+		SEXP out_Prob = PROTECT(NEW_NUMERIC(NumSamp));
+		SET_ELEMENT(rv_ans, 2, out_Prob);
+		SEXP out_PriorProb = PROTECT(NEW_NUMERIC(NumSamp));
+		SET_ELEMENT(rv_ans, 3, out_PriorProb);
+
+		TSparsePostProb sp;
+		sp.Init(NumTopK, MinP);
+
+		if (!Rf_isNull(proc_ptr))
+			GPUExtProcPtr = (TypeGPUExtProc *)R_ExternalPtrAddr(proc_ptr);
+		try {
+			M.PredictHLA(reader, NumSamp, Rf_asInteger(chunk_size),
+				Rf_asInteger(vote_method), INTEGER(out_H1), INTEGER(out_H2),
+				REAL(out_Prob), REAL(out_PriorProb),
+				Rf_asLogical(ShowInfo)==TRUE, sparse ? &sp : NULL,
+				Rf_asInteger(nthreads));
+			GPUExtProcPtr = NULL;
+		}
+		catch(...) {
+			GPUExtProcPtr = NULL;
+			throw;
+		}
+
+		if (sparse)
+			_Set_SparseProb(rv_ans, 4, sp);
+		UNPROTECT(5);
+	CORE_CATCH
+}
+
+
 /**
  *  Create a new individual classifier with specified parameters
  *
- *  \param model        the model index
+ *  \param model        the model handle
  *  \param snpidx       the indices of SNP markers
  *  \param samp_num     the bootstrap count
  *  \param freq         the haplotype frequencies
@@ -647,7 +995,6 @@ SEXP HIBAG_Predict_Resp_Prob(SEXP model, SEXP GenoMat, SEXP nSamp,
 SEXP HIBAG_NewClassifierHaplo(SEXP model, SEXP snpidx,
 	SEXP samp_num, SEXP freq, SEXP hla, SEXP haplo, SEXP acc)
 {
-	int midx = Rf_asInteger(model);
 	int nHaplo = Rf_length(freq);
 	if (nHaplo != Rf_length(hla))
 		error("Invalid length of 'hla'.");
@@ -656,14 +1003,13 @@ SEXP HIBAG_NewClassifierHaplo(SEXP model, SEXP snpidx,
 	double Acc = Rf_isNull(acc) ? 0.0 : Rf_asReal(acc);
 
 	CORE_TRY
-		_Check_HIBAG_Model(midx);
+		CAttrBag_Model *M = _Get_HIBAG_Model(model);
 
 		vector<const char*> HapList(nHaplo);
 		for (int i=0; i < nHaplo; i++)
 			HapList[i] = CHAR(STRING_ELT(haplo, i));
 
-		CAttrBag_Classifier *I =
-			_HIBAG_MODELS_[midx]->NewClassifierAllSamp();
+		CAttrBag_Classifier *I = M->NewClassifierAllSamp();
 		I->Assign(Rf_length(snpidx), INTEGER(snpidx),
 			INTEGER(samp_num), nHaplo, REAL(freq), INTEGER(hla),
 			&HapList[0], &Acc);
@@ -671,18 +1017,90 @@ SEXP HIBAG_NewClassifierHaplo(SEXP model, SEXP snpidx,
 }
 
 
+/**
+ *  Save a HIBAG model to a binary file
+ *
+ *  \param model        the model handle
+ *  \param fn           the file name
+ *  \param meta         a raw vector of metadata (the serialized R object)
+**/
+SEXP HIBAG_SaveBinary(SEXP model, SEXP fn, SEXP meta)
+{
+	const char *filename = CHAR(STRING_ELT(fn, 0));
+	CORE_TRY
+		_Get_HIBAG_Model(model)->SaveBinary(filename, RAW(meta),
+			Rf_length(meta));
+	CORE_CATCH
+}
+
+
+/**
+ *  Load a HIBAG model from a binary file, which is memory-mapped
+ *
+ *  \param fn           the file name
+ *  \return the model handle and the raw vector of metadata
+**/
+SEXP HIBAG_LoadBinary(SEXP fn)
+{
+	const char *filename = CHAR(STRING_ELT(fn, 0));
+	CORE_TRY
+		SEXP model = PROTECT(_New_HIBAG_Model());
+		CAttrBag_Model *m = _Get_HIBAG_Model(model);
+		m->LoadBinary(filename);
+
+		size_t meta_size;
+		const UINT8 *meta = m->BinaryMeta(meta_size);
+		rv_ans = PROTECT(NEW_LIST(2));
+		SET_ELEMENT(rv_ans, 0, model);
+		SEXP out_meta = NEW_RAW(meta_size);
+		SET_ELEMENT(rv_ans, 1, out_meta);
+		memcpy(RAW(out_meta), meta, meta_size);
+		UNPROTECT(2);
+	CORE_CATCH
+}
+
+
+/**
+ *  Save the training set of a HIBAG model to a file for the worker processes
+ *
+ *  \param model        the model handle
+ *  \param fn           the file name
+**/
+SEXP HIBAG_SaveTraining(SEXP model, SEXP fn)
+{
+	const char *filename = CHAR(STRING_ELT(fn, 0));
+	CORE_TRY
+		_Get_HIBAG_Model(model)->SaveTraining(filename);
+	CORE_CATCH
+}
+
+
+/**
+ *  Create a HIBAG model from a training file, which is memory-mapped
+ *
+ *  \param fn           the file name
+ *  \return the model handle
+**/
+SEXP HIBAG_LoadTraining(SEXP fn)
+{
+	const char *filename = CHAR(STRING_ELT(fn, 0));
+	CORE_TRY
+		rv_ans = _New_HIBAG_Model();
+		_Get_HIBAG_Model(rv_ans)->LoadTraining(filename);
+	CORE_CATCH
+}
+
+
 /**
  *  Get the number of individual component classifiers
  *
- *  \param model        the model index
+ *  \param model        the model handle
  *  \return the number of individual classifiers
 **/
 SEXP HIBAG_GetNumClassifiers(SEXP model)
 {
-	int midx = Rf_asInteger(model);
 	CORE_TRY
-		_Check_HIBAG_Model(midx);
-		rv_ans = ScalarInteger(_HIBAG_MODELS_[midx]->ClassifierList().size());
+		rv_ans = ScalarInteger(_Get_HIBAG_Model(model)->ClassifierList().size());
 	CORE_CATCH
 }
 
@@ -690,7 +1108,7 @@ SEXP HIBAG_GetNumClassifiers(SEXP model)
 /**
  *  Get the details of a specified individual classifier
  *
- *  \param model         the model index
+ *  \param model         the model handle
  *  \param idx           the index of individual classifier
  *  \return the haplotype frequencies, the HLA alleles, the haplotype list,
  *          the indices of SNP markers, the indices of samples and
@@ -698,12 +1116,10 @@ SEXP HIBAG_GetNumClassifiers(SEXP model)
 **/
 SEXP HIBAG_Classifier_GetHaplos(SEXP model, SEXP idx)
 {
-	int midx = Rf_asInteger(model);
 	int cidx = Rf_asInteger(idx);
 
 	CORE_TRY
-		_Check_HIBAG_Model(midx);
-		CAttrBag_Model *AB = _HIBAG_MODELS_[midx];
+		CAttrBag_Model *AB = _Get_HIBAG_Model(model);
 
 		const CAttrBag_Classifier &Voter = AB->ClassifierList()[cidx - 1];
 		const size_t nHaplo = Voter.nHaplo();
@@ -863,91 +1279,25 @@ SEXP HIBAG_ConvBED(SEXP bedfn, SEXP n_samp, SEXP n_snp, SEXP n_save_snp,
 	const int *pflag   = LOGICAL(snp_flag);
 
 	CORE_TRY
-		// open file
-		ifstream file(fn, ios::binary);
-		if (!file.good())
-			throw ErrHLA("Fail to open the file \"%s\".", fn);
-
-		// read prefix
-		char prefix[3];
-		file.read(prefix, 3);
-		if ((prefix[0] != 0x6C) || (prefix[1] != 0x1B))
-			throw ErrHLA("Invalid prefix in the PLINK BED file.");
-		int mode = prefix[2];
-
-		// determine the values of packed genotypes
-		int nRe, nPack, nNumPack, nNum;
-		if (mode == 0)
+		// the selected SNPs
+		vector<int> snp_idx;
+		snp_idx.reserve(NumSvSNP);
+		for (int j=0; j < NumSNP; j++)
 		{
-			// the individual-major mode
-			nRe = NumSNP % 4;
-			nNumPack = NumSNP / 4;
-			nPack = (nRe > 0) ? (nNumPack + 1) : nNumPack;
-			nNum = NumSamp;
-		} else {
-			// the SNP-major mode
-			nRe = NumSamp % 4;
-			nNumPack = NumSamp / 4;
-			nPack = (nRe > 0) ? (nNumPack + 1) : nNumPack;
-			nNum = NumSNP;
+			if (pflag[j])
+				snp_idx.push_back(j);
 		}
+		if ((int)snp_idx.size() != NumSvSNP)
+			throw ErrHLA("Invalid number of selected SNPs.");
 
-		vector<char> srcgeno(nPack);
-		vector<int> dstgeno((nNumPack+1) * 4);
-		static const int cvt[4] = { 2, NA_INTEGER, 1, 0 };
-		int I_SNP = 0;
+		// open file
+		CBEDGenoReader reader;
+		reader.Open(fn, NumSamp, NumSNP, NumSvSNP,
+			snp_idx.empty() ? NULL : &snp_idx[0], NULL);
 
-		// output
+		// output, one sample after another
 		rv_ans = allocMatrix(INTSXP, NumSvSNP, NumSamp);
-
-		// for - loop
-		for (int i=0; i < nNum; i++)
-		{
-			// read genotypes
-			file.read(&srcgeno[0], nPack);
-			// unpacked
-			int *p = &dstgeno[0];
-			for (int k=0; k < nNumPack; k++)
-			{
-				unsigned char g = srcgeno[k];
-				*p++ = cvt[g & 0x03]; g >>= 2;
-				*p++ = cvt[g & 0x03]; g >>= 2;
-				*p++ = cvt[g & 0x03]; g >>= 2;
-				*p++ = cvt[g & 0x03];
-			}
-			if (nRe > 0)
-			{
-				unsigned char g = srcgeno[nNumPack];
-				for (long k=0; k < nRe; k++)
-				{
-					*p++ = cvt[g & 0x03]; g >>= 2;
-				}
-			}
-
-			// write
-			if (mode == 0)
-			{
-				// the individual-major mode
-				int *pI = INTEGER(rv_ans) + i * NumSvSNP;
-				for (int j=0; j < NumSNP; j++)
-				{
-					if (pflag[j])
-						*pI++ = dstgeno[j];
-				}
-			} else {
-				// the SNP-major mode
-				if (pflag[i])
-				{
-					int *pI = INTEGER(rv_ans) + I_SNP;
-					I_SNP ++;
-					for (int j=0; j < NumSamp; j++)
-					{
-						*pI = dstgeno[j];
-						pI += NumSvSNP;
-					}
-				}
-			}
-		}
+		reader.Read(INTEGER(rv_ans), NumSamp);
 
 	CORE_CATCH
 }
@@ -1094,6 +1444,67 @@ SEXP HIBAG_Distance(SEXP NumHLA, SEXP Idx, SEXP Freq, SEXP HaploStr)
 }
 
 
+/**
+ *  Enable or disable the profiling counters, and get the counters
+ *
+ *  \param enable     TRUE or FALSE to set, NA to keep the current state
+ *  \param reset      whether to reset the counters to zero
+**/
+SEXP HIBAG_Profile(SEXP enable, SEXP reset)
+{
+	const int en = Rf_asLogical(enable);
+	const int rs = Rf_asLogical(reset);
+
+	CORE_TRY
+		if (rs == TRUE) ProfileReset();
+		if (en != NA_LOGICAL) Profile_Enabled = (en == TRUE);
+
+		TProfileStat st;
+		ProfileGet(st);
+		rv_ans = PROTECT(NEW_LIST(5));
+		SET_ELEMENT(rv_ans, 0, ScalarLogical(Profile_Enabled ? TRUE : FALSE));
+		SEXP n_call = PROTECT(NEW_NUMERIC(PROF_NUM_PHASE));
+		SET_ELEMENT(rv_ans, 1, n_call);
+		SEXP wall = PROTECT(NEW_NUMERIC(PROF_NUM_PHASE));
+		SET_ELEMENT(rv_ans, 2, wall);
+		SEXP cpu = PROTECT(NEW_NUMERIC(PROF_NUM_PHASE));
+		SET_ELEMENT(rv_ans, 3, cpu);
+		for (int i=0; i < PROF_NUM_PHASE; i++)
+		{
+			REAL(n_call)[i] = st.NumCall[i];
+			REAL(wall)[i] = st.WallTime[i];
+			REAL(cpu)[i] = st.CPUTime[i];
+		}
+		SEXP event = PROTECT(NEW_NUMERIC(PROF_NUM_EVENT));
+		SET_ELEMENT(rv_ans, 4, event);
+		for (int i=0; i < PROF_NUM_EVENT; i++)
+			REAL(event)[i] = st.Event[i];
+		UNPROTECT(5);
+	CORE_CATCH
+}
+
+
+/**
+ *  Set the memory limit of the prediction caches, and get the previous limit
+ *
+ *  \param max_memory the number of bytes (0 to disable), NA to keep it
+**/
+SEXP HIBAG_PredCache(SEXP max_memory)
+{
+	const double m = Rf_asReal(max_memory);
+
+	CORE_TRY
+		rv_ans = ScalarReal((double)PredCache_MaxMemory);
+		if (R_finite(m))
+		{
+			if (m < 0)
+				throw ErrHLA("Invalid memory limit of the prediction caches.");
+			PredCache_MaxMemory = (size_t)m;
+		}
+	CORE_CATCH
+}
+
+
 /**
  *  Get an error message
 **/
@@ -1155,6 +1566,8 @@ void R_init_HIBAG(DllInfo *info)
 	{
 		CALL(HIBAG_AlleleStrand, 8),
 		CALL(HIBAG_AlleleStrand2, 2),
+		CALL(HIBAG_AppendCheckpoint, 2),
+		CALL(HIBAG_BEDAlleleFreq, 4),
 		CALL(HIBAG_BEDFlag, 1),
 		CALL(HIBAG_GetNumClassifiers, 1),
 		CALL(HIBAG_Classifier_GetHaplos, 2),
@@ -1164,12 +1577,21 @@ void R_init_HIBAG(DllInfo *info)
 		CALL(HIBAG_Distance, 4),
 		CALL(HIBAG_ErrMsg, 0),
 		CALL(HIBAG_Kernel_Version, 0),
+		CALL(HIBAG_LoadBinary, 1),
+		CALL(HIBAG_LoadTraining, 1),
 		CALL(HIBAG_New, 3),
 		CALL(HIBAG_NewClassifierHaplo, 7),
-		CALL(HIBAG_NewClassifiers, 7),
-		CALL(HIBAG_Predict_Resp, 6),
-		CALL(HIBAG_Predict_Resp_Prob, 6),
+		CALL(HIBAG_NewClassifiers, 12),
+		CALL(HIBAG_OpenCheckpoint, 7),
+		CALL(HIBAG_Predict_Resp, 7),
+		CALL(HIBAG_Predict_Resp_Prob, 7),
+		CALL(HIBAG_Predict_Resp_SpProb, 9),
+		CALL(HIBAG_Predict_BED, 13),
+		CALL(HIBAG_PredCache, 1),
+		CALL(HIBAG_Profile, 2),
 		CALL(HIBAG_Training, 6),
+		CALL(HIBAG_SaveBinary, 3),
+		CALL(HIBAG_SaveTraining, 2),
 		CALL(HIBAG_SortAlleleStr, 1),
 		CALL(HIBAG_SeqMerge, 1),
 		CALL(HIBAG_SeqRmDot, 2),
@@ -1178,8 +1600,6 @@ void R_init_HIBAG(DllInfo *info)
 	};
 
 	R_registerRoutines(info, NULL, callMethods, NULL, NULL);
-
-	memset((void*)_HIBAG_MODELS_, 0, sizeof(_HIBAG_MODELS_));
 }
 
 /// Finalize the package
@@ -1187,16 +1607,10 @@ void R_unload_HIBAG(DllInfo *info)
 {
 	try
 	{
-		for (int i=0; i < MODEL_NUM_LIMIT; i++)
+		while (!_HIBAG_MODELS_.empty())
 		{
-			CAttrBag_Model *m = _HIBAG_MODELS_[i];
-			try
-			{
-				if (m != NULL)
-				{
-					_HIBAG_MODELS_[i] = NULL;
-					delete m;
-				}
+			try {
+				_HIBAG_Model_Release(*_HIBAG_MODELS_.begin());
 			} catch(...) {}
 		}
 	} catch(...) {}
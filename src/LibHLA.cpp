@@ -26,14 +26,26 @@
 // ===============================================================
 
 
-#include "LibHLA.h"
+// memory-mapped files, included before R headers
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   define NOMINMAX
+#   include <windows.h>
+#else
+// 64-bit file offsets (off_t) for the files over 2GB
+#   ifndef _FILE_OFFSET_BITS
+#       define _FILE_OFFSET_BITS 64
+#   endif
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
 
-// disable timing
-// #define HIBAG_ENABLE_TIMING
+#include "LibHLA.h"
 
-#ifdef HIBAG_ENABLE_TIMING
-#   include <time.h>
-#endif
+#include <time.h>
+#include <limits>
 
 
 using namespace std;
@@ -42,34 +54,139 @@ using namespace HLA_LIB;
 
 
 // ========================================================================= //
+// Profiling counters
 
-#ifdef HIBAG_ENABLE_TIMING
+bool HLA_LIB::Profile_Enabled = false;
 
-static clock_t timing_array[5];
+/// the counters: the number of calls, wall and CPU nanoseconds per phase,
+//    followed by events
+static int64_t ProfileCnt[3*PROF_NUM_PHASE + PROF_NUM_EVENT];
 
-template<size_t I> struct TTiming
-{
-	clock_t start;
-	inline TTiming() { start = clock(); }
-	inline ~TTiming() { Stop(); }
-	inline void Stop() { timing_array[I] += clock() - start; }
-};
+#ifndef __GNUC__
+static CMutex ProfileMutex;
+#endif
 
-#define HIBAG_TIMING(i)    TTiming<i> tm;
-#define TM_TOTAL      0
-#define TM_ACC_OOB    1
-#define TM_ACC_IB     2
-#define TM_PRE_HAPLO  3
-#define TM_EM_ALG     4
+/// add to a counter atomically, return the old value
+static inline int64_t ProfileFetchAdd(int i, int64_t v)
+{
+#ifdef __GNUC__
+	return __sync_fetch_and_add(&ProfileCnt[i], v);
+#else
+	ProfileMutex.Lock();
+	int64_t rv = ProfileCnt[i];
+	ProfileCnt[i] += v;
+	ProfileMutex.Unlock();
+	return rv;
+#endif
+}
 
-// _OutOfBagAccuracy: 41.00%
-// _InBagLogLik: 54.58%
-//  PrepareHaplotypes: 0.34%
-//  ExpectationMaximization: 3.30%
+/// the wall-clock time in nanoseconds
+static int64_t ProfileWallTime()
+{
+#ifdef _WIN32
+	LARGE_INTEGER c, f;
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return (int64_t)(c.QuadPart * (1e9 / f.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
+/// the CPU time in nanoseconds of the calling thread, or the process if
+//    'process' is true (for the phases waiting for worker threads)
+static int64_t ProfileCPUTime(bool process)
+{
+#if defined(_WIN32)
+	FILETIME t0, t1, tk, tu;
+	if (process)
+		GetProcessTimes(GetCurrentProcess(), &t0, &t1, &tk, &tu);
+	else
+		GetThreadTimes(GetCurrentThread(), &t0, &t1, &tk, &tu);
+	return (((int64_t)tk.dwHighDateTime << 32) + tk.dwLowDateTime +
+		((int64_t)tu.dwHighDateTime << 32) + tu.dwLowDateTime) * 100;
+#elif defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+	clock_gettime(process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID,
+		&ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 #else
-#   define HIBAG_TIMING(i)
+	return (int64_t)(clock() * (1e9 / CLOCKS_PER_SEC));
 #endif
+}
+
+/// whether a phase runs worker threads
+static inline bool ProfileTopPhase(int phase)
+{
+	return (phase == PROF_TRAIN) || (phase == PROF_PREDICT);
+}
+
+void HLA_LIB::ProfileReset()
+{
+	for (size_t i=0; i < sizeof(ProfileCnt)/sizeof(int64_t); i++)
+		ProfileFetchAdd(i, -ProfileFetchAdd(i, 0));
+}
+
+void HLA_LIB::ProfileGet(TProfileStat &Out)
+{
+	for (int i=0; i < PROF_NUM_PHASE; i++)
+	{
+		Out.NumCall[i] = ProfileFetchAdd(i, 0);
+		Out.WallTime[i] = ProfileFetchAdd(PROF_NUM_PHASE + i, 0) * 1e-9;
+		Out.CPUTime[i] = ProfileFetchAdd(2*PROF_NUM_PHASE + i, 0) * 1e-9;
+	}
+	for (int i=0; i < PROF_NUM_EVENT; i++)
+		Out.Event[i] = ProfileFetchAdd(3*PROF_NUM_PHASE + i, 0);
+}
+
+void HLA_LIB::ProfileAdd(TProfileEvent Event, int64_t Value)
+{
+	ProfileFetchAdd(3*PROF_NUM_PHASE + Event, Value);
+}
+
+CProfileTiming::CProfileTiming(TProfilePhase phase)
+{
+	if (Profile_Enabled)
+	{
+		_Phase = phase;
+		_Wall = ProfileWallTime();
+		_CPU = ProfileCPUTime(ProfileTopPhase(phase));
+	} else
+		_Phase = -1;
+}
+
+CProfileTiming::~CProfileTiming()
+{
+	if (_Phase >= 0)
+	{
+		ProfileFetchAdd(_Phase, 1);
+		ProfileFetchAdd(PROF_NUM_PHASE + _Phase, ProfileWallTime() - _Wall);
+		ProfileFetchAdd(2*PROF_NUM_PHASE + _Phase, ProfileCPUTime(ProfileTopPhase(_Phase)) - _CPU);
+	}
+}
+
+#define HIBAG_PROFILE(phase)    CProfileTiming prof_timing(phase);
+
+/// count the haplotype pairs enumerated, and the Hamming distances computed
+//    if 'ham_dist' is true
+static inline void ProfilePairs(int64_t n_pair, bool ham_dist)
+{
+	if (Profile_Enabled)
+	{
+		ProfileAdd(PROF_HAPLO_PAIR, n_pair);
+		if (ham_dist) ProfileAdd(PROF_HAMMING_DIST, n_pair);
+	}
+}
+
+/// add the bytes of the growth of a vector capacity
+template<typename T>
+static inline void ProfileAllocVec(const vector<T> &v, size_t old_capacity)
+{
+	if (Profile_Enabled && (v.capacity() > old_capacity))
+		ProfileAdd(PROF_ALLOC_BYTES, (v.capacity() - old_capacity)*sizeof(T));
+}
 
 
 
@@ -83,6 +200,10 @@ int HLA_LIB::EM_MaxNum_Iterations = 500;
 static const double EM_INIT_VAL_FRAC = 0.001;
 /// the reltol convergence tolerance, sqrt(machine.epsilon) by default, used in EM algorithm
 double HLA_LIB::EM_FuncRelTol = sqrt(DBL_EPSILON);
+/// whether to use the SQUAREM extrapolation to accelerate EM algorithm
+bool HLA_LIB::EM_Accelerate = false;
+/// the successive-halving racing of candidate SNPs, disabled by default
+TSearchRacing HLA_LIB::Search_Racing = { false, 0.125, 1.0/3, 1e-4 };
 
 
 // Parameters -- reduce the number of possible haplotypes
@@ -99,6 +220,18 @@ static const double FRACTION_HAPLO = 1.0/10;
 static const double STOP_RELTOL_LOGLIK_ADDSNP = 0.001;
 /// the reltol for erasing the SNP marker is prune = TRUE
 static const double PRUNE_RELTOL_LOGLIK = 0.1;
+/// the min number of candidate SNPs in a step to race them
+static const int RACE_MIN_CANDIDATE = 4;
+/// the min number of out-of-bag samples in a racing round
+static const int RACE_MIN_SAMP = 16;
+/// the max number of bytes used by the distances of parent haplotype pairs
+size_t HLA_LIB::ParentDist_MaxMemory = 64 * 1024 * 1024;
+
+
+// Parameters -- prediction
+
+/// the max number of bytes used by the cached posterior probabilities
+size_t HLA_LIB::PredCache_MaxMemory = 256 * 1024 * 1024;
 
 
 /// Random number: return an integer from 0 to n-1 with equal probability
@@ -110,6 +243,42 @@ static inline int RandomNum(int n)
 	return v;
 }
 
+/// Random number from a stream, or from R's RNG if 'rand' is NULL
+static inline int RandomNum(int n, TRandomStream *rand)
+{
+	if (!rand) return RandomNum(n);
+	int v = (int)(n * rand->Unif());
+	if (v >= n) v = n - 1;
+	return v;
+}
+
+/// A 64-bit random seed from a stream, or from R's RNG if 'rand' is NULL
+static uint64_t RandomSeed(TRandomStream *rand)
+{
+	const double hi = rand ? rand->Unif() : unif_rand();
+	const double lo = rand ? rand->Unif() : unif_rand();
+	return (uint64_t(hi * 4294967296.0) << 32) | uint64_t(lo * 4294967296.0);
+}
+
+/// A bootstrap sample of the counts 'S', with at least one out-of-bag sample
+static void RandomBootstrap(vector<int> &S, TRandomStream *rand)
+{
+	const int n = S.size();
+	int n_unique;
+	do {
+		// initialize S
+		for (int i=0; i < n; i++) S[i] = 0;
+		n_unique = 0;
+
+		for (int i=0; i < n; i++)
+		{
+			int k = RandomNum(n, rand);
+			if (S[k] == 0) n_unique ++;
+			S[k] ++;
+		}
+	} while (n_unique >= n); // to avoid the case of no out-of-bag individuals
+}
+
 
 
 // ========================================================================= //
@@ -140,6 +309,42 @@ public:
 static CInit _Init;
 
 
+#ifdef HIBAG_STANDALONE
+
+static double Default_UnifRand()
+{
+	static TRandomStream rs;
+	static bool seeded = false;
+	if (!seeded) { rs.Seed(0); seeded = true; }
+	return rs.Unif();
+}
+
+static void Default_Print(const char *msg)
+{
+	fputs(msg, stdout);
+	fflush(stdout);
+}
+
+THostHooks HLA_LIB::HostHooks = { Default_UnifRand, Default_Print };
+
+void Rprintf(const char *fmt, ...)
+{
+	char buf[4096];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	(*HostHooks.Print)(buf);
+}
+
+double unif_rand()
+{
+	return (*HostHooks.UnifRand)();
+}
+
+#endif
+
+
 // GPU extensible component
 TypeGPUExtProc *HLA_LIB::GPUExtProcPtr = NULL;;
 
@@ -206,6 +411,206 @@ CdProgression HLA_LIB::Progress;
 
 
 
+// ========================================================================= //
+// Multithreading
+
+CMutex::CMutex()
+{
+	pthread_mutex_init(&_mutex, NULL);
+}
+
+CMutex::~CMutex()
+{
+	pthread_mutex_destroy(&_mutex);
+}
+
+
+CThreadPool::CThreadPool()
+{
+	pthread_cond_init(&_CondTask, NULL);
+	pthread_cond_init(&_CondDone, NULL);
+	_Job = NULL;
+	_NumTask = _NextTask = _NumRunning = 0;
+	_HasError = _Stop = false;
+}
+
+CThreadPool::~CThreadPool()
+{
+	_StopThreads();
+	pthread_cond_destroy(&_CondTask);
+	pthread_cond_destroy(&_CondDone);
+}
+
+void CThreadPool::SetNumThread(int n)
+{
+	if (n <= 1) n = 0;
+	if (n == (int)_Threads.size()) return;
+	_StopThreads();
+
+	_Stop = false;
+	for (int i=0; i < n; i++)
+	{
+		pthread_t th;
+		void **param = new void*[2];
+		param[0] = this;
+		param[1] = (void*)(size_t)i;
+		if (pthread_create(&th, NULL, _ThreadEntry, param) != 0)
+		{
+			delete[] param;
+			_StopThreads();
+			throw ErrHLA("Fails to create a new thread.");
+		}
+		_Threads.push_back(th);
+	}
+}
+
+void CThreadPool::Run(CParallelJob &job, int n)
+{
+	if (n <= 0) return;
+	if (_Threads.empty())
+	{
+		// no worker thread
+		for (int i=0; i < n; i++)
+		{
+			job.Run(i, 0);
+			job.Done(i);
+		}
+		return;
+	}
+
+	// start the tasks
+	_Mutex.Lock();
+	_Job = &job;
+	_NumTask = n; _NextTask = 0; _NumRunning = 0;
+	_Finished.clear();
+	_HasError = false; _ErrMsg.clear();
+	pthread_cond_broadcast(&_CondTask);
+
+	// wait for all tasks, and call Done() in the calling thread
+	vector<int> done;
+	while (true)
+	{
+		while (_Finished.empty() &&
+				(_NextTask < _NumTask || _NumRunning > 0))
+			pthread_cond_wait(&_CondDone, &_Mutex._mutex);
+		done.swap(_Finished);
+		bool finish = (_NextTask >= _NumTask) && (_NumRunning == 0);
+		bool has_error = _HasError;
+		_Mutex.Unlock();
+
+		if (!has_error)
+		{
+			for (size_t i=0; i < done.size(); i++)
+				job.Done(done[i]);
+		}
+		done.clear();
+		if (finish) break;
+		_Mutex.Lock();
+	}
+
+	_Mutex.Lock();
+	_Job = NULL;
+	_NumTask = _NextTask = 0;
+	bool has_error = _HasError;
+	string msg = _ErrMsg;
+	_Mutex.Unlock();
+
+	if (has_error) throw ErrHLA(msg);
+}
+
+void CThreadPool::_StopThreads()
+{
+	if (_Threads.empty()) return;
+	_Mutex.Lock();
+	_Stop = true;
+	pthread_cond_broadcast(&_CondTask);
+	_Mutex.Unlock();
+	for (size_t i=0; i < _Threads.size(); i++)
+		pthread_join(_Threads[i], NULL);
+	_Threads.clear();
+	_Stop = false;
+}
+
+void CThreadPool::_WorkerLoop(int thread_idx)
+{
+	_Mutex.Lock();
+	while (true)
+	{
+		while (!_Stop && (_NextTask >= _NumTask))
+			pthread_cond_wait(&_CondTask, &_Mutex._mutex);
+		if (_Stop) break;
+
+		// get a task
+		const int idx = _NextTask ++;
+		CParallelJob *job = _Job;
+		_NumRunning ++;
+		_Mutex.Unlock();
+
+		string msg;
+		bool has_error = false;
+		try {
+			job->Run(idx, thread_idx);
+		}
+		catch (exception &E) {
+			msg = E.what(); has_error = true;
+		}
+		catch (const char *E) {
+			msg = E; has_error = true;
+		}
+		catch (...) {
+			msg = "unknown error!"; has_error = true;
+		}
+
+		_Mutex.Lock();
+		_NumRunning --;
+		if (has_error)
+		{
+			if (!_HasError)
+				{ _HasError = true; _ErrMsg = msg; }
+			_NextTask = _NumTask;  // skip the remaining tasks
+		} else
+			_Finished.push_back(idx);
+		pthread_cond_signal(&_CondDone);
+	}
+	_Mutex.Unlock();
+}
+
+void *CThreadPool::_ThreadEntry(void *param)
+{
+	void **p = (void**)param;
+	CThreadPool *pool = (CThreadPool*)p[0];
+	int thread_idx = (int)(size_t)p[1];
+	delete[] p;
+	pool->_WorkerLoop(thread_idx);
+	return NULL;
+}
+
+
+void TRandomStream::Seed(uint64_t seed)
+{
+	// splitmix64 to initialize the state
+	for (int i=0; i < 2; i++)
+	{
+		uint64_t z = (seed += 0x9E3779B97F4A7C15LLU);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9LLU;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBLLU;
+		State[i] = z ^ (z >> 31);
+	}
+}
+
+double TRandomStream::Unif()
+{
+	uint64_t s1 = State[0];
+	const uint64_t s0 = State[1];
+	State[0] = s0;
+	s1 ^= s1 << 23;
+	State[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+	// 53-bit precision
+	return ((State[1] + s0) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+
 // ========================================================================= //
 // Packed bi-allelic SNP haplotype structure: 8 alleles in a byte
 
@@ -322,6 +727,7 @@ void CHaplotypeList::alloc_mem(size_t num)
 	base_ptr = realloc(base_ptr, size);
 	if (base_ptr == NULL)
 		throw ErrHLA("Fails to allocate memory.");
+	if (Profile_Enabled) ProfileAdd(PROF_ALLOC_BYTES, size);
 	UINT8 *p = (UINT8 *)base_ptr;
 	size_t r = (size_t)p & 0x1F;
 	if (r > 0) p += 32 - r;
@@ -339,6 +745,15 @@ CHaplotypeList& CHaplotypeList::operator= (const CHaplotypeList &src)
 
 void CHaplotypeList::ResizeHaplo(size_t num)
 {
+	if (!base_ptr && List)
+	{
+		// detach from the external storage
+		const THaplotype *p = List;
+		alloc_mem(reserve_size = num);
+		memmove(List, p, sizeof(THaplotype)*std::min(Num_Haplo, num));
+		Num_Haplo = num;
+		return;
+	}
 	if (Num_Haplo != num)
 	{
 		Num_Haplo = num;
@@ -347,6 +762,15 @@ void CHaplotypeList::ResizeHaplo(size_t num)
 	}
 }
 
+void CHaplotypeList::AssignExternal(THaplotype *ptr, size_t num)
+{
+	if (base_ptr) free(base_ptr);
+	base_ptr = NULL;
+	reserve_size = 0;
+	List = ptr;
+	Num_Haplo = num;
+}
+
 void CHaplotypeList::DoubleHaplos(CHaplotypeList &OutHaplos) const
 {
 	HIBAG_CHECKING(Num_SNP >= HIBAG_MAXNUM_SNP_IN_CLASSIFIER,
@@ -392,8 +816,22 @@ void CHaplotypeList::DoubleHaplosInitFreq(CHaplotypeList &OutHaplos,
 	}
 }
 
-void CHaplotypeList::EraseDoubleHaplos(double RareProb, CHaplotypeList &OutHaplos) const
+void CHaplotypeList::EraseDoubleHaplos(double RareProb,
+	CHaplotypeList &OutHaplos) const
+{
+	_EraseDoubleHaplos(RareProb, OutHaplos, NULL);
+}
+
+void CHaplotypeList::EraseDoubleHaplos(double RareProb,
+	CHaplotypeList &OutHaplos, vector<int> &OutSrcIdx) const
+{
+	_EraseDoubleHaplos(RareProb, OutHaplos, &OutSrcIdx);
+}
+
+void CHaplotypeList::_EraseDoubleHaplos(double RareProb,
+	CHaplotypeList &OutHaplos, vector<int> *OutSrcIdx) const
 {
+	HIBAG_PROFILE(PROF_ERASE_HAPLO)
 	// count the number of haplotypes after filtering rare haplotypes
 	size_t num = 0;
 	const THaplotype *p = List;
@@ -412,32 +850,39 @@ void CHaplotypeList::EraseDoubleHaplos(double RareProb, CHaplotypeList &OutHaplo
 	OutHaplos.Num_SNP = Num_SNP;
 	OutHaplos.ResizeHaplo(num);
 	OutHaplos.LenPerHLA.resize(LenPerHLA.size());
+	int *pIdx = NULL;
+	if (OutSrcIdx)
+	{
+		OutSrcIdx->resize(num);
+		if (num > 0) pIdx = &(*OutSrcIdx)[0];
+	}
 
 	// assign haplotypes
 	p = List;
 	THaplotype *pOut = OutHaplos.List;
 	double sum = 0;
+	int idx = 0;
 	for (size_t i=0; i < LenPerHLA.size(); i++)
 	{
 		num = 0;
-		for (size_t n=LenPerHLA[i]; n > 0; n-=2, p+=2)
+		for (size_t n=LenPerHLA[i]; n > 0; n-=2, p+=2, idx+=2)
 		{
 			double sumfreq = p[0].Freq + p[1].Freq;
 			if ((p[0].Freq < RareProb) || (p[1].Freq < RareProb))
 			{
 				if (sumfreq >= MIN_RARE_FREQ)
 				{
-					if (p[0].Freq >= p[1].Freq)
-						*pOut = p[0];
-					else
-						*pOut = p[1];
+					int k = (p[0].Freq >= p[1].Freq) ? 0 : 1;
+					*pOut = p[k];
 					pOut->Freq = sumfreq; pOut ++;
+					if (pIdx) *pIdx++ = idx + k;
 					sum += sumfreq;
 					num ++;
 				}
 			} else {
 				*pOut++ = p[0];
 				*pOut++ = p[1];
+				if (pIdx) { *pIdx++ = idx; *pIdx++ = idx + 1; }
 				sum += sumfreq;
 				num += 2;
 			}
@@ -801,18 +1246,67 @@ inline int TGenotype::_HamDist(size_t Length,
 
 CSNPGenoMatrix::CSNPGenoMatrix()
 {
-	Num_Total_SNP = Num_Total_Samp = 0;
-	pGeno = NULL;
+	Num_Total_SNP = Num_Total_Samp = Num_Packed_Word = 0;
+	Packed = NULL;
+}
+
+void CSNPGenoMatrix::Init(int n_snp, int n_samp, const int *geno)
+{
+	Num_Total_SNP = n_snp;
+	Num_Total_Samp = n_samp;
+	Num_Packed_Word = (n_samp + 31) / 32;
+	PackedBuf.clear();
+	Packed = NULL;
+	if (!geno) return;
+
+	// transpose, reading the genotypes sequentially
+	PackedBuf.assign(size_t(n_snp) * Num_Packed_Word, 0);
+	if (!PackedBuf.empty()) Packed = &PackedBuf[0];
+	for (int i=0; i < n_samp; i++)
+	{
+		uint64_t *p = &PackedBuf[i >> 5];
+		const int shift = (i & 0x1F) << 1;
+		for (int j=0; j < n_snp; j++, p += Num_Packed_Word)
+		{
+			const int g = *geno++;
+			*p |= uint64_t(((0 <= g) && (g <= 2)) ? g : 3) << shift;
+		}
+	}
 }
 
-const int CSNPGenoMatrix::Get(const int IdxSamp, const int IdxSNP) const
+void CSNPGenoMatrix::InitPacked(int n_snp, int n_samp,
+	const uint64_t *packed)
 {
-	return pGeno[IdxSamp*Num_Total_SNP + IdxSNP];
+	Num_Total_SNP = n_snp;
+	Num_Total_Samp = n_samp;
+	Num_Packed_Word = (n_samp + 31) / 32;
+	PackedBuf.clear();
+	Packed = packed;
 }
 
-int *CSNPGenoMatrix::Get(const int IdxSamp)
+void CSNPGenoMatrix::AlleleCount(const int BootstrapCnt[],
+	vector<TSNPAlleleCnt> &Out) const
 {
-	return pGeno + IdxSamp * Num_Total_SNP;
+	Out.resize(Num_Total_SNP);
+	for (int j=0; j < Num_Total_SNP; j++)
+	{
+		const uint64_t *p = PackedSNP(j);
+		int allele = 0, valid = 0;
+		for (int i=0; i < Num_Total_Samp; i += 32)
+		{
+			const int *cnt = BootstrapCnt + i;
+			const int m = std::min(32, Num_Total_Samp - i);
+			uint64_t w = *p++;
+			for (int k=0; k < m; k++, w >>= 2)
+			{
+				const int g = int(w & 0x03);
+				if (g < 3)
+					{ allele += g*cnt[k]; valid += 2*cnt[k]; }
+			}
+		}
+		Out[j].Allele = allele;
+		Out[j].Valid = valid;
+	}
 }
 
 
@@ -831,12 +1325,16 @@ void CGenotypeList::AddSNP(int IdxSNP, const CSNPGenoMatrix &SNPMat)
 	HIBAG_CHECKING(Num_SNP >= HIBAG_MAXNUM_SNP_IN_CLASSIFIER,
 		"CGenotypeList::AddSNP, there are too many SNP markers.");
 	
-	const int *pG = SNPMat.pGeno + IdxSNP;
-	for (int i=0; i < SNPMat.Num_Total_Samp; i++)
+	// 32 samples per word, and the missing genotype (3) is set by _SetSNP()
+	const uint64_t *pG = SNPMat.PackedSNP(IdxSNP);
+	const int n = SNPMat.Num_Total_Samp;
+	for (int i=0; i < n; i += 32)
 	{
-		int g = *pG;
-		pG += SNPMat.Num_Total_SNP;
-		List[i]._SetSNP(Num_SNP, g);
+		TGenotype *p = &List[i];
+		const int m = std::min(32, n - i);
+		uint64_t w = *pG++;
+		for (int k=0; k < m; k++, w >>= 2)
+			p[k]._SetSNP(Num_SNP, int(w & 0x03));
 	}
 	Num_SNP ++;
 }
@@ -906,11 +1404,13 @@ inline int CHLATypeList::Compare(const THLAType &H1, const THLAType &H2)
 CSamplingWithoutReplace::CSamplingWithoutReplace()
 {
 	_m_try = 0;
+	_Rand = NULL;
 }
 
-CBaseSampling *CSamplingWithoutReplace::Init(int m_total)
+CBaseSampling *CSamplingWithoutReplace::Init(int m_total, TRandomStream *rand)
 {
 	_m_try = 0;
+	_Rand = rand;
 	_IdxArray.resize(m_total);
 	for (int i=0; i < m_total; i++)
 		_IdxArray[i] = i;
@@ -930,7 +1430,7 @@ void CSamplingWithoutReplace::RandomSelect(int m_try)
 	{
 		for (int i=0; i < m_try; i++)
 		{
-			int I = RandomNum(n_tmp - i);
+			int I = RandomNum(n_tmp - i, _Rand);
 			std::swap(_IdxArray[I], _IdxArray[n_tmp-i-1]);
 		}
 	}
@@ -973,21 +1473,35 @@ int &CSamplingWithoutReplace::operator[] (int idx)
 // -------------------------------------------------------------------------
 // The class of SNP genotype list
 
-CAlg_EM::CAlg_EM() {}
+CAlg_EM::CAlg_EM()
+{
+	_NumCall = _NumIter = 0;
+}
 
 void CAlg_EM::PrepareHaplotypes(const CHaplotypeList &CurHaplo,
 	const CGenotypeList &GenoList, const CHLATypeList &HLAList,
 	CHaplotypeList &NextHaplo)
 {
-	HIBAG_TIMING(TM_PRE_HAPLO)
+	HIBAG_PROFILE(PROF_PRE_HAPLO)
 	HIBAG_CHECKING(GenoList.nSamp() != HLAList.nSamp(),
 		"CAlg_EM::PrepareHaplotypes, GenoList and HLAList should have the same number of samples.");
 
-	_SampHaploPair.clear();
-	_SampHaploPair.reserve(GenoList.nSamp());
+	_SampBootstrap.clear();
+	_SampIndex.clear();
+	_SampPairStart.clear();
+	_PairH1.clear();
+	_PairH2.clear();
+	const size_t old_cap = _PairH1.capacity() + _PairH2.capacity();
+	const size_t old_cap2 = _PairFlag.capacity() + _PairFreq.capacity();
 	CurHaplo.DoubleHaplos(NextHaplo);
+	int64_t n_dist = 0;
 
-	vector<int> DiffList(GenoList.nSamp()*(2*GenoList.nSamp() + 1));
+	// the start of each HLA allele in NextHaplo
+	const size_t nhla = NextHaplo.nHLA();
+	vector<size_t> HLAStart(nhla + 1);
+	HLAStart[0] = 0;
+	for (size_t i=0; i < nhla; i++)
+		HLAStart[i+1] = HLAStart[i] + NextHaplo.LenPerHLA[i];
 
 	// get haplotype pairs for each sample
 	for (int iSamp=0; iSamp < GenoList.nSamp(); iSamp++)
@@ -997,108 +1511,86 @@ void CAlg_EM::PrepareHaplotypes(const CHaplotypeList &CurHaplo,
 
 		if (pG.BootstrapCount > 0)
 		{
-			_SampHaploPair.push_back(THaploPairList());
-			THaploPairList &HP = _SampHaploPair.back();
-			HP.BootstrapCount = pG.BootstrapCount;
-			HP.SampIndex = iSamp;
+			const size_t start = _PairH1.size();
+			_SampBootstrap.push_back(pG.BootstrapCount);
+			_SampIndex.push_back(iSamp);
+			_SampPairStart.push_back(start);
 
-			size_t pH1_st = NextHaplo.StartHaploHLA(pHLA.Allele1);
+			size_t pH1_st = HLAStart[pHLA.Allele1];
 			size_t pH1_n  = NextHaplo.LenPerHLA[pHLA.Allele1];
-			size_t pH2_st = NextHaplo.StartHaploHLA(pHLA.Allele2);
+			size_t pH2_st = HLAStart[pHLA.Allele2];
 			size_t pH2_n  = NextHaplo.LenPerHLA[pHLA.Allele2];
-			THaplotype *p1, *p2;
+			const bool diag = (pHLA.Allele1 == pHLA.Allele2);
 			int MinDiff = GenoList.Num_SNP * 4;
+			n_dist += diag ? pH1_n*(pH1_n+1)/2 : pH1_n*pH2_n;
 
-			if (pHLA.Allele1 != pHLA.Allele2)
+			// keep the pairs with the minimum distance in a single pass
+			const THaplotype *p1 = &NextHaplo.List[pH1_st];
+			for (size_t i1=pH1_st; i1 < pH1_st+pH1_n; i1++, p1++)
 			{
-				const size_t m = pH1_n * pH2_n;
-				if (m > DiffList.size()) DiffList.resize(m);
-				int *pD = &DiffList[0];
-
-				p1 = &NextHaplo.List[pH1_st];
-				for (size_t n1=pH1_n; n1 > 0; n1--, p1++)
-				{
-					p2 = &NextHaplo.List[pH2_st];
-					for (size_t n2=pH2_n; n2 > 0; n2--, p2++)
-					{
-						int d = *pD++ = pG._HamDist(CurHaplo.Num_SNP, *p1, *p2);
-						if (d < MinDiff) MinDiff = d;
-						if (d == 0)
-							HP.PairList.push_back(THaploPair(p1, p2));
-					}
-				}
-
-				if (MinDiff > 0)
-				{
-					int *pD = &DiffList[0];
-					p1 = &NextHaplo.List[pH1_st];
-					for (size_t n1=pH1_n; n1 > 0; n1--, p1++)
-					{
-						p2 = &NextHaplo.List[pH2_st];
-						for (size_t n2=pH2_n; n2 > 0; n2--, p2++)
-						{
-							if (*pD++ == MinDiff)
-								HP.PairList.push_back(THaploPair(p1, p2));
-						}
-					}
-				}
-
-			} else {
-				const size_t m = pH1_n * (pH1_n + 1) / 2;
-				if (m > DiffList.size()) DiffList.resize(m);
-				int *pD = &DiffList[0];
-
-				p1 = &NextHaplo.List[pH1_st];
-				for (size_t n1=pH1_n; n1 > 0; n1--, p1++)
-				{
-					p2 = p1;
-					for (size_t n2=n1; n2 > 0; n2--, p2++)
-					{
-						int d = *pD++ = pG._HamDist(CurHaplo.Num_SNP, *p1, *p2);
-						if (d < MinDiff) MinDiff = d;
-						if (d == 0)
-							HP.PairList.push_back(THaploPair(p1, p2));
-					}
-				}
-
-				if (MinDiff > 0)
+				size_t i2 = diag ? i1 : pH2_st;
+				const THaplotype *p2 = &NextHaplo.List[i2];
+				for (; i2 < pH2_st+pH2_n; i2++, p2++)
 				{
-					int *pD = &DiffList[0];
-					p1 = &NextHaplo.List[pH1_st];
-					for (size_t n1=pH1_n; n1 > 0; n1--, p1++)
+					int d = pG._HamDist(CurHaplo.Num_SNP, *p1, *p2);
+					if (d < MinDiff)
 					{
-						p2 = p1;
-						for (size_t n2=n1; n2 > 0; n2--, p2++)
-						{
-							if (*pD++ == MinDiff)
-								HP.PairList.push_back(THaploPair(p1, p2));
-						}
+						MinDiff = d;
+						_PairH1.resize(start); _PairH2.resize(start);
 					}
+					if (d == MinDiff)
+						{ _PairH1.push_back(i1); _PairH2.push_back(i2); }
 				}
 			}
 		}
 	}
+
+	// all haplotype pairs exist before adding a new SNP
+	const size_t npair = _PairH1.size();
+	_SampPairStart.push_back(npair);
+	_PairFlag.assign((npair + 63) / 64, ~uint64_t(0));
+	_PairFreq.resize(npair);
+
+	if (Profile_Enabled)
+	{
+		ProfileAdd(PROF_HAPLO_PAIR, n_dist);
+		ProfileAdd(PROF_HAMMING_DIST, n_dist);
+		const size_t cap = _PairH1.capacity() + _PairH2.capacity();
+		const size_t cap2 = _PairFlag.capacity() + _PairFreq.capacity();
+		if (cap > old_cap)
+			ProfileAdd(PROF_ALLOC_BYTES, (cap - old_cap)*sizeof(int));
+		if (cap2 > old_cap2)
+			ProfileAdd(PROF_ALLOC_BYTES, (cap2 - old_cap2)*sizeof(double));
+	}
 }
 
 bool CAlg_EM::PrepareNewSNP(const int NewSNP, const CHaplotypeList &CurHaplo,
 	const CSNPGenoMatrix &SNPMat, CGenotypeList &GenoList,
-	CHaplotypeList &NextHaplo)
+	CHaplotypeList &NextHaplo, const TSNPAlleleCnt *AlleleCnt)
 {
+	HIBAG_PROFILE(PROF_NEW_SNP)
 	HIBAG_CHECKING((NewSNP<0) || (NewSNP>=SNPMat.Num_Total_SNP),
 		"CAlg_EM::PrepareNewSNP, invalid NewSNP.");
 	HIBAG_CHECKING(SNPMat.Num_Total_Samp != GenoList.nSamp(),
 		"CAlg_EM::PrepareNewSNP, SNPMat and GenoList should have the same number of SNPs.");
 
 	// compute the allele frequency of NewSNP
+	const uint64_t *pSNP = SNPMat.PackedSNP(NewSNP);
 	int allele_cnt = 0, valid_cnt = 0;
-	for (int iSamp=0; iSamp < SNPMat.Num_Total_Samp; iSamp++)
+	if (AlleleCnt)
 	{
-		int dup = GenoList.List[iSamp].BootstrapCount;
-		if (dup > 0)
+		allele_cnt = AlleleCnt->Allele;
+		valid_cnt = AlleleCnt->Valid;
+	} else {
+		for (int iSamp=0; iSamp < SNPMat.Num_Total_Samp; iSamp++)
 		{
-			int g = SNPMat.Get(iSamp, NewSNP);
-			if ((0<=g) && (g<=2))
-				{ allele_cnt += g*dup; valid_cnt += 2*dup; }
+			int dup = GenoList.List[iSamp].BootstrapCount;
+			if (dup > 0)
+			{
+				int g = CSNPGenoMatrix::PackedGet(pSNP, iSamp);
+				if (g >= 0)
+					{ allele_cnt += g*dup; valid_cnt += 2*dup; }
+			}
 		}
 	}
 	if ((allele_cnt==0) || (allele_cnt==valid_cnt)) return false;
@@ -1108,101 +1600,386 @@ bool CAlg_EM::PrepareNewSNP(const int NewSNP, const CHaplotypeList &CurHaplo,
 
 	// update haplotype pair
 	const int IdxNewSNP = NextHaplo.Num_SNP - 1;
-	vector<THaploPairList>::iterator it;
+	const THaplotype *pH = NextHaplo.List;
+	_PairFlag.assign(_PairFlag.size(), 0);
+	uint64_t *pFlag = _PairFlag.empty() ? NULL : &_PairFlag[0];
 
-	for (it = _SampHaploPair.begin(); it != _SampHaploPair.end(); it++)
+	for (size_t i=0; i < _SampBootstrap.size(); i++)
 	{
-		vector<THaploPair>::iterator p;
 		// SNP genotype
-		int geno = SNPMat.Get(it->SampIndex, NewSNP);
-		if ((0<=geno) && (geno<=2))
+		int geno = CSNPGenoMatrix::PackedGet(pSNP, _SampIndex[i]);
+		const bool valid = (geno >= 0);
+		// for -- loop
+		for (size_t k=_SampPairStart[i]; k < _SampPairStart[i+1]; k++)
 		{
-			// for -- loop
-			for (p = it->PairList.begin(); p != it->PairList.end(); p++)
+			if (!valid || ((pH[_PairH1[k]].GetAllele(IdxNewSNP) +
+				pH[_PairH2[k]].GetAllele(IdxNewSNP)) == geno))
 			{
-				p->Flag = ((p->H1->GetAllele(IdxNewSNP) +
-					p->H2->GetAllele(IdxNewSNP)) == geno);
+				pFlag[k >> 6] |= uint64_t(1) << (k & 0x3F);
 			}
-		} else {
-			// for -- loop
-			for (p = it->PairList.begin(); p != it->PairList.end(); p++)
-				p->Flag = true;
 		}
 	}
 
 	return true;
 }
 
-void CAlg_EM::ExpectationMaximization(CHaplotypeList &NextHaplo)
+void CAlg_EM::ExpectationMaximization(CHaplotypeList &NextHaplo,
+	double RelTol)
 {
-	HIBAG_TIMING(TM_EM_ALG)
+	HIBAG_PROFILE(PROF_EM_ALG)
+	_NumCall ++;
+	if (RelTol < 0) RelTol = EM_FuncRelTol;
+
+	if (EM_Accelerate)
+	{
+		const int n_iter = _AcceleratedEM(NextHaplo, RelTol);
+		_NumIter += n_iter;
+		if (Profile_Enabled) ProfileAdd(PROF_EM_ITER, n_iter);
+		return;
+	}
 
 	// the converage tolerance
 	double ConvTol = 0, LogLik = -1e+30;
+	int n_iter = 0;
 
 	// iterate ...
 	for (int iter=0; iter <= EM_MaxNum_Iterations; iter++)
 	{
-		// save old values
-		// old log likelihood
+		// save old log likelihood
 		double Old_LogLik = LogLik;
-		// save old haplotype frequencies
-		NextHaplo.SaveClearFrequency();
-
-		// for-loop each sample
-		vector<THaploPairList>::iterator s;
-		vector<THaploPair>::iterator p;
-		int TotalNumSamp = 0;
-		LogLik = 0;
-
-		for (s = _SampHaploPair.begin(); s != _SampHaploPair.end(); s++)
-		{
-			// always "s->BootstrapCount > 0"
-			TotalNumSamp += s->BootstrapCount;
-
-			double psum = 0;
-			for (p = s->PairList.begin(); p != s->PairList.end(); p++)
-			{
-				if (p->Flag)
-				{
-					p->GenoFreq = (p->H1 != p->H2) ?
-						(2 * p->H1->aux.OldFreq * p->H2->aux.OldFreq) :
-						(p->H1->aux.OldFreq * p->H2->aux.OldFreq);
-					psum += p->GenoFreq;
-				}
-			}
-			LogLik += s->BootstrapCount * log(psum);
-			psum = s->BootstrapCount / psum;
-
-			// update
-			for (p = s->PairList.begin(); p != s->PairList.end(); p++)
-			{
-				if (p->Flag)
-				{
-					double r = p->GenoFreq * psum;
-					p->H1->Freq += r; p->H2->Freq += r;
-				}
-			}
-		}
-
-		// finally
-		NextHaplo.ScaleFrequency(0.5/TotalNumSamp);
+		// update haplotype frequencies
+		LogLik = _EMStep(NextHaplo);
+		n_iter ++;
 
 		if (iter > 0)
 		{
 			if (fabs(LogLik - Old_LogLik) <= ConvTol)
 				break;
 		} else {
-			ConvTol = EM_FuncRelTol * (fabs(LogLik) + EM_FuncRelTol);
+			ConvTol = RelTol * (fabs(LogLik) + RelTol);
 			if (ConvTol < 0) ConvTol = 0;
 		}
 	}
+
+	_NumIter += n_iter;
+	if (Profile_Enabled) ProfileAdd(PROF_EM_ITER, n_iter);
 }
 
+double CAlg_EM::_EMStep(CHaplotypeList &Haplo)
+{
+	// save old haplotype frequencies
+	const size_t nHaplo = Haplo.Num_Haplo;
+	_OldFreq.resize(nHaplo);
+	_NewFreq.assign(nHaplo, 0);
+	if (nHaplo <= 0) return 0;
+	for (size_t i=0; i < nHaplo; i++)
+		_OldFreq[i] = Haplo.List[i].Freq;
+
+	const double *pOld = &_OldFreq[0];
+	double *pNew = &_NewFreq[0];
+	const int *pH1 = _PairH1.empty() ? NULL : &_PairH1[0];
+	const int *pH2 = _PairH2.empty() ? NULL : &_PairH2[0];
+	const uint64_t *pFlag = _PairFlag.empty() ? NULL : &_PairFlag[0];
+	double *pG = _PairFreq.empty() ? NULL : &_PairFreq[0];
+
+	// for-loop each sample
+	int TotalNumSamp = 0;
+	double LogLik = 0;
 
+	for (size_t i=0; i < _SampBootstrap.size(); i++)
+	{
+		// always "BootstrapCount > 0"
+		const int cnt = _SampBootstrap[i];
+		const size_t st = _SampPairStart[i], ed = _SampPairStart[i+1];
+		TotalNumSamp += cnt;
+
+		// gather, the pairs not existing in the sample contribute zero
+		double psum = 0;
+		for (size_t k=st; k < ed; k++)
+		{
+			const int h1 = pH1[k], h2 = pH2[k];
+			double f = (h1 != h2) ? (2 * pOld[h1] * pOld[h2]) :
+				(pOld[h1] * pOld[h2]);
+			pG[k] = f * double((pFlag[k >> 6] >> (k & 0x3F)) & 0x01);
+			psum += pG[k];
+		}
+		LogLik += cnt * log(psum);
+		psum = cnt / psum;
 
-// -------------------------------------------------------------------------
-// The algorithm of prediction
+		// scatter
+		for (size_t k=st; k < ed; k++)
+		{
+			double r = pG[k] * psum;
+			pNew[pH1[k]] += r; pNew[pH2[k]] += r;
+		}
+	}
+
+	// finally
+	const double scale = 0.5 / TotalNumSamp;
+	THaplotype *p = Haplo.List;
+	for (size_t i=0; i < nHaplo; i++)
+		(p++)->Freq = pNew[i] * scale;
+
+	return LogLik;
+}
+
+static inline void GetHaploFreq(const CHaplotypeList &Haplo, vector<double> &Out)
+{
+	const THaplotype *p = Haplo.List;
+	Out.resize(Haplo.Num_Haplo);
+	for (size_t i=0; i < Haplo.Num_Haplo; i++) Out[i] = (p++)->Freq;
+}
+
+static inline void SetHaploFreq(CHaplotypeList &Haplo, const vector<double> &In)
+{
+	THaplotype *p = Haplo.List;
+	for (size_t i=0; i < Haplo.Num_Haplo; i++) (p++)->Freq = In[i];
+}
+
+/// the max number of step halvings to keep frequencies positive in SQUAREM
+static const int SQUAREM_MAX_HALVING = 10;
+/// the frequency below which a haplotype can be truncated in SQUAREM
+static const double SQUAREM_MIN_FREQ = 1e-9;
+/// the factor of the EM update for a truncated haplotype frequency
+static const double SQUAREM_SHRINK_FREQ = 0.01;
+
+int CAlg_EM::_AcceleratedEM(CHaplotypeList &Haplo, double RelTol)
+{
+	// SQUAREM (Varadhan & Roland, 2008, Scand J Statist 35:335-353), the
+	//   scheme 'SqS3' with the EM update as a stabilization step, and the
+	//   extrapolation is rejected if it decreases the log likelihood or
+	//   gives a non-positive frequency (except vanishing haplotypes)
+	const size_t n = Haplo.Num_Haplo;
+	double ConvTol = 0, LogLik = 0;
+	bool has_loglik = false, extrapolated = false;
+	int num_iter = 0;
+
+	while (num_iter <= EM_MaxNum_Iterations)
+	{
+		// theta0 -> theta1
+		double LL = _EMStep(Haplo);
+		num_iter ++;
+		if (extrapolated && (LL < LogLik))
+		{
+			// fall back to theta2, the EM update of the previous cycle
+			SetHaploFreq(Haplo, _Theta2);
+			extrapolated = false;
+			continue;
+		}
+		if (has_loglik)
+		{
+			// the same stopping rule as EM, on two successive EM updates
+			if (!extrapolated && (fabs(LL - LogLik) <= ConvTol)) break;
+		} else {
+			ConvTol = RelTol * (fabs(LL) + RelTol);
+			if (ConvTol < 0) ConvTol = 0;
+			has_loglik = true;
+		}
+		LogLik = LL;
+		if (num_iter > EM_MaxNum_Iterations) break;
+		// theta0 was saved in '_OldFreq' by the update
+		_Theta0 = _OldFreq;
+
+		// theta1 -> theta2
+		GetHaploFreq(Haplo, _Theta1);
+		LL = _EMStep(Haplo);
+		num_iter ++;
+		if (fabs(LL - LogLik) <= ConvTol) break;
+		LogLik = LL;
+		GetHaploFreq(Haplo, _Theta2);
+
+		// r = theta1 - theta0, v = theta2 - 2*theta1 + theta0
+		double sr2=0, sv2=0;
+		for (size_t i=0; i < n; i++)
+		{
+			double r = _Theta1[i] - _Theta0[i];
+			double v = _Theta2[i] - 2*_Theta1[i] + _Theta0[i];
+			sr2 += r*r; sv2 += v*v;
+		}
+		extrapolated = false;
+		if (sv2 <= 0) continue;
+		double alpha = -sqrt(sr2 / sv2);
+
+		// theta' = theta0 - 2*alpha*r + alpha^2*v, and alpha = -1 gives theta2
+		for (int k=0; (alpha < -1) && (k < SQUAREM_MAX_HALVING); k++)
+		{
+			THaplotype *p = Haplo.List;
+			double sum = 0;
+			bool valid = true;
+			for (size_t i=0; i < n; i++, p++)
+			{
+				double r = _Theta1[i] - _Theta0[i];
+				double v = _Theta2[i] - 2*_Theta1[i] + _Theta0[i];
+				p->Freq = _Theta0[i] - 2*alpha*r + alpha*alpha*v;
+				if (!(p->Freq > 0))
+				{
+					// a vanishing haplotype is kept positive and rare
+					if (_Theta2[i] < SQUAREM_MIN_FREQ)
+						p->Freq = SQUAREM_SHRINK_FREQ * _Theta2[i];
+					else {
+						valid = false; break;
+					}
+				}
+				sum += p->Freq;
+			}
+			if (valid)
+			{
+				Haplo.ScaleFrequency(1 / sum);
+				extrapolated = true;
+				break;
+			}
+			alpha = 0.5 * (alpha - 1);
+		}
+		if (!extrapolated)
+			SetHaploFreq(Haplo, _Theta2);
+	}
+
+	return num_iter;
+}
+
+
+
+void CAlg_EM::AssignPairs(const CAlg_EM &src, const CHaplotypeList &SrcHaplo,
+	CHaplotypeList &DstHaplo)
+{
+	// the haplotype pairs are stored by indices
+	DstHaplo = SrcHaplo;
+	_SampBootstrap = src._SampBootstrap;
+	_SampIndex = src._SampIndex;
+	_SampPairStart = src._SampPairStart;
+	_PairH1 = src._PairH1;
+	_PairH2 = src._PairH2;
+	_PairFlag = src._PairFlag;
+	_PairFreq.resize(src._PairFreq.size());
+}
+
+
+
+// -------------------------------------------------------------------------
+// The distances between genotypes and parent haplotype pairs
+
+void TParentDist::SetNewSNP(const TGenotype &Geno, size_t idx)
+{
+	size_t i = idx >> 3, r = idx & 0x07;
+	int s1 = (Geno.PackedSNP1[i] >> r) & 0x01;
+	int s2 = (Geno.PackedSNP2[i] >> r) & 0x01;
+	int m  = (Geno.PackedMissing[i] >> r) & 0x01;
+	// the same as TGenotype::_HamDist() on a single SNP
+	for (int a1=0; a1 <= 1; a1++)
+	{
+		for (int a2=0; a2 <= 1; a2++)
+		{
+			int mask = ((a1 ^ s2) | (a2 ^ s1)) & m;
+			NewDist[(a1 << 1) | a2] = ((a1 ^ s1) & mask) + ((a2 ^ s2) & mask);
+		}
+	}
+}
+
+
+CParentDistCache::CParentDistCache()
+{
+	_NumParent = _NumPair = 0;
+	_NumCached = 0;
+}
+
+void CParentDistCache::Init(const CHaplotypeList &Parent,
+	const CGenotypeList &GenoList)
+{
+	HIBAG_PROFILE(PROF_PARENT_DIST)
+	HIBAG_CHECKING(Parent.Num_SNP != (size_t)GenoList.Num_SNP,
+		"CParentDistCache::Init, Parent and GenoList should have the same number of SNP markers.");
+
+	const size_t n = Parent.Num_Haplo;
+	const int nSamp = GenoList.nSamp();
+	_NumParent = n;
+	_NumPair = n * (n + 1) / 2;
+	_NumCached = 0;
+
+	// the number of samples allowed by the memory limit
+	size_t max_n = (_NumPair > 0) ? (ParentDist_MaxMemory / _NumPair) : 0;
+	if (max_n > (size_t)nSamp) max_n = nSamp;
+	if (max_n <= 0)
+	{
+		Clear();
+		return;
+	}
+
+	// row offsets, the pair (p1, p2) with p1 <= p2 is at _RowOffset[p1] + p2
+	_RowOffset.resize(n);
+	for (size_t p=0, st=0; p < n; p++)
+	{
+		_RowOffset[p] = st - p;
+		st += n - p;
+	}
+
+	// out-of-bag samples first, since all of them are used in each candidate
+	_SampPos.assign(nSamp, -1);
+	for (int pass=0; pass < 2; pass++)
+	{
+		for (int i=0; i < nSamp && (size_t)_NumCached < max_n; i++)
+		{
+			bool oob = (GenoList.List[i].BootstrapCount <= 0);
+			if (oob == (pass == 0))
+				_SampPos[i] = _NumCached++;
+		}
+	}
+
+	// compute the distances
+	const size_t old_cap = _Dist.capacity();
+	_Dist.resize(_NumPair * _NumCached);
+	ProfileAllocVec(_Dist, old_cap);
+	if (Profile_Enabled)
+	{
+		ProfileAdd(PROF_HAPLO_PAIR, (int64_t)_NumPair * _NumCached);
+		ProfileAdd(PROF_HAMMING_DIST, (int64_t)_NumPair * _NumCached);
+	}
+	for (int i=0; i < nSamp; i++)
+	{
+		if (_SampPos[i] < 0) continue;
+		const TGenotype &G = GenoList.List[i];
+		UINT8 *pD = &_Dist[_NumPair * _SampPos[i]];
+		const THaplotype *p1 = Parent.List;
+		for (size_t m1=n; m1 > 0; m1--, p1++)
+		{
+			const THaplotype *p2 = p1;
+			for (size_t m2=m1; m2 > 0; m2--, p2++)
+				*pD++ = G._HamDist(Parent.Num_SNP, *p1, *p2);
+		}
+	}
+}
+
+void CParentDistCache::Clear()
+{
+	_NumParent = _NumPair = 0;
+	_NumCached = 0;
+	_RowOffset.clear();
+	_SampPos.clear();
+	_Dist.clear();
+}
+
+void CParentDistCache::SetChild(const vector<int> &SrcIdx,
+	vector<size_t> &OutOffset, vector<int> &OutParent,
+	vector<UINT8> &OutAllele) const
+{
+	const size_t n = SrcIdx.size();
+	OutOffset.resize(n);
+	OutParent.resize(n);
+	OutAllele.resize(n);
+	for (size_t i=0; i < n; i++)
+	{
+		int p = SrcIdx[i] >> 1;
+		HIBAG_CHECKING(p >= (int)_NumParent,
+			"CParentDistCache::SetChild, invalid parent haplotype.");
+		OutParent[i] = p;
+		OutOffset[i] = _RowOffset[p];
+		OutAllele[i] = SrcIdx[i] & 0x01;
+	}
+}
+
+
+
+// -------------------------------------------------------------------------
+// The algorithm of prediction
 
 CAlg_Prediction::CAlg_Prediction() { }
 
@@ -1265,6 +2042,7 @@ double &CAlg_Prediction::IndexSumPostProb(int H1, int H2)
 void CAlg_Prediction::PredictPostProb(const CHaplotypeList &Haplo,
 	const TGenotype &Geno, double &SumProb)
 {
+	ProfilePairs((int64_t)Haplo.Num_Haplo*(Haplo.Num_Haplo+1)/2, true);
 	THaplotype *I1, *I2;
 	double *pProb = &_PostProb[0];
 	double sum;
@@ -1325,6 +2103,7 @@ void CAlg_Prediction::PredictPostProb(const CHaplotypeList &Haplo,
 THLAType CAlg_Prediction::_PredBestGuess(const CHaplotypeList &Haplo,
 	const TGenotype &Geno)
 {
+	ProfilePairs((int64_t)Haplo.Num_Haplo*(Haplo.Num_Haplo+1)/2, true);
 	THLAType rv;
 	rv.Allele1 = rv.Allele2 = NA_INTEGER;
 	double max=0, prob;
@@ -1388,6 +2167,7 @@ THLAType CAlg_Prediction::_PredBestGuess(const CHaplotypeList &Haplo,
 double CAlg_Prediction::_PredPostProb(const CHaplotypeList &Haplo,
 	const TGenotype &Geno, const THLAType &HLA)
 {
+	ProfilePairs((int64_t)Haplo.Num_Haplo*(Haplo.Num_Haplo+1)/2, true);
 	int H1=HLA.Allele1, H2=HLA.Allele2;
 	if (H1 > H2) std::swap(H1, H2);
 	int IxHLA = H2 + H1*(2*_nHLA-H1-1)/2;
@@ -1444,6 +2224,218 @@ double CAlg_Prediction::_PredPostProb(const CHaplotypeList &Haplo,
 	return hlaProb / sum;
 }
 
+double CAlg_Prediction::_PredPostProb(const CHaplotypeList &Haplo,
+	const TParentDist &Dist, const THLAType &HLA)
+{
+	ProfilePairs((int64_t)Haplo.Num_Haplo*(Haplo.Num_Haplo+1)/2, false);
+	int H1=HLA.Allele1, H2=HLA.Allele2;
+	if (H1 > H2) std::swap(H1, H2);
+	int IxHLA = H2 + H1*(2*_nHLA-H1-1)/2;
+	int idx = 0;
+
+	double sum=0, hlaProb=0, prob;
+	const THaplotype *L = Haplo.List;
+	size_t I1 = 0, I2;
+
+	for (int h1=0; h1 < _nHLA; h1++)
+	{
+		size_t n1 = Haplo.LenPerHLA[h1];
+
+		// diagonal
+		prob = 0;
+		for (size_t i1=I1; i1 < I1+n1; i1++)
+		{
+			for (size_t i2=i1; i2 < I1+n1; i2++)
+			{
+				ADD_FREQ_MUTANT(prob, (i1 != i2) ?
+					(2 * L[i1].Freq * L[i2].Freq) : (L[i1].Freq * L[i2].Freq),
+					Dist.Get(i1, i2));
+			}
+		}
+		I2 = I1 + n1;
+		if (IxHLA == idx) hlaProb = prob;
+		idx ++; sum += prob;
+
+		// off-diagonal
+		for (int h2=h1+1; h2 < _nHLA; h2++)
+		{
+			size_t n2 = Haplo.LenPerHLA[h2];
+			prob = 0;
+			for (size_t i1=I1; i1 < I1+n1; i1++)
+			{
+				for (size_t i2=I2; i2 < I2+n2; i2++)
+				{
+					ADD_FREQ_MUTANT(prob, 2 * L[i1].Freq * L[i2].Freq,
+						Dist.Get(i1, i2));
+				}
+			}
+			I2 += n2;
+			if (IxHLA == idx) hlaProb = prob;
+			idx ++; sum += prob;
+		}
+
+		I1 += n1;
+	}
+
+	return hlaProb / sum;
+}
+
+bool CAlg_Prediction::_PairBoundGreater(const TPairBound &a,
+	const TPairBound &b)
+{
+	if (a.Bound != b.Bound)
+		return a.Bound > b.Bound;
+	else
+		return a.Index < b.Index;
+}
+
+void CAlg_Prediction::_InitPairBound(const CHaplotypeList &Haplo,
+	vector<TPairBound> &OutBound) const
+{
+	// the total frequency and the start of each HLA allele
+	vector<double> F(_nHLA);
+	vector<size_t> St(_nHLA);
+	const THaplotype *p = Haplo.List;
+	for (int h=0, st=0; h < _nHLA; h++)
+	{
+		size_t n = Haplo.LenPerHLA[h];
+		double sum = 0;
+		for (size_t i=0; i < n; i++) sum += (p++)->Freq;
+		F[h] = sum; St[h] = st;
+		st += n;
+	}
+
+	// the sum of 2*f_i*f_j over (h1, h2) is 2*F1*F2, and F1*F1 if h1 = h2
+	OutBound.resize(_nHLA*(_nHLA+1)/2);
+	TPairBound *pB = &OutBound[0];
+	int idx = 0;
+	for (int h1=0; h1 < _nHLA; h1++)
+	{
+		for (int h2=h1; h2 < _nHLA; h2++, idx++, pB++)
+		{
+			pB->Bound = (h1 == h2) ? (F[h1] * F[h1]) : (2 * F[h1] * F[h2]);
+			pB->Index = idx;
+			pB->H1 = h1; pB->H2 = h2;
+			pB->Start1 = St[h1]; pB->Len1 = Haplo.LenPerHLA[h1];
+			pB->Start2 = St[h2]; pB->Len2 = Haplo.LenPerHLA[h2];
+		}
+	}
+
+	// largest bounds first
+	std::sort(OutBound.begin(), OutBound.end(), _PairBoundGreater);
+}
+
+inline double CAlg_Prediction::_PairProb(const CHaplotypeList &Haplo,
+	const TGenotype &Geno, const TPairBound &B)
+{
+	// the same order of summation as _PredBestGuess()
+	double prob = 0;
+	const THaplotype *i1 = Haplo.List + B.Start1;
+	if (B.H1 == B.H2)
+	{
+		for (size_t m1=B.Len1; m1 > 0; m1--, i1++)
+		{
+			const THaplotype *i2 = i1;
+			for (size_t m2=m1; m2 > 0; m2--, i2++)
+			{
+				ADD_FREQ_MUTANT(prob, (i1 != i2) ?
+					(2 * i1->Freq * i2->Freq) : (i1->Freq * i2->Freq),
+					Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
+			}
+		}
+	} else {
+		for (size_t m1=B.Len1; m1 > 0; m1--, i1++)
+		{
+			const THaplotype *i2 = Haplo.List + B.Start2;
+			for (size_t m2=B.Len2; m2 > 0; m2--, i2++)
+			{
+				ADD_FREQ_MUTANT(prob, 2 * i1->Freq * i2->Freq,
+					Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
+			}
+		}
+	}
+	return prob;
+}
+
+inline double CAlg_Prediction::_PairProb(const CHaplotypeList &Haplo,
+	const TParentDist &Dist, const TPairBound &B)
+{
+	double prob = 0;
+	const THaplotype *L = Haplo.List;
+	const size_t E1 = B.Start1 + B.Len1;
+	if (B.H1 == B.H2)
+	{
+		for (size_t i1=B.Start1; i1 < E1; i1++)
+		{
+			for (size_t i2=i1; i2 < E1; i2++)
+			{
+				ADD_FREQ_MUTANT(prob, (i1 != i2) ?
+					(2 * L[i1].Freq * L[i2].Freq) : (L[i1].Freq * L[i2].Freq),
+					Dist.Get(i1, i2));
+			}
+		}
+	} else {
+		const size_t E2 = B.Start2 + B.Len2;
+		for (size_t i1=B.Start1; i1 < E1; i1++)
+		{
+			for (size_t i2=B.Start2; i2 < E2; i2++)
+			{
+				ADD_FREQ_MUTANT(prob, 2 * L[i1].Freq * L[i2].Freq,
+					Dist.Get(i1, i2));
+			}
+		}
+	}
+	return prob;
+}
+
+/// the relative tolerance of the upper bounds for rounding errors
+static const double PAIR_BOUND_RELTOL = 1e-8;
+
+/// whether the distances are computed from genotypes in prediction
+static inline bool UseHammingDist(const TGenotype &) { return true; }
+static inline bool UseHammingDist(const TParentDist &) { return false; }
+
+template<typename TGENO>
+THLAType CAlg_Prediction::_PredBestGuessBound(const CHaplotypeList &Haplo,
+	const TGENO &Geno, const vector<TPairBound> &Bound)
+{
+	THLAType rv;
+	rv.Allele1 = rv.Allele2 = NA_INTEGER;
+	double max = 0;
+	int max_idx = INT_MAX;
+	int64_t n_pair = 0;
+
+	vector<TPairBound>::const_iterator p;
+	for (p = Bound.begin(); p != Bound.end(); p++)
+	{
+		// no HLA pair left can be better than the current best
+		if (p->Bound * (1 + PAIR_BOUND_RELTOL) < max) break;
+		double prob = _PairProb(Haplo, Geno, *p);
+		n_pair += (p->H1 == p->H2) ? p->Len1*(p->Len1+1)/2 : p->Len1*p->Len2;
+		// ties are resolved by the order of HLA pairs as _PredBestGuess()
+		if ((max < prob) || ((max == prob) && (max > 0) && (p->Index < max_idx)))
+		{
+			max = prob; max_idx = p->Index;
+			rv.Allele1 = p->H1; rv.Allele2 = p->H2;
+		}
+	}
+
+	ProfilePairs(n_pair, UseHammingDist(Geno));
+	return rv;
+}
+
+THLAType CAlg_Prediction::_PredBestGuess(const CHaplotypeList &Haplo,
+	const TGenotype &Geno, const vector<TPairBound> &Bound)
+{
+	return _PredBestGuessBound(Haplo, Geno, Bound);
+}
+
+THLAType CAlg_Prediction::_PredBestGuess(const CHaplotypeList &Haplo,
+	const TParentDist &Dist, const vector<TPairBound> &Bound)
+{
+	return _PredBestGuessBound(Haplo, Dist, Bound);
+}
+
 THLAType CAlg_Prediction::BestGuess()
 {
 	THLAType rv;
@@ -1491,54 +2483,576 @@ THLAType CAlg_Prediction::BestGuessEnsemble()
 
 
 // -------------------------------------------------------------------------
-// The algorithm of variable selection
+// The posterior probabilities in a sparse format
 
-CVariableSelection::CVariableSelection()
+/// decreasing probability, and then increasing index
+struct TSparsePostProb::TGreater
 {
-	_SNPMat = NULL;
-	_HLAList = NULL;
+	const double *Prob;
+	TGreater(const double *p) { Prob = p; }
+	inline bool operator()(int i, int j) const
+	{
+		return (Prob[i] > Prob[j]) || ((Prob[i] == Prob[j]) && (i < j));
+	}
+};
+
+TSparsePostProb::TSparsePostProb()
+{
+	TopK = 0; MinProb = 0;
+	SampStart.push_back(0);
 }
 
-void CVariableSelection::InitSelection(CSNPGenoMatrix &snpMat,
-	CHLATypeList &hlaList, const int _BootstrapCnt[])
+void TSparsePostProb::Init(int topk, double min_prob)
 {
-	HIBAG_CHECKING(snpMat.Num_Total_Samp != hlaList.nSamp(),
-		"CVariableSelection::InitSelection, snpMat and hlaList should have the same number of samples.");
+	TopK = topk; MinProb = min_prob;
+	SampStart.clear(); Index.clear(); Prob.clear();
+	SampStart.push_back(0);
+}
 
-	_SNPMat = &snpMat;
-	_HLAList = &hlaList;
-	
-	// initialize genotype list
-	_GenoList.List.resize(snpMat.Num_Total_Samp);
-	for (int i=0; i < snpMat.Num_Total_Samp; i++)
+void TSparsePostProb::Append(const double prob[], size_t n)
+{
+	// the nonzero pairs above the cutoff
+	_Work.clear();
+	for (size_t i=0; i < n; i++)
 	{
-		TGenotype &g = _GenoList.List[i];
-		g.BootstrapCount = _BootstrapCnt[i];
-		g.aux_hla_type = hlaList.List[i];
-		if (g.aux_hla_type.Allele2 < g.aux_hla_type.Allele1)
-		{
-			int w = g.aux_hla_type.Allele2;
-			g.aux_hla_type.Allele2 = g.aux_hla_type.Allele1;
-			g.aux_hla_type.Allele1 = w;
-		}
+		if ((prob[i] > 0) && (prob[i] >= MinProb))
+			_Work.push_back(i);
 	}
-	_GenoList.Num_SNP = 0;
-	_GenoList.SetAllMissing();
-
-	_Predict.InitPrediction(nHLA());
-}
 
-void CVariableSelection::_InitHaplotype(CHaplotypeList &Haplo)
-{
-	const size_t n_hla = _HLAList->Num_HLA_Allele();
-	vector<int> tmp(n_hla, 0);
-	int SumCnt = 0;
-	for (int i=0; i < nSamp(); i++)
+	// sort, keeping the top K
+	TGreater cmp(prob);
+	if ((TopK > 0) && (_Work.size() > (size_t)TopK))
 	{
-		int cnt = _GenoList.List[i].BootstrapCount;
-		tmp[_HLAList->List[i].Allele1] += cnt;
-		tmp[_HLAList->List[i].Allele2] += cnt;
-		SumCnt += cnt;
+		nth_element(_Work.begin(), _Work.begin() + TopK, _Work.end(), cmp);
+		_Work.resize(TopK);
+	}
+	sort(_Work.begin(), _Work.end(), cmp);
+
+	for (vector<int>::const_iterator it=_Work.begin(); it != _Work.end(); it++)
+	{
+		Index.push_back(*it);
+		Prob.push_back(prob[*it]);
+	}
+	SampStart.push_back(Index.size());
+}
+
+void TSparsePostProb::Append(const TSparsePostProb &src)
+{
+	const size_t offset = Index.size();
+	for (size_t i=1; i < src.SampStart.size(); i++)
+		SampStart.push_back(src.SampStart[i] + offset);
+	Index.insert(Index.end(), src.Index.begin(), src.Index.end());
+	Prob.insert(Prob.end(), src.Prob.begin(), src.Prob.end());
+}
+
+
+
+// -------------------------------------------------------------------------
+// The cache of posterior probabilities in prediction
+
+CPredCache::CPredCache()
+{
+	_NumByte = _NumProb = _MaxEntry = _LastSlot = 0;
+	_NumHit = _NumMiss = 0;
+}
+
+void CPredCache::Init(int n_snp, size_t n_prob, int n_samp,
+	size_t max_memory)
+{
+	HIBAG_CHECKING((n_snp < 0) || ((size_t)n_snp > HIBAG_MAXNUM_SNP_IN_CLASSIFIER),
+		"CPredCache::Init, the number of SNPs is invalid.");
+
+	Clear();
+	_NumByte = (n_snp + 7) / 8;
+	_NumProb = n_prob;
+	_LastKey.resize(3 * _NumByte);
+
+	// each entry: a key, the sum of prior prob, the posterior prob and
+	//   two slots in the hash table
+	const size_t size = 3*_NumByte + sizeof(double)*(n_prob + 1) +
+		2*sizeof(int);
+	_MaxEntry = max_memory / size;
+	if (_MaxEntry > (size_t)n_samp) _MaxEntry = n_samp;
+	if (_MaxEntry > (size_t)INT_MAX/2) _MaxEntry = INT_MAX/2;
+
+	if (_MaxEntry > 0)
+	{
+		size_t n = 16;
+		while (n < 2*_MaxEntry) n <<= 1;
+		_Table.resize(n, -1);
+	}
+}
+
+void CPredCache::Clear()
+{
+	_MaxEntry = _LastSlot = 0;
+	_NumHit = _NumMiss = 0;
+	_Table.clear(); _Key.clear(); _SumProb.clear(); _Prob.clear();
+}
+
+const double *CPredCache::Find(const TGenotype &Geno, double &OutSumProb)
+{
+	if (_Table.empty())
+	{
+		_NumMiss ++;
+		return NULL;
+	}
+
+	// the key, the bits beyond the SNPs are always ZERO
+	UINT8 *key = &_LastKey[0];
+	memcpy(key, Geno.PackedSNP1, _NumByte);
+	memcpy(key + _NumByte, Geno.PackedSNP2, _NumByte);
+	memcpy(key + 2*_NumByte, Geno.PackedMissing, _NumByte);
+	const size_t nkey = 3 * _NumByte;
+
+	// FNV-1a hash
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i=0; i < nkey; i++)
+	{
+		h ^= key[i];
+		h *= 1099511628211ULL;
+	}
+
+	// linear probing
+	const size_t mask = _Table.size() - 1;
+	size_t slot = (size_t)(h ^ (h >> 32)) & mask;
+	for (int k; (k = _Table[slot]) >= 0; slot = (slot + 1) & mask)
+	{
+		if (memcmp(&_Key[nkey * k], key, nkey) == 0)
+		{
+			_NumHit ++;
+			OutSumProb = _SumProb[k];
+			return &_Prob[_NumProb * k];
+		}
+	}
+
+	_LastSlot = slot;
+	_NumMiss ++;
+	return NULL;
+}
+
+void CPredCache::Add(const double Prob[], double SumProb)
+{
+	const size_t n = _SumProb.size();
+	if (n >= _MaxEntry) return;
+
+	_Table[_LastSlot] = n;
+	_Key.insert(_Key.end(), _LastKey.begin(), _LastKey.end());
+	_SumProb.push_back(SumProb);
+	_Prob.insert(_Prob.end(), Prob, Prob + _NumProb);
+}
+
+
+
+// -------------------------------------------------------------------------
+// The memory-mapped file
+
+CMappedFile::CMappedFile()
+{
+	_Data = NULL; _Size = 0;
+	_Handle = NULL;
+}
+
+CMappedFile::~CMappedFile()
+{
+	Close();
+}
+
+void CMappedFile::Open(const char *fn, bool copy_on_write)
+{
+	Close();
+
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		throw ErrHLA("Fail to open the file \"%s\".", fn);
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(hFile, &size))
+	{
+		CloseHandle(hFile);
+		throw ErrHLA("Fail to open the file \"%s\".", fn);
+	}
+	_Size = size.QuadPart;
+	if (_Size > 0)
+	{
+		HANDLE hMap = CreateFileMappingA(hFile, NULL,
+			copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+		CloseHandle(hFile);
+		if (hMap == NULL)
+			throw ErrHLA("Fail to map the file \"%s\".", fn);
+		_Data = (const UINT8*)MapViewOfFile(hMap,
+			copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+		if (_Data == NULL)
+		{
+			CloseHandle(hMap);
+			throw ErrHLA("Fail to map the file \"%s\".", fn);
+		}
+		_Handle = hMap;
+	} else
+		CloseHandle(hFile);
+#else
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		throw ErrHLA("Fail to open the file \"%s\".", fn);
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw ErrHLA("Fail to open the file \"%s\".", fn);
+	}
+	_Size = st.st_size;
+	if (_Size > 0)
+	{
+		void *p = mmap(NULL, _Size,
+			copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ,
+			MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			throw ErrHLA("Fail to map the file \"%s\".", fn);
+		_Data = (const UINT8*)p;
+	} else
+		close(fd);
+#endif
+}
+
+void CMappedFile::Close()
+{
+	if (_Data)
+	{
+	#ifdef _WIN32
+		UnmapViewOfFile((LPCVOID)_Data);
+		CloseHandle((HANDLE)_Handle);
+	#else
+		munmap((void*)_Data, _Size);
+	#endif
+	}
+	_Data = NULL; _Size = 0;
+	_Handle = NULL;
+}
+
+
+
+// -------------------------------------------------------------------------
+// The genotype reader of PLINK BED files
+
+// PLINK BED codes: 00 -- homozygote of the first allele,
+//   01 -- missing, 10 -- heterozygote, 11 -- homozygote of the second
+
+/// the genotypes of the four samples in a byte, without or with flipping
+static int BED_LUT[2][256][4];
+
+static struct TInitBEDLookupTable
+{
+	TInitBEDLookupTable()
+	{
+		static const int cvt[4] = { 2, NA_INTEGER, 1, 0 };
+		static const int cvt_flip[4] = { 0, NA_INTEGER, 1, 2 };
+		for (int b=0; b < 256; b++)
+		{
+			for (int k=0; k < 4; k++)
+			{
+				BED_LUT[0][b][k] = cvt[(b >> (2*k)) & 0x03];
+				BED_LUT[1][b][k] = cvt_flip[(b >> (2*k)) & 0x03];
+			}
+		}
+	}
+} InitBEDLookupTable;
+
+/// the number of SNPs in a tile
+static const int BED_TILE_NUM_SNP = 64;
+/// the number of samples in a tile, a multiple of 4
+static const int BED_TILE_NUM_SAMP = 1024;
+
+
+CBEDGenoReader::CBEDGenoReader()
+{
+	_NumSamp = _NumSNP = 0;
+	_SNPMajor = true;
+	_RecordSize = 0;
+	_Position = 0;
+}
+
+void CBEDGenoReader::Open(const char *fn, int n_samp, int n_snp, int n_sel,
+	const int SNPIndex[], const int Flip[])
+{
+	HIBAG_CHECKING((n_samp < 0) || (n_snp < 0) || (n_sel < 0),
+		"CBEDGenoReader::Open, the dimension is invalid.");
+	Close();
+
+	_File.Open(fn);
+	const UINT8 *prefix = _File.Data();
+	if ((_File.Size() < 3) || (prefix[0] != 0x6C) || (prefix[1] != 0x1B))
+		throw ErrHLA("Invalid prefix in the PLINK BED file.");
+
+	_NumSamp = n_samp;
+	_NumSNP = n_snp;
+	_SNPMajor = (prefix[2] != 0);
+	_RecordSize = _SNPMajor ? ((int64_t(n_samp) + 3) / 4) :
+		((int64_t(n_snp) + 3) / 4);
+	_Position = 0;
+	if (_File.Size() < 3 + _RecordSize*(_SNPMajor ? n_snp : n_samp))
+		throw ErrHLA("The PLINK BED file is truncated.");
+
+	_SNPIndex.assign(SNPIndex, SNPIndex + n_sel);
+	_Flip.assign(n_sel, 0);
+	for (int i=0; i < n_sel; i++)
+	{
+		if (_SNPIndex[i] >= n_snp)
+			throw ErrHLA("Invalid SNP index in the PLINK BED file.");
+		if (Flip) _Flip[i] = (Flip[i] != 0);
+	}
+}
+
+void CBEDGenoReader::Close()
+{
+	_File.Close();
+	_NumSamp = _NumSNP = _Position = 0;
+	_SNPIndex.clear(); _Flip.clear(); _Tile.clear();
+}
+
+void CBEDGenoReader::Read(int OutGeno[], int n_samp)
+{
+	HIBAG_CHECKING((n_samp < 0) || (_Position + n_samp > _NumSamp),
+		"CBEDGenoReader::Read, there are not enough samples.");
+
+	const int n_sel = _SNPIndex.size();
+	const UINT8 *base = _File.Data() + 3;
+
+	if (_SNPMajor)
+	{
+		// decode a tile of SNPs x samples by whole bytes, and then write
+		//   the tile sample by sample to avoid the large stride of 'OutGeno'
+		const size_t tile_len = BED_TILE_NUM_SAMP + 4;
+		_Tile.resize(BED_TILE_NUM_SNP * tile_len);
+
+		for (int i0=0; i0 < n_samp; i0 += BED_TILE_NUM_SAMP)
+		{
+			const int m = (n_samp - i0 < BED_TILE_NUM_SAMP) ?
+				(n_samp - i0) : BED_TILE_NUM_SAMP;
+			const int pos = _Position + i0;
+			const int shift = pos & 0x03;
+			const int nbyte = (shift + m + 3) / 4;
+
+			for (int j0=0; j0 < n_sel; j0 += BED_TILE_NUM_SNP)
+			{
+				const int nj = (n_sel - j0 < BED_TILE_NUM_SNP) ?
+					(n_sel - j0) : BED_TILE_NUM_SNP;
+
+				// decode
+				for (int j=0; j < nj; j++)
+				{
+					int *t = &_Tile[j * tile_len];
+					const int k = _SNPIndex[j0 + j];
+					if (k >= 0)
+					{
+						const UINT8 *s = base + k*_RecordSize + (pos >> 2);
+						const int (*lut)[4] = BED_LUT[_Flip[j0 + j]];
+						for (int b=0; b < nbyte; b++, t+=4)
+							memcpy(t, lut[s[b]], sizeof(int)*4);
+					} else {
+						for (int b=0; b < shift+m; b++)
+							t[b] = NA_INTEGER;
+					}
+				}
+
+				// write
+				int *p = OutGeno + (size_t)i0*n_sel + j0;
+				const int *t = &_Tile[shift];
+				for (int i=0; i < m; i++, p += n_sel, t++)
+				{
+					const int *tt = t;
+					for (int j=0; j < nj; j++, tt += tile_len)
+						p[j] = *tt;
+				}
+			}
+		}
+	} else {
+		// the record of each sample
+		const UINT8 *s = base + _Position*_RecordSize;
+		for (int i=0; i < n_samp; i++, s += _RecordSize)
+		{
+			for (int j=0; j < n_sel; j++)
+			{
+				const int k = _SNPIndex[j];
+				*OutGeno++ = (k >= 0) ?
+					BED_LUT[_Flip[j]][s[k >> 2]][k & 0x03] : NA_INTEGER;
+			}
+		}
+	}
+
+	_Position += n_samp;
+}
+
+
+
+// -------------------------------------------------------------------------
+// The training trace
+
+CTrainingTrace *HLA_LIB::TrainingTrace = NULL;
+
+/// the wall-clock time in nanoseconds if the training trace is enabled
+static inline int64_t TraceTime()
+{
+	return TrainingTrace ? ProfileWallTime() : 0;
+}
+
+CTrainingTrace::CTrainingTrace() { }
+
+CTrainingTrace::~CTrainingTrace() { }
+
+void CTrainingTrace::Write(const vector<TTrainingTraceRecord> &Rec)
+{
+	_Mutex.Lock();
+	try {
+		_Write(Rec);
+	} catch (...) {
+		_Mutex.Unlock();
+		throw;
+	}
+	_Mutex.Unlock();
+}
+
+CTrainingTraceCSV::CTrainingTraceCSV(const char *fn)
+{
+	_File = fopen(fn, "wt");
+	if (!_File)
+		throw ErrHLA("Fail to create the training trace '%s'.", fn);
+	// a large buffer, since a step is written at once
+	setvbuf(_File, NULL, _IOFBF, 1 << 16);
+	fputs("classifier,step,n.snp,n.haplo,snp,valid,em.iter,n.haplo.em,"
+		"n.haplo.erase,oob.acc,oob.time,inbag.loss,inbag.time,pruned,winner,"
+		"raced\n",
+		_File);
+}
+
+CTrainingTraceCSV::~CTrainingTraceCSV()
+{
+	if (_File) fclose(_File);
+	_File = NULL;
+}
+
+void CTrainingTraceCSV::_Write(const vector<TTrainingTraceRecord> &Rec)
+{
+	vector<TTrainingTraceRecord>::const_iterator p;
+	for (p = Rec.begin(); p != Rec.end(); p++)
+	{
+		fprintf(_File, "%d,%d,%d,%d,%d,%s,", p->Classifier+1, p->Step,
+			p->NumSNP, p->NumHaplo, p->SNP+1, p->Valid ? "TRUE" : "FALSE");
+		if (p->Valid)
+		{
+			fprintf(_File, "%d,%d,%d,%.6g,%.6g,", p->EMIter, p->NumHaploEM,
+				p->NumHaploErase, p->OOBAcc, p->OOBTime);
+			if (p->InBagLoss == p->InBagLoss)  // not NaN
+				fprintf(_File, "%.10g,%.6g,", p->InBagLoss, p->InBagTime);
+			else
+				fputs("NA,NA,", _File);
+		} else
+			fputs("NA,NA,NA,NA,NA,NA,NA,", _File);
+		fputs(p->Pruned ? "TRUE," : "FALSE,", _File);
+		if (p->Winner >= 0)
+			fprintf(_File, "%d,", p->Winner+1);
+		else
+			fputs("NA,", _File);
+		fprintf(_File, "%d\n", p->Raced);
+	}
+	if (ferror(_File))
+		throw ErrHLA("Fail to write the training trace.");
+}
+
+
+
+// -------------------------------------------------------------------------
+// The algorithm of variable selection
+
+void CVariableSelection::TCandidateEval::Init(int snp)
+{
+	Valid = false;
+	Acc = 0;
+	Loss = 0;
+	SNP = snp;
+	HasLoss = Pruned = false;
+	EMIter = NumHaploEM = NumHaplo = 0;
+	OOBTime = InBagTime = 0;
+	Raced = NumSamp = 0;
+}
+
+CVariableSelection::CVariableSelection()
+{
+	_SNPMat = NULL;
+	_HLAList = NULL;
+	_ThreadPool = NULL;
+	_TraceIdx = 0;
+	_RaceSampNum = 0;
+	_RaceAlive = NULL;
+}
+
+void CVariableSelection::SetThreadPool(CThreadPool *pool)
+{
+	_ThreadPool = pool;
+	if (pool && (pool->NumThread() > 1))
+		_CandSpace.resize(pool->NumThread());
+	else
+		_CandSpace.clear();
+}
+
+void CVariableSelection::GetEMStat(double &NumCall, double &NumIter) const
+{
+	NumCall = _EM.NumCall() + _MainSpace.EM.NumCall();
+	NumIter = _EM.NumIter() + _MainSpace.EM.NumIter();
+	for (size_t i=0; i < _CandSpace.size(); i++)
+	{
+		NumCall += _CandSpace[i].EM.NumCall();
+		NumIter += _CandSpace[i].EM.NumIter();
+	}
+}
+
+void CVariableSelection::SetTraceIndex(int idx)
+{
+	_TraceIdx = idx;
+}
+
+void CVariableSelection::InitSelection(CSNPGenoMatrix &snpMat,
+	CHLATypeList &hlaList, const int _BootstrapCnt[])
+{
+	HIBAG_CHECKING(snpMat.Num_Total_Samp != hlaList.nSamp(),
+		"CVariableSelection::InitSelection, snpMat and hlaList should have the same number of samples.");
+
+	_SNPMat = &snpMat;
+	_HLAList = &hlaList;
+	
+	// initialize genotype list
+	_GenoList.List.resize(snpMat.Num_Total_Samp);
+	for (int i=0; i < snpMat.Num_Total_Samp; i++)
+	{
+		TGenotype &g = _GenoList.List[i];
+		g.BootstrapCount = _BootstrapCnt[i];
+		g.aux_hla_type = hlaList.List[i];
+		if (g.aux_hla_type.Allele2 < g.aux_hla_type.Allele1)
+		{
+			int w = g.aux_hla_type.Allele2;
+			g.aux_hla_type.Allele2 = g.aux_hla_type.Allele1;
+			g.aux_hla_type.Allele1 = w;
+		}
+	}
+	_GenoList.Num_SNP = 0;
+	_GenoList.SetAllMissing();
+	snpMat.AlleleCount(_BootstrapCnt, _AlleleCnt);
+
+	_Predict.InitPrediction(nHLA());
+}
+
+void CVariableSelection::_InitHaplotype(CHaplotypeList &Haplo)
+{
+	const size_t n_hla = _HLAList->Num_HLA_Allele();
+	vector<int> tmp(n_hla, 0);
+	int SumCnt = 0;
+	for (int i=0; i < nSamp(); i++)
+	{
+		int cnt = _GenoList.List[i].BootstrapCount;
+		tmp[_HLAList->List[i].Allele1] += cnt;
+		tmp[_HLAList->List[i].Allele2] += cnt;
+		SumCnt += cnt;
 	}
 
 	Haplo.LenPerHLA.resize(n_hla);
@@ -1578,8 +3092,14 @@ void CVariableSelection::_Done_EvalAcc()
 
 int CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo)
 {
-	HIBAG_TIMING(TM_ACC_OOB)
-	HIBAG_CHECKING(Haplo.Num_SNP != _GenoList.Num_SNP,
+	return _OutOfBagAccuracy(Haplo, _GenoList);
+}
+
+int CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo,
+	CGenotypeList &Geno, TCandidateSpace *Space, int MinAcc)
+{
+	HIBAG_PROFILE(PROF_ACC_OOB)
+	HIBAG_CHECKING(Haplo.Num_SNP != Geno.Num_SNP,
 		"CVariableSelection::_OutOfBagAccuracy, Haplo and GenoList should have the same number of SNP markers.");
 
 	int CorrectCnt=0;
@@ -1587,13 +3107,37 @@ int CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo)
 	{
 		CorrectCnt = (*GPUExtProcPtr->build_acc_oob)();
 	} else {
-		vector<TGenotype>::const_iterator p = _GenoList.List.begin();
-		for (; p != _GenoList.List.end(); p++)
+		vector<CAlg_Prediction::TPairBound> Bound;
+		_Predict._InitPairBound(Haplo, Bound);
+		TParentDist Dist;
+		const bool cached = _InitParentDist(Haplo, Space, Dist);
+		// stop early if the accuracy cannot reach 'MinAcc'
+		const bool bounded = (MinAcc > 0) && !_OutOfBagOrder.empty();
+		const int n = bounded ? (int)_OutOfBagOrder.size() : Geno.nSamp();
+		int Remain = 2 * n;
+		for (int k=0; k < n; k++)
 		{
+			const int i = bounded ? _OutOfBagOrder[k] : k;
+			const TGenotype *p = &Geno.List[i];
 			if (p->BootstrapCount <= 0)
 			{
-				THLAType g = _Predict._PredBestGuess(Haplo, *p);
+				THLAType g;
+				if (cached && (Dist.Dist = _ParentDist.SampDist(i)))
+				{
+					Dist.SetNewSNP(*p, Haplo.Num_SNP - 1);
+					g = _Predict._PredBestGuess(Haplo, Dist, Bound);
+				} else
+					g = _Predict._PredBestGuess(Haplo, *p, Bound);
 				CorrectCnt += CHLATypeList::Compare(g, p->aux_hla_type);
+				if (bounded)
+				{
+					Remain -= 2;
+					if (CorrectCnt + Remain < MinAcc)
+					{
+						if (Profile_Enabled) ProfileAdd(PROF_OOB_EXIT, 1);
+						return CorrectCnt + Remain;
+					}
+				}
 			}
 		}
 	}
@@ -1601,10 +3145,62 @@ int CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo)
 	return CorrectCnt;
 }
 
+int CVariableSelection::_SubsetAccuracy(CHaplotypeList &Haplo,
+	CGenotypeList &Geno, TCandidateSpace *Space, const int Samp[], int n_samp)
+{
+	HIBAG_PROFILE(PROF_ACC_OOB)
+	vector<CAlg_Prediction::TPairBound> Bound;
+	_Predict._InitPairBound(Haplo, Bound);
+	TParentDist Dist;
+	const bool cached = _InitParentDist(Haplo, Space, Dist);
+	int CorrectCnt = 0;
+	for (int k=0; k < n_samp; k++)
+	{
+		const int i = Samp[k];
+		const TGenotype *p = &Geno.List[i];
+		THLAType g;
+		if (cached && (Dist.Dist = _ParentDist.SampDist(i)))
+		{
+			Dist.SetNewSNP(*p, Haplo.Num_SNP - 1);
+			g = _Predict._PredBestGuess(Haplo, Dist, Bound);
+		} else
+			g = _Predict._PredBestGuess(Haplo, *p, Bound);
+		CorrectCnt += CHLATypeList::Compare(g, p->aux_hla_type);
+	}
+	return CorrectCnt;
+}
+
+void CVariableSelection::_InitOutOfBagOrder(CHaplotypeList &Haplo)
+{
+	// the out-of-bag samples with more mispredicted alleles go first,
+	//   since a new SNP rarely corrects them
+	vector<CAlg_Prediction::TPairBound> Bound;
+	_Predict._InitPairBound(Haplo, Bound);
+	vector<int> idx[3];
+	for (int i=0; i < _GenoList.nSamp(); i++)
+	{
+		const TGenotype &G = _GenoList.List[i];
+		if (G.BootstrapCount <= 0)
+		{
+			THLAType g = _Predict._PredBestGuess(Haplo, G, Bound);
+			idx[CHLATypeList::Compare(g, G.aux_hla_type)].push_back(i);
+		}
+	}
+	_OutOfBagOrder.clear();
+	for (int k=0; k < 3; k++)
+		_OutOfBagOrder.insert(_OutOfBagOrder.end(), idx[k].begin(), idx[k].end());
+}
+
 double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo)
 {
-	HIBAG_TIMING(TM_ACC_IB)
-	HIBAG_CHECKING(Haplo.Num_SNP != _GenoList.Num_SNP,
+	return _InBagLogLik(Haplo, _GenoList);
+}
+
+double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo,
+	CGenotypeList &Geno, TCandidateSpace *Space)
+{
+	HIBAG_PROFILE(PROF_ACC_IB)
+	HIBAG_CHECKING(Haplo.Num_SNP != Geno.Num_SNP,
 		"CVariableSelection::_InBagLogLik, Haplo and GenoList should have the same number of SNP markers.");
 
 	double LogLik = 0;
@@ -1612,13 +3208,21 @@ double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo)
 	{
 		LogLik = (*GPUExtProcPtr->build_acc_ib)();
 	} else {
-		vector<TGenotype>::const_iterator p = _GenoList.List.begin();
-		for (; p != _GenoList.List.end(); p++)
+		TParentDist Dist;
+		const bool cached = _InitParentDist(Haplo, Space, Dist);
+		vector<TGenotype>::const_iterator p = Geno.List.begin();
+		for (int i=0; p != Geno.List.end(); p++, i++)
 		{
 			if (p->BootstrapCount > 0)
 			{
-				LogLik += p->BootstrapCount *
-					log(_Predict._PredPostProb(Haplo, *p, p->aux_hla_type));
+				double prob;
+				if (cached && (Dist.Dist = _ParentDist.SampDist(i)))
+				{
+					Dist.SetNewSNP(*p, Haplo.Num_SNP - 1);
+					prob = _Predict._PredPostProb(Haplo, Dist, p->aux_hla_type);
+				} else
+					prob = _Predict._PredPostProb(Haplo, *p, p->aux_hla_type);
+				LogLik += p->BootstrapCount * log(prob);
 			}
 		}
 		LogLik *= -2;
@@ -1626,13 +3230,235 @@ double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo)
 	return LogLik;
 }
 
-void CVariableSelection::Search(CBaseSampling &VarSampling,
-	CHaplotypeList &OutHaplo, vector<int> &OutSNPIndex,
-	double &Out_Global_Max_OutOfBagAcc, int mtry, bool prune,
-	bool verbose, bool verbose_detail)
+bool CVariableSelection::_InitParentDist(const CHaplotypeList &Haplo,
+	TCandidateSpace *Space, TParentDist &Dist)
 {
-	// rare probability
-	const double RARE_PROB = std::max(FRACTION_HAPLO/(2*nSamp()), MIN_RARE_FREQ);
+	if (!Space || _ParentDist.Empty()) return false;
+	if (Space->SrcIdx.size() != Haplo.Num_Haplo) return false;
+	if (Haplo.Num_Haplo <= 0) return false;
+	_ParentDist.SetChild(Space->SrcIdx, Space->Offset, Space->Parent,
+		Space->Allele);
+	Dist.Dist = NULL;
+	Dist.Offset = &Space->Offset[0];
+	Dist.Parent = &Space->Parent[0];
+	Dist.Allele = &Space->Allele[0];
+	return true;
+}
+
+/// Evaluating the candidate SNPs of one step in parallel
+class CEvalCandidateJob: public CParallelJob
+{
+public:
+	typedef void (CVariableSelection::*TEvalFunc)(int idx, int thread_idx);
+
+	CEvalCandidateJob(CVariableSelection *obj, TEvalFunc fn)
+		{ Obj = obj; Func = fn; }
+	virtual void Run(int idx, int thread_idx)
+		{ (Obj->*Func)(idx, thread_idx); }
+
+private:
+	CVariableSelection *Obj;
+	TEvalFunc Func;
+};
+
+void CVariableSelection::_EvalCandidate(TCandidateSpace &Space, int NewSNP,
+	const CHaplotypeList &CurHaplo, double RareProb, int MinAcc,
+	TCandidateEval &OutEval)
+{
+	OutEval.Init(NewSNP);
+	if (Space.EM.PrepareNewSNP(NewSNP, CurHaplo, *_SNPMat, Space.GenoList,
+		Space.NextHaplo, &_AlleleCnt[NewSNP]))
+	{
+		// run EM algorithm
+		const double n_iter = Space.EM.NumIter();
+		Space.EM.ExpectationMaximization(Space.NextHaplo);
+		OutEval.EMIter = int(Space.EM.NumIter() - n_iter);
+		// remove rare haplotypes
+		Space.NextHaplo.EraseDoubleHaplos(RareProb, Space.NextReducedHaplo,
+			Space.SrcIdx);
+		OutEval.NumHaploEM = Space.NextHaplo.Num_Haplo;
+		OutEval.NumHaplo = Space.NextReducedHaplo.Num_Haplo;
+		// add a SNP to the SNP genotype list
+		Space.GenoList.AddSNP(NewSNP, *_SNPMat);
+
+		// evaluate losses
+		OutEval.Valid = true;
+		int64_t t0 = TraceTime();
+		OutEval.Acc = _OutOfBagAccuracy(Space.NextReducedHaplo,
+			Space.GenoList, &Space, MinAcc);
+		int64_t t1 = TraceTime();
+		OutEval.OOBTime = (t1 - t0) * 1e-9;
+		if (OutEval.Acc >= MinAcc)
+		{
+			OutEval.Loss = _InBagLogLik(Space.NextReducedHaplo, Space.GenoList,
+				&Space);
+			OutEval.HasLoss = true;
+			OutEval.InBagTime = (TraceTime() - t1) * 1e-9;
+		}
+
+		// remove the last SNP in the SNP genotype list
+		Space.GenoList.ReduceSNP();
+	}
+}
+
+void CVariableSelection::_EvalCandidates(CBaseSampling &VarSampling,
+	const CHaplotypeList &CurHaplo, const CHaplotypeList &NextHaplo,
+	double RareProb, int MinAcc, vector<TCandidateEval> &OutEval)
+{
+	const int n = VarSampling.NumOfSelection();
+	OutEval.resize(n);
+
+	// each thread has a copy of the haplotype pairs and genotypes
+	for (size_t i=0; i < _CandSpace.size(); i++)
+		_InitCandSpace(_CandSpace[i], NextHaplo);
+
+	// the candidate SNPs are evaluated independently
+	vector<int> snp(n);
+	for (int i=0; i < n; i++) snp[i] = VarSampling[i];
+	_CandSNP = &snp[0];
+	_CandCurHaplo = &CurHaplo;
+	_CandRareProb = RareProb;
+	_CandMinAcc = MinAcc;
+	_CandEval = &OutEval[0];
+
+	CEvalCandidateJob job(this, &CVariableSelection::_EvalCandidateTask);
+	_ThreadPool->Run(job, n);
+}
+
+void CVariableSelection::_EvalCandidateTask(int idx, int thread_idx)
+{
+	// skip the candidates eliminated by the racing
+	if (_CandEval[idx].Raced > 0) return;
+	_EvalCandidate(_CandSpace[thread_idx], _CandSNP[idx], *_CandCurHaplo,
+		_CandRareProb, _CandMinAcc, _CandEval[idx]);
+}
+
+void CVariableSelection::_InitCandSpace(TCandidateSpace &Space,
+	const CHaplotypeList &NextHaplo)
+{
+	Space.EM.AssignPairs(_EM, NextHaplo, Space.NextHaplo);
+	Space.GenoList.List = _GenoList.List;
+	Space.GenoList.Num_SNP = _GenoList.Num_SNP;
+}
+
+void CVariableSelection::_RaceCandidate(TCandidateSpace &Space, int NewSNP,
+	const CHaplotypeList &CurHaplo, double RareProb, TCandidateEval &OutEval)
+{
+	OutEval.Init(NewSNP);
+	if (Space.EM.PrepareNewSNP(NewSNP, CurHaplo, *_SNPMat, Space.GenoList,
+		Space.NextHaplo, &_AlleleCnt[NewSNP]))
+	{
+		// run EM algorithm with a loose tolerance
+		const double n_iter = Space.EM.NumIter();
+		Space.EM.ExpectationMaximization(Space.NextHaplo,
+			Search_Racing.EMRelTol);
+		OutEval.EMIter = int(Space.EM.NumIter() - n_iter);
+		// remove rare haplotypes
+		Space.NextHaplo.EraseDoubleHaplos(RareProb, Space.NextReducedHaplo,
+			Space.SrcIdx);
+		OutEval.NumHaploEM = Space.NextHaplo.Num_Haplo;
+		OutEval.NumHaplo = Space.NextReducedHaplo.Num_Haplo;
+
+		// the accuracy of a subset of out-of-bag samples
+		Space.GenoList.AddSNP(NewSNP, *_SNPMat);
+		OutEval.Valid = true;
+		int64_t t0 = TraceTime();
+		OutEval.Acc = _SubsetAccuracy(Space.NextReducedHaplo, Space.GenoList,
+			&Space, &_RaceSamp[0], _RaceSampNum);
+		OutEval.OOBTime = (TraceTime() - t0) * 1e-9;
+		OutEval.NumSamp = _RaceSampNum;
+		Space.GenoList.ReduceSNP();
+	}
+}
+
+void CVariableSelection::_RaceCandidateTask(int idx, int thread_idx)
+{
+	const int i = _RaceAlive[idx];
+	_RaceCandidate(_CandSpace[thread_idx], _CandSNP[i], *_CandCurHaplo,
+		_CandRareProb, _CandEval[i]);
+}
+
+void CVariableSelection::_RaceCandidates(CBaseSampling &VarSampling,
+	const CHaplotypeList &CurHaplo, const CHaplotypeList &NextHaplo,
+	double RareProb, vector<TCandidateEval> &OutEval)
+{
+	const int n = VarSampling.NumOfSelection();
+	const int n_oob = _RaceSamp.size();
+
+	// the out-of-bag samples in a new random order for each step
+	for (int i=n_oob-1; i > 0; i--)
+		std::swap(_RaceSamp[i], _RaceSamp[RandomNum(i+1, &_RaceRand)]);
+
+	// the working spaces, the calling thread uses '_MainSpace'
+	const bool parallel = !_CandSpace.empty();
+	if (parallel)
+	{
+		for (size_t i=0; i < _CandSpace.size(); i++)
+			_InitCandSpace(_CandSpace[i], NextHaplo);
+	} else
+		_InitCandSpace(_MainSpace, NextHaplo);
+
+	vector<int> snp(n), alive(n);
+	vector< pair<int, int> > rank;
+	for (int i=0; i < n; i++)
+		{ snp[i] = VarSampling[i]; alive[i] = i; }
+	_CandSNP = &snp[0];
+	_CandCurHaplo = &CurHaplo;
+	_CandRareProb = RareProb;
+	_CandEval = &OutEval[0];
+
+	// the sample size grows by the same factor as the candidates shrink
+	int m = std::max(RACE_MIN_SAMP,
+		(int)ceil(Search_Racing.SampFrac * n_oob));
+	for (int round=1; (m < n_oob) && (alive.size() > 1); round++)
+	{
+		_RaceSampNum = m;
+		_RaceAlive = &alive[0];
+		if (parallel)
+		{
+			CEvalCandidateJob job(this, &CVariableSelection::_RaceCandidateTask);
+			_ThreadPool->Run(job, alive.size());
+		} else {
+			for (size_t k=0; k < alive.size(); k++)
+			{
+				_RaceCandidate(_MainSpace, snp[alive[k]], CurHaplo, RareProb,
+					OutEval[alive[k]]);
+			}
+		}
+
+		// keep the most accurate candidates, and then the first sampled
+		rank.resize(alive.size());
+		for (size_t k=0; k < alive.size(); k++)
+		{
+			const TCandidateEval &E = OutEval[alive[k]];
+			rank[k] = make_pair(E.Valid ? -E.Acc : 1, alive[k]);
+		}
+		std::sort(rank.begin(), rank.end());
+		size_t n_keep = (size_t)ceil(alive.size() * Search_Racing.KeepFrac);
+		if (n_keep < 1) n_keep = 1;
+		alive.clear();
+		for (size_t k=0; k < rank.size(); k++)
+		{
+			const int i = rank[k].second;
+			if (k < n_keep && OutEval[i].Valid)
+				alive.push_back(i);
+			else
+				OutEval[i].Raced = round;
+		}
+
+		m = (int)std::min((double)n_oob, ceil(m / Search_Racing.KeepFrac));
+	}
+
+	_RaceAlive = NULL;
+}
+
+void CVariableSelection::Search(CBaseSampling &VarSampling,
+	CHaplotypeList &OutHaplo, vector<int> &OutSNPIndex,
+	double &Out_Global_Max_OutOfBagAcc, int mtry, bool prune,
+	bool verbose, bool verbose_detail)
+{
+	// rare probability
+	const double RARE_PROB = std::max(FRACTION_HAPLO/(2*nSamp()), MIN_RARE_FREQ);
 
 	// initialize output
 	_InitHaplotype(OutHaplo);
@@ -1642,13 +3468,25 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 	int Global_Max_OutOfBagAcc = 0;  // # of correct alleles
 	double Global_Min_Loss = 1e+30;
 	int NumOOB = 0;
+	// the racing uses its own random stream seeded by the bootstrap sample,
+	//   so the sampling of candidate SNPs is not affected
+	const bool racing = Search_Racing.Enabled && !GPUExtProcPtr &&
+		(Search_Racing.KeepFrac > 0) && (Search_Racing.KeepFrac < 1);
+	_RaceSamp.clear();
 	{
+		uint64_t seed = 0;
 		vector<TGenotype>::const_iterator p = _GenoList.List.begin();
-		for (; p != _GenoList.List.end(); p++)
+		for (int i=0; p != _GenoList.List.end(); p++, i++)
 		{
-			if (p->BootstrapCount <= 0) NumOOB ++;
+			seed = seed * 0x100000001B3ULL + p->BootstrapCount;
+			if (p->BootstrapCount <= 0)
+			{
+				NumOOB ++;
+				if (racing) _RaceSamp.push_back(i);
+			}
 		}
 		if (NumOOB <= 0) NumOOB = 1;
+		if (racing) _RaceRand.Seed(seed);
 	}
 
 	// reserve memory for haplotype lists
@@ -1656,6 +3494,8 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 	CHaplotypeList NextHaplo(reserve_num_haplo);
 	CHaplotypeList NextReducedHaplo(reserve_num_haplo);
 	CHaplotypeList MinHaplo(reserve_num_haplo);
+	vector<TCandidateEval> CandEval;
+	int n_step = 0;
 
 	while (VarSampling.TotalNum() > 0 &&
 		OutSNPIndex.size() < HIBAG_MAXNUM_SNP_IN_CLASSIFIER)
@@ -1670,43 +3510,113 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 		// sample mtry from all candidate SNP markers
 		VarSampling.RandomSelect(mtry);
 
+		// the distances from the current haplotypes are shared by all
+		//   candidate SNPs
+		if (!GPUExtProcPtr && (VarSampling.NumOfSelection() > 1))
+		{
+			_ParentDist.Init(OutHaplo, _GenoList);
+			_InitOutOfBagOrder(OutHaplo);
+		} else {
+			_ParentDist.Clear();
+			_OutOfBagOrder.clear();
+		}
+
+		// eliminate the candidates by racing on subsets of samples
+		const int n_cand = VarSampling.NumOfSelection();
+		CandEval.resize(n_cand);
+		for (int i=0; i < n_cand; i++)
+			CandEval[i].Init(VarSampling[i]);
+		if (racing && (n_cand >= RACE_MIN_CANDIDATE))
+			_RaceCandidates(VarSampling, OutHaplo, NextHaplo, RARE_PROB, CandEval);
+
+		// evaluate all candidates in parallel first, and then compare them
+		//   in the same order as the serial loop
+		const bool parallel = !_CandSpace.empty() && !GPUExtProcPtr &&
+			(n_cand > 1);
+		if (parallel)
+		{
+			_EvalCandidates(VarSampling, OutHaplo, NextHaplo, RARE_PROB,
+				Global_Max_OutOfBagAcc, CandEval);
+		}
+		const int n_snp = OutSNPIndex.size();
+		const int n_haplo = OutHaplo.Num_Haplo;
+
 		// for-loop
 		for (int i=0; i < VarSampling.NumOfSelection(); i++)
 		{
-			if (_EM.PrepareNewSNP(VarSampling[i], OutHaplo, *_SNPMat, _GenoList, NextHaplo))
+			bool valid;
+			int acc = 0;
+			double loss = 0;
+			TCandidateEval &E = CandEval[i];
+			// not compared if eliminated by the racing
+			if (E.Raced > 0) continue;
+
+			if (parallel)
 			{
-				// run EM algorithm
-				_EM.ExpectationMaximization(NextHaplo);
-				// remove rare haplotypes
-				NextHaplo.EraseDoubleHaplos(RARE_PROB, NextReducedHaplo);
-				// add a SNP to the SNP genotype list
-				_GenoList.AddSNP(VarSampling[i], *_SNPMat);
-
-				// evaluate losses
-				_Init_EvalAcc(NextReducedHaplo, _GenoList);
-				double loss = 0;
-				int acc = _OutOfBagAccuracy(NextReducedHaplo);
+				valid = E.Valid;
+				acc = E.Acc;
+				// the serial loop does not compute the loss in this case
 				if (acc >= max_OutOfBagAcc)
-					loss = _InBagLogLik(NextReducedHaplo);
-				_Done_EvalAcc();
+					loss = E.Loss;
+			} else {
+				E.Init(VarSampling[i]);
+				valid = _EM.PrepareNewSNP(VarSampling[i], OutHaplo, *_SNPMat,
+					_GenoList, NextHaplo, &_AlleleCnt[VarSampling[i]]);
+				if (valid)
+				{
+					// run EM algorithm
+					const double n_iter = _EM.NumIter();
+					_EM.ExpectationMaximization(NextHaplo);
+					E.EMIter = int(_EM.NumIter() - n_iter);
+					// remove rare haplotypes
+					NextHaplo.EraseDoubleHaplos(RARE_PROB, NextReducedHaplo,
+						_MainSpace.SrcIdx);
+					E.NumHaploEM = NextHaplo.Num_Haplo;
+					E.NumHaplo = NextReducedHaplo.Num_Haplo;
+					// add a SNP to the SNP genotype list
+					_GenoList.AddSNP(VarSampling[i], *_SNPMat);
+
+					// evaluate losses
+					_Init_EvalAcc(NextReducedHaplo, _GenoList);
+					int64_t t0 = TraceTime();
+					acc = _OutOfBagAccuracy(NextReducedHaplo, _GenoList,
+						&_MainSpace, prune ? Global_Max_OutOfBagAcc :
+						max_OutOfBagAcc);
+					int64_t t1 = TraceTime();
+					E.OOBTime = (t1 - t0) * 1e-9;
+					if (acc >= max_OutOfBagAcc)
+					{
+						loss = _InBagLogLik(NextReducedHaplo, _GenoList,
+							&_MainSpace);
+						E.Loss = loss;
+						E.HasLoss = true;
+						E.InBagTime = (TraceTime() - t1) * 1e-9;
+					}
+					_Done_EvalAcc();
+					E.Valid = true;
+					E.Acc = acc;
 
-				// remove the last SNP in the SNP genotype list
-				_GenoList.ReduceSNP();
+					// remove the last SNP in the SNP genotype list
+					_GenoList.ReduceSNP();
+				}
+			}
 
+			if (valid)
+			{
 				// compare
 				if (acc > max_OutOfBagAcc)
 				{
 					min_i = i;
 					min_loss = loss;
 					max_OutOfBagAcc = acc;
-					MinHaplo = NextReducedHaplo;
+					if (!parallel) MinHaplo = NextReducedHaplo;
 				} else if (acc == max_OutOfBagAcc)
 				{
 					if (loss < min_loss)
 					{
 						min_i = i;
 						min_loss = loss;
-						MinHaplo = NextReducedHaplo;
+						if (!parallel) MinHaplo = NextReducedHaplo;
 					}
 				}
 				// check and delete
@@ -1715,10 +3625,14 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 					if (acc < Global_Max_OutOfBagAcc)
 					{
 						VarSampling[i] = -1;
+						E.Pruned = true;
 					} else if (acc == Global_Max_OutOfBagAcc)
 					{
 						if ((loss > Global_Min_Loss*(1+PRUNE_RELTOL_LOGLIK)) && (min_i != i))
+						{
 							VarSampling[i] = -1;
+							E.Pruned = true;
+						}
 					}
 				}
 			}
@@ -1741,8 +3655,21 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 			sign = false;
 
 		// handle ...
+		if (TrainingTrace)
+		{
+			_WriteTrace(++n_step, n_snp, n_haplo, NumOOB, CandEval,
+				sign ? CandEval[min_i].SNP : -1);
+		}
 		if (sign)
 		{
+			if (parallel)
+			{
+				// the haplotypes of the winner (EM is deterministic)
+				_EM.PrepareNewSNP(VarSampling[min_i], OutHaplo, *_SNPMat,
+					_GenoList, NextHaplo, &_AlleleCnt[VarSampling[min_i]]);
+				_EM.ExpectationMaximization(NextHaplo);
+				NextHaplo.EraseDoubleHaplos(RARE_PROB, MinHaplo);
+			}
 			// add a new SNP predictor
 			Global_Max_OutOfBagAcc = max_OutOfBagAcc;
 			Global_Min_Loss = min_loss;
@@ -1773,310 +3700,1944 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 		}
 	}
 
+	_ParentDist.Clear();
+	_OutOfBagOrder.clear();
 	Out_Global_Max_OutOfBagAcc = 0.5 * Global_Max_OutOfBagAcc / NumOOB;
 }
 
+void CVariableSelection::_WriteTrace(int step, int n_snp, int n_haplo,
+	int NumOOB, const vector<TCandidateEval> &Eval, int winner)
+{
+	_TraceRecord.resize(Eval.size());
+	for (size_t i=0; i < Eval.size(); i++)
+	{
+		const TCandidateEval &E = Eval[i];
+		TTrainingTraceRecord &R = _TraceRecord[i];
+		R.Classifier = _TraceIdx;
+		R.Step = step;
+		R.NumSNP = n_snp;
+		R.NumHaplo = n_haplo;
+		R.SNP = E.SNP;
+		R.Valid = E.Valid;
+		R.EMIter = E.EMIter;
+		R.NumHaploEM = E.NumHaploEM;
+		R.NumHaploErase = E.NumHaplo;
+		R.OOBAcc = 0.5 * E.Acc / (E.Raced > 0 ? E.NumSamp : NumOOB);
+		R.OOBTime = E.OOBTime;
+		R.InBagLoss = E.HasLoss ? E.Loss :
+			numeric_limits<double>::quiet_NaN();
+		R.InBagTime = E.InBagTime;
+		R.Pruned = E.Pruned;
+		R.Winner = winner;
+		R.Raced = E.Raced;
+	}
+	TrainingTrace->Write(_TraceRecord);
+}
+
+
+
+// -------------------------------------------------------------------------
+// The individual classifier
+
+CAttrBag_Classifier::CAttrBag_Classifier(CAttrBag_Model &_owner)
+{
+	_Owner = &_owner;
+	_OutOfBag_Accuracy = 0;
+}
+
+void CAttrBag_Classifier::InitBootstrapCount(int SampCnt[])
+{
+	_BootstrapCount.assign(&SampCnt[0], &SampCnt[_Owner->nSamp()]);
+	_SNPIndex.clear();
+	_OutOfBag_Accuracy = 0;
+}
+
+void CAttrBag_Classifier::Assign(int n_snp, const int snpidx[],
+	const int samp_num[], int n_haplo, const double *freq, const int *hla,
+	const char *haplo[], double *_acc)
+{
+	// SNP markers
+	_SNPIndex.assign(&snpidx[0], &snpidx[n_snp]);
+	// The number of samples
+	if (samp_num)
+	{
+		const int n = _Owner->nSamp();
+		_BootstrapCount.assign(&samp_num[0], &samp_num[n]);
+	}
+	// The haplotypes
+	_Haplo.Num_SNP = n_snp;
+	_Haplo.ResizeHaplo(n_haplo);
+	_Haplo.LenPerHLA.resize(_Owner->nHLA());
+	for (int i=0; i < n_haplo; i++)
+	{
+		_Haplo.List[i] = THaplotype(haplo[i], freq[i]);
+		_Haplo.LenPerHLA[hla[i]] ++;
+	}
+	_Haplo.SetHaploAux();
+	// Accuracies
+	_OutOfBag_Accuracy = (_acc) ? (*_acc) : 0;
+}
+
+void CAttrBag_Classifier::Grow(CBaseSampling &VarSampling, int mtry,
+	bool prune, bool verbose, bool verbose_detail)
+{
+	Grow(_Owner->_VarSelect, VarSampling, mtry, prune, verbose,
+		verbose_detail);
+}
+
+void CAttrBag_Classifier::Grow(CVariableSelection &VarSelect,
+	CBaseSampling &VarSampling, int mtry, bool prune, bool verbose,
+	bool verbose_detail)
+{
+	VarSelect.InitSelection(_Owner->_SNPMat, _Owner->_HLAList,
+		&_BootstrapCount[0]);
+	VarSelect.SetTraceIndex(this - &_Owner->_ClassifierList[0]);
+	VarSelect.Search(VarSampling, _Haplo, _SNPIndex, _OutOfBag_Accuracy,
+		mtry, prune, verbose, verbose_detail);
+	_Haplo.SetHaploAux();
+}
+
+
+// -------------------------------------------------------------------------
+// the low-latency prediction of a sample
+
+/// the number of parts of the classifiers summed up separately, which does
+//    not depend on the number of threads, so the results are reproducible
+static const int PRED_LATENCY_NUM_PART = 16;
+/// the number of posterior probabilities in a slice of the tree reduction
+static const size_t PRED_LATENCY_SLICE = 4096;
+
+namespace HLA_LIB
+{
+	/// evaluate the classifiers of a sample in parallel, and sum up the
+	//    weighted posterior probabilities of the parts by a tree reduction
+	class CPredictLatency: public CParallelJob
+	{
+	public:
+		CPredictLatency(const CAttrBag_Model &model): Model(model)
+		{
+			NumPart = 0; pCtx = NULL;
+			Geno = NULL; Planes = NULL;
+			VoteMethod = 1; Reduce = false;
+		}
+
+		/// set the number of threads and initialize the buffers
+		void Init(int nthreads)
+		{
+			Pool.SetNumThread(nthreads);
+			Scratch.resize(Pool.NumThread());
+			for (size_t i=0; i < Scratch.size(); i++)
+				Scratch[i].InitPrediction(Model.nHLA());
+			const size_t nn = Model.nHLA()*(Model.nHLA()+1)/2;
+			NumPart = min(PRED_LATENCY_NUM_PART,
+				(int)Model._ClassifierList.size());
+			Part.resize(NumPart);
+			for (int i=0; i < NumPart; i++) Part[i].resize(nn);
+			PartWeight.resize(NumPart);
+			PartMatching.resize(NumPart);
+		}
+
+		/// predict a sample using the posterior probabilities and the caches
+		//    of classifiers in 'Ctx'
+		void Predict(TPredContext &Ctx, const int geno[],
+			const uint64_t planes[], int vote_method, double &OutMatching)
+		{
+			pCtx = &Ctx; Geno = geno; Planes = planes;
+			VoteMethod = vote_method;
+
+			// evaluate the parts of classifiers
+			Reduce = false;
+			Pool.Run(*this, NumPart);
+
+			// the weights and the matching proportions
+			for (int s=1; s < NumPart; s <<= 1)
+			{
+				for (int i=0; i+s < NumPart; i += 2*s)
+				{
+					PartWeight[i] += PartWeight[i+s];
+					PartMatching[i] += PartMatching[i+s];
+				}
+			}
+			// the posterior probabilities in slices
+			Reduce = true;
+			const size_t nn = Part[0].size();
+			Pool.Run(*this, (nn + PRED_LATENCY_SLICE - 1) / PRED_LATENCY_SLICE);
+
+			// output
+			CAlg_Prediction &P = Ctx.Predict;
+			P._SumPostProb.swap(Part[0]);
+			P._Sum_Weight = PartWeight[0];
+			P.NormalizeSumPostProb();
+			OutMatching = PartMatching[0] / Model._ClassifierList.size();
+			pCtx = NULL;
+		}
+
+		virtual void Run(int idx, int thread_idx)
+		{
+			if (!Reduce)
+			{
+				// the classifiers in the 'idx'-th part
+				const size_t n = Model._ClassifierList.size();
+				const size_t st = n * idx / NumPart;
+				const size_t ed = n * (idx + 1) / NumPart;
+				CAlg_Prediction &P = Scratch[thread_idx];
+				P._SumPostProb.swap(Part[idx]);
+				P.InitSumPostProbBuffer();
+				double sum_pb=0, pb;
+				for (size_t c_i=st; c_i < ed; c_i++)
+				{
+					// the cache of a classifier is used by one part only
+					if (Model._AddClassifier(P, pCtx->Cache[c_i], c_i, Geno,
+							Planes, VoteMethod, pb))
+						sum_pb += pb;
+				}
+				PartWeight[idx] = P._Sum_Weight;
+				PartMatching[idx] = sum_pb;
+				P._SumPostProb.swap(Part[idx]);
+			} else {
+				// the tree reduction of the 'idx'-th slice
+				const size_t st = idx * PRED_LATENCY_SLICE;
+				const size_t n = min(PRED_LATENCY_SLICE, Part[0].size() - st);
+				for (int s=1; s < NumPart; s <<= 1)
+				{
+					for (int i=0; i+s < NumPart; i += 2*s)
+					{
+						double *p = &Part[i][st];
+						const double *q = &Part[i+s][st];
+						for (size_t k=0; k < n; k++) p[k] += q[k];
+					}
+				}
+			}
+		}
+
+	private:
+		const CAttrBag_Model &Model;
+		/// the warm thread pool
+		CThreadPool Pool;
+		/// the posterior probabilities of a classifier in each thread
+		vector<CAlg_Prediction> Scratch;
+		/// the sums of each part
+		vector< vector<double> > Part;
+		vector<double> PartWeight, PartMatching;
+		int NumPart;
+		/// the current sample
+		TPredContext *pCtx;
+		const int *Geno;
+		const uint64_t *Planes;
+		int VoteMethod;
+		bool Reduce;
+	};
+}
+
+
+// -------------------------------------------------------------------------
+// the attribute bagging model
+
+CAttrBag_Model::CAttrBag_Model()
+{
+	_PredPrepared = false;
+	_ModelFile = NULL;
+	_TrainingFile = NULL;
+	_Checkpoint = NULL;
+	_Latency = NULL;
+}
+
+CAttrBag_Model::~CAttrBag_Model()
+{
+	if (_Latency) delete _Latency;
+	_Latency = NULL;
+	CloseCheckpoint();
+	// the haplotypes may refer to the mapped file
+	_ClassifierList.clear();
+	if (_ModelFile) delete _ModelFile;
+	_ModelFile = NULL;
+	// the genotypes may refer to the mapped file
+	_SNPMat.Init(0, 0, NULL);
+	if (_TrainingFile) delete _TrainingFile;
+	_TrainingFile = NULL;
+}
+
+void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int n_hla)
+{
+	HIBAG_CHECKING(n_snp < 0, "CAttrBag_Model::InitTraining, n_snp error.")
+	HIBAG_CHECKING(n_samp < 0, "CAttrBag_Model::InitTraining, n_samp error.")
+	HIBAG_CHECKING(n_hla < 0, "CAttrBag_Model::InitTraining, n_hla error.")
+
+	_SNPMat.Init(n_snp, n_samp, NULL);
+
+	_HLAList.List.resize(n_samp);
+	_HLAList.Str_HLA_Allele.resize(n_hla);
+}
+
+void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int *snp_geno,
+	int n_hla, int *H1, int *H2)
+{
+	HIBAG_CHECKING(n_snp < 0, "CAttrBag_Model::InitTraining, n_snp error.")
+	HIBAG_CHECKING(n_samp < 0, "CAttrBag_Model::InitTraining, n_samp error.")
+	HIBAG_CHECKING(n_hla < 0, "CAttrBag_Model::InitTraining, n_hla error.")
+
+	// the genotypes are copied, 'snp_geno' is not used after return
+	_SNPMat.Init(n_snp, n_samp, snp_geno);
+
+	_HLAList.List.resize(n_samp);
+	_HLAList.Str_HLA_Allele.resize(n_hla);
+	for (int i=0; i < n_samp; i++)
+	{
+		HIBAG_CHECKING(H1[i]<0 || H1[i]>=n_hla,
+			"CAttrBag_Model::InitTraining, H1 error.");
+		HIBAG_CHECKING(H2[i]<0 || H2[i]>=n_hla,
+			"CAttrBag_Model::InitTraining, H2 error.");
+		_HLAList.List[i].Allele1 = H1[i];
+		_HLAList.List[i].Allele2 = H2[i];
+	}
+}
+
+CAttrBag_Classifier *CAttrBag_Model::NewClassifierBootstrap()
+{
+	_ResetPredict();
+	_ClassifierList.push_back(CAttrBag_Classifier(*this));
+	CAttrBag_Classifier *I = &_ClassifierList.back();
+
+	vector<int> S(nSamp());
+	RandomBootstrap(S, NULL);
+	I->InitBootstrapCount(&S[0]);
+
+	return I;
+}
+
+CAttrBag_Classifier *CAttrBag_Model::NewClassifierAllSamp()
+{
+	_ResetPredict();
+	_ClassifierList.push_back(CAttrBag_Classifier(*this));
+	CAttrBag_Classifier *I = &_ClassifierList.back();
+
+	vector<int> S(nSamp(), 1);
+	I->InitBootstrapCount(&S[0]);
+
+	return I;
+}
+
+// -------------------------------------------------------------------------
+// The binary model file (native byte order, checked when loading):
+//   the header, the metadata block, the table of classifiers, and for each
+//   classifier, the SNP indices, the bootstrap counts, the numbers of
+//   haplotypes per HLA allele (int32) and the haplotypes (THaplotype
+//   records aligned to 32 bytes, with aux.Freq_f32 and aux.HLA_allele set)
+
+static const char MODEL_FILE_MAGIC[8] =
+	{ 'H', 'I', 'B', 'A', 'G', 'M', 'O', 'D' };
+static const uint32_t MODEL_FILE_BYTE_ORDER = 0x01020304;
+
+/// the header of the binary model file
+struct TModelFileHeader
+{
+	char Magic[8];            //< MODEL_FILE_MAGIC
+	uint32_t Version;         //< HIBAG_MODEL_FILE_VERSION
+	uint32_t ByteOrder;       //< MODEL_FILE_BYTE_ORDER
+	uint32_t HaploSize;       //< sizeof(THaplotype)
+	int32_t NumSNP;           //< the number of SNPs in the model
+	int32_t NumSamp;          //< the number of training samples
+	int32_t NumHLA;           //< the number of unique HLA alleles
+	int32_t NumClassifier;    //< the number of individual classifiers
+	int32_t Reserved;
+	int64_t MetaOffset;       //< the metadata block
+	int64_t MetaSize;
+	int64_t ClassifierOffset; //< the table of TModelFileClassifier
+	int64_t FileSize;         //< the total number of bytes
+};
+
+/// an individual classifier in the binary model file
+struct TModelFileClassifier
+{
+	int32_t NumSNP;           //< the number of SNPs
+	int32_t NumHaplo;         //< the number of haplotypes
+	double Accuracy;          //< the out-of-bag accuracy
+	int64_t SNPOffset;        //< NumSNP SNP indices
+	int64_t BootstrapOffset;  //< NumSamp bootstrap counts, 0 if not saved
+	int64_t LenPerHLAOffset;  //< NumHLA numbers of haplotypes
+	int64_t HaploOffset;      //< NumHaplo haplotypes
+};
+
+/// fseek() with a 64-bit offset, since 'long' is 32-bit on Windows
+static inline int FileSeek(FILE *f, int64_t offset, int origin)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, origin);
+#else
+	return fseeko(f, (off_t)offset, origin);
+#endif
+}
 
+/// the sequential writer of the binary model file
+class CModelFileWriter
+{
+public:
+	CModelFileWriter(const char *fn)
+	{
+		_fn = fn; _Pos = 0;
+		_File = fopen(fn, "wb");
+		if (!_File)
+			throw ErrHLA("Fail to create the file \"%s\".", fn);
+	}
+	~CModelFileWriter()
+	{
+		if (_File) fclose(_File);
+	}
+
+	inline int64_t Position() const { return _Pos; }
+
+	void Write(const void *buf, size_t size)
+	{
+		if (size > 0 && fwrite(buf, 1, size, _File) != size)
+			throw ErrHLA("Fail to write the file \"%s\".", _fn);
+		_Pos += size;
+	}
+	void Write(const vector<int32_t> &buf)
+	{
+		if (!buf.empty()) Write(&buf[0], sizeof(int32_t)*buf.size());
+	}
+	/// pad zeros until the position is a multiple of 'align'
+	void Align(int align)
+	{
+		static const UINT8 Zero[32] = { 0 };
+		Write(Zero, (align - _Pos % align) % align);
+	}
+	/// rewrite a block at the beginning of the file
+	void Rewrite(int64_t pos, const void *buf, size_t size)
+	{
+		if (FileSeek(_File, pos, SEEK_SET) != 0 ||
+				fwrite(buf, 1, size, _File) != size)
+			throw ErrHLA("Fail to write the file \"%s\".", _fn);
+		FileSeek(_File, 0, SEEK_END);
+	}
+	void Close()
+	{
+		int r = fclose(_File);
+		_File = NULL;
+		if (r != 0)
+			throw ErrHLA("Fail to write the file \"%s\".", _fn);
+	}
+
+private:
+	FILE *_File;
+	const char *_fn;
+	int64_t _Pos;
+};
+
+void CAttrBag_Model::SaveBinary(const char *fn, const void *meta,
+	size_t meta_size) const
+{
+	const int n_hla = nHLA();
+	const int n_classifier = _ClassifierList.size();
+
+	TModelFileHeader Header;
+	memset(&Header, 0, sizeof(Header));
+	memcpy(Header.Magic, MODEL_FILE_MAGIC, sizeof(Header.Magic));
+	Header.Version = HIBAG_MODEL_FILE_VERSION;
+	Header.ByteOrder = MODEL_FILE_BYTE_ORDER;
+	Header.HaploSize = sizeof(THaplotype);
+	Header.NumSNP = nSNP();
+	Header.NumSamp = nSamp();
+	Header.NumHLA = n_hla;
+	Header.NumClassifier = n_classifier;
+
+	TModelFileClassifier Empty;
+	memset(&Empty, 0, sizeof(Empty));
+	vector<TModelFileClassifier> Table(n_classifier, Empty);
+	const size_t table_size = sizeof(TModelFileClassifier)*n_classifier;
+
+	CModelFileWriter W(fn);
+	W.Write(&Header, sizeof(Header));
+	Header.MetaOffset = W.Position();
+	Header.MetaSize = meta_size;
+	W.Write(meta, meta_size);
+	W.Align(8);
+	Header.ClassifierOffset = W.Position();
+	if (n_classifier > 0) W.Write(&Table[0], table_size);
+
+	vector<int32_t> buf;
+	for (int i=0; i < n_classifier; i++)
+	{
+		const CAttrBag_Classifier &C = _ClassifierList[i];
+		TModelFileClassifier &T = Table[i];
+		T.NumSNP = C.nSNP();
+		T.NumHaplo = C.nHaplo();
+		T.Accuracy = C.OutOfBag_Accuracy();
+		// SNP indices
+		W.Align(4);
+		T.SNPOffset = W.Position();
+		buf.assign(C.SNPIndex().begin(), C.SNPIndex().end());
+		W.Write(buf);
+		// bootstrap counts
+		if ((int)C.BootstrapCount().size() == nSamp())
+		{
+			T.BootstrapOffset = W.Position();
+			buf.assign(C.BootstrapCount().begin(), C.BootstrapCount().end());
+			W.Write(buf);
+		}
+		// the numbers of haplotypes per HLA allele
+		T.LenPerHLAOffset = W.Position();
+		buf.assign(n_hla, 0);
+		const vector<size_t> &Len = C.Haplotype().LenPerHLA;
+		for (size_t k=0; k < Len.size() && (int)k < n_hla; k++)
+			buf[k] = Len[k];
+		W.Write(buf);
+		// haplotypes
+		W.Align(32);
+		T.HaploOffset = W.Position();
+		CHaplotypeList H(C.Haplotype());
+		H.SetHaploAux();
+		W.Write(H.List, sizeof(THaplotype)*H.Num_Haplo);
+	}
+
+	Header.FileSize = W.Position();
+	W.Rewrite(0, &Header, sizeof(Header));
+	if (n_classifier > 0)
+		W.Rewrite(Header.ClassifierOffset, &Table[0], table_size);
+	W.Close();
+}
+
+void CAttrBag_Model::LoadBinary(const char *fn)
+{
+	HIBAG_CHECKING(!_ClassifierList.empty() || _ModelFile,
+		"CAttrBag_Model::LoadBinary, the model should be empty.");
+
+	// the pages are shared until written (e.g., by the GPU extension)
+	CMappedFile *F = new CMappedFile;
+	try {
+		F->Open(fn, true);
+	} catch (...) {
+		delete F; throw;
+	}
+	_ModelFile = F;
+	UINT8 *base = const_cast<UINT8*>(F->Data());
+	const int64_t size = F->Size();
+
+	// check the header
+	static const char *err_fmt = "Invalid binary model file \"%s\".";
+	if (size < (int64_t)sizeof(TModelFileHeader))
+		throw ErrHLA(err_fmt, fn);
+	const TModelFileHeader &Header = *(const TModelFileHeader*)base;
+	if (memcmp(Header.Magic, MODEL_FILE_MAGIC, sizeof(Header.Magic)) != 0)
+		throw ErrHLA(err_fmt, fn);
+	if (Header.ByteOrder != MODEL_FILE_BYTE_ORDER)
+		throw ErrHLA("The byte order of \"%s\" is not supported.", fn);
+	if (Header.Version != HIBAG_MODEL_FILE_VERSION)
+	{
+		throw ErrHLA("The binary model file \"%s\" (v%u) is not supported.",
+			fn, Header.Version);
+	}
+	if (Header.HaploSize != sizeof(THaplotype) || Header.FileSize != size ||
+			Header.NumSNP <= 0 || Header.NumSamp <= 0 || Header.NumHLA <= 0 ||
+			Header.NumClassifier < 0)
+		throw ErrHLA(err_fmt, fn);
+
+	// whether [offset, offset + n*elm_size) is in the file
+	#define IN_FILE(offset, n, elm_size, align)    \
+		((offset) > 0 && (offset) % (align) == 0 && (offset) <= size && \
+		(int64_t)(n) <= (size - (offset)) / (int64_t)(elm_size))
+
+	if (!IN_FILE(Header.MetaOffset, Header.MetaSize, 1, 1) ||
+			!IN_FILE(Header.ClassifierOffset, Header.NumClassifier,
+				sizeof(TModelFileClassifier), 8))
+		throw ErrHLA(err_fmt, fn);
+
+	InitTraining(Header.NumSNP, Header.NumSamp, Header.NumHLA);
+	_ResetPredict();
+	const int n_hla = Header.NumHLA;
+	const TModelFileClassifier *T =
+		(const TModelFileClassifier*)(base + Header.ClassifierOffset);
+
+	// the haplotypes refer to the mapped file, avoid moving the classifiers
+	_ClassifierList.reserve(Header.NumClassifier);
+	for (int i=0; i < Header.NumClassifier; i++, T++)
+	{
+		if (T->NumSNP <= 0 ||
+				(size_t)T->NumSNP > HIBAG_MAXNUM_SNP_IN_CLASSIFIER ||
+				T->NumHaplo <= 0 ||
+				!IN_FILE(T->SNPOffset, T->NumSNP, sizeof(int32_t), 4) ||
+				!IN_FILE(T->LenPerHLAOffset, n_hla, sizeof(int32_t), 4) ||
+				!IN_FILE(T->HaploOffset, T->NumHaplo, sizeof(THaplotype), 32))
+			throw ErrHLA(err_fmt, fn);
+		if (T->BootstrapOffset != 0 &&
+				!IN_FILE(T->BootstrapOffset, Header.NumSamp, sizeof(int32_t), 4))
+			throw ErrHLA(err_fmt, fn);
+
+		_ClassifierList.push_back(CAttrBag_Classifier(*this));
+		CAttrBag_Classifier &C = _ClassifierList.back();
+		C._OutOfBag_Accuracy = T->Accuracy;
+
+		const int32_t *s = (const int32_t*)(base + T->SNPOffset);
+		C._SNPIndex.assign(s, s + T->NumSNP);
+		for (int k=0; k < T->NumSNP; k++)
+		{
+			if (s[k] < 0 || s[k] >= Header.NumSNP)
+				throw ErrHLA(err_fmt, fn);
+		}
+		if (T->BootstrapOffset != 0)
+		{
+			s = (const int32_t*)(base + T->BootstrapOffset);
+			C._BootstrapCount.assign(s, s + Header.NumSamp);
+		}
+
+		s = (const int32_t*)(base + T->LenPerHLAOffset);
+		C._Haplo.LenPerHLA.assign(s, s + n_hla);
+		int64_t n_haplo = 0;
+		for (int k=0; k < n_hla; k++)
+		{
+			if (s[k] < 0) throw ErrHLA(err_fmt, fn);
+			n_haplo += s[k];
+		}
+		if (n_haplo != T->NumHaplo)
+			throw ErrHLA(err_fmt, fn);
+
+		C._Haplo.Num_SNP = T->NumSNP;
+		C._Haplo.AssignExternal((THaplotype*)(base + T->HaploOffset),
+			T->NumHaplo);
+	}
+
+	#undef IN_FILE
+}
+
+const UINT8 *CAttrBag_Model::BinaryMeta(size_t &OutSize) const
+{
+	if (_ModelFile)
+	{
+		const TModelFileHeader &Header =
+			*(const TModelFileHeader*)_ModelFile->Data();
+		OutSize = Header.MetaSize;
+		return _ModelFile->Data() + Header.MetaOffset;
+	} else {
+		OutSize = 0;
+		return NULL;
+	}
+}
+
+// -------------------------------------------------------------------------
+// The preprocessed training file (native byte order, checked when loading):
+//   the header, the packed genotypes (CSNPGenoMatrix::Packed aligned to 64
+//   bytes) and the HLA types of the samples (int32 pairs)
+
+static const char TRAINING_FILE_MAGIC[8] =
+	{ 'H', 'I', 'B', 'A', 'G', 'T', 'R', 'N' };
+
+/// the header of the training file
+struct TTrainingFileHeader
+{
+	char Magic[8];            //< TRAINING_FILE_MAGIC
+	uint32_t Version;         //< HIBAG_TRAINING_FILE_VERSION
+	uint32_t ByteOrder;       //< MODEL_FILE_BYTE_ORDER
+	int32_t NumSNP;           //< the number of SNPs
+	int32_t NumSamp;          //< the number of training samples
+	int32_t NumHLA;           //< the number of unique HLA alleles
+	int32_t Reserved;
+	int64_t GenoOffset;       //< NumSNP*((NumSamp+31)/32) 64-bit words
+	int64_t HLAOffset;        //< NumSamp pairs of HLA alleles
+	int64_t FileSize;         //< the total number of bytes
+};
+
+void CAttrBag_Model::SaveTraining(const char *fn) const
+{
+	HIBAG_CHECKING(nSamp() > 0 && !_SNPMat.Packed,
+		"CAttrBag_Model::SaveTraining, no genotype.");
+
+	TTrainingFileHeader Header;
+	memset(&Header, 0, sizeof(Header));
+	memcpy(Header.Magic, TRAINING_FILE_MAGIC, sizeof(Header.Magic));
+	Header.Version = HIBAG_TRAINING_FILE_VERSION;
+	Header.ByteOrder = MODEL_FILE_BYTE_ORDER;
+	Header.NumSNP = nSNP();
+	Header.NumSamp = nSamp();
+	Header.NumHLA = nHLA();
+
+	CModelFileWriter W(fn);
+	W.Write(&Header, sizeof(Header));
+	// at most 32 bytes are padded each time
+	W.Align(32); W.Align(64);
+	Header.GenoOffset = W.Position();
+	W.Write(_SNPMat.Packed, sizeof(uint64_t)*_SNPMat.PackedSize());
+	Header.HLAOffset = W.Position();
+	vector<int32_t> buf(2*nSamp());
+	for (int i=0; i < nSamp(); i++)
+	{
+		buf[2*i] = _HLAList.List[i].Allele1;
+		buf[2*i+1] = _HLAList.List[i].Allele2;
+	}
+	W.Write(buf);
+
+	Header.FileSize = W.Position();
+	W.Rewrite(0, &Header, sizeof(Header));
+	W.Close();
+}
+
+void CAttrBag_Model::LoadTraining(const char *fn)
+{
+	HIBAG_CHECKING(!_ClassifierList.empty() || _ModelFile || _TrainingFile,
+		"CAttrBag_Model::LoadTraining, the model should be empty.");
+
+	// read-only, the pages are shared by all processes mapping the file
+	CMappedFile *F = new CMappedFile;
+	try {
+		F->Open(fn, false);
+	} catch (...) {
+		delete F; throw;
+	}
+	_TrainingFile = F;
+	const UINT8 *base = F->Data();
+	const int64_t size = F->Size();
+
+	// check the header
+	static const char *err_fmt = "Invalid training file \"%s\".";
+	if (size < (int64_t)sizeof(TTrainingFileHeader))
+		throw ErrHLA(err_fmt, fn);
+	const TTrainingFileHeader &Header = *(const TTrainingFileHeader*)base;
+	if (memcmp(Header.Magic, TRAINING_FILE_MAGIC, sizeof(Header.Magic)) != 0)
+		throw ErrHLA(err_fmt, fn);
+	if (Header.ByteOrder != MODEL_FILE_BYTE_ORDER)
+		throw ErrHLA("The byte order of \"%s\" is not supported.", fn);
+	if (Header.Version != HIBAG_TRAINING_FILE_VERSION)
+	{
+		throw ErrHLA("The training file \"%s\" (v%u) is not supported.",
+			fn, Header.Version);
+	}
+	if (Header.FileSize != size || Header.NumSNP <= 0 ||
+			Header.NumSamp <= 0 || Header.NumHLA <= 0)
+		throw ErrHLA(err_fmt, fn);
+
+	const int64_t n_word =
+		int64_t(Header.NumSNP) * ((Header.NumSamp + 31) / 32);
+	if (Header.GenoOffset <= 0 || Header.GenoOffset % 64 != 0 ||
+			Header.GenoOffset > size ||
+			n_word > (size - Header.GenoOffset) / (int64_t)sizeof(uint64_t) ||
+			Header.HLAOffset != Header.GenoOffset + n_word*8 ||
+			int64_t(Header.NumSamp) * 8 != size - Header.HLAOffset)
+		throw ErrHLA(err_fmt, fn);
+
+	InitTraining(Header.NumSNP, Header.NumSamp, Header.NumHLA);
+	_SNPMat.InitPacked(Header.NumSNP, Header.NumSamp,
+		(const uint64_t*)(base + Header.GenoOffset));
+
+	const int32_t *h = (const int32_t*)(base + Header.HLAOffset);
+	for (int i=0; i < Header.NumSamp; i++, h+=2)
+	{
+		if (h[0] < 0 || h[0] >= Header.NumHLA ||
+				h[1] < 0 || h[1] >= Header.NumHLA)
+			throw ErrHLA(err_fmt, fn);
+		_HLAList.List[i].Allele1 = h[0];
+		_HLAList.List[i].Allele2 = h[1];
+	}
+}
+
+// -------------------------------------------------------------------------
+// The checkpoint file (native byte order, checked when resuming):
+//   the header, followed by the records of finished classifiers in the order
+//   of completion, each with TCheckpointRecord, the SNP indices, the
+//   bootstrap counts, the numbers of haplotypes per HLA allele (int32) and
+//   the haplotypes (THaplotype records)
+
+static const char CHECKPOINT_MAGIC[8] =
+	{ 'H', 'I', 'B', 'A', 'G', 'C', 'K', 'P' };
+static const uint32_t CHECKPOINT_RECORD_MARK = 0x4B435243;
+
+/// the header of the checkpoint file
+struct TCheckpointHeader
+{
+	char Magic[8];            //< CHECKPOINT_MAGIC
+	uint32_t Version;         //< HIBAG_CHECKPOINT_VERSION
+	uint32_t ByteOrder;       //< MODEL_FILE_BYTE_ORDER
+	uint32_t HaploSize;       //< sizeof(THaplotype)
+	int32_t NumSNP;           //< the number of SNPs
+	int32_t NumSamp;          //< the number of training samples
+	int32_t NumHLA;           //< the number of unique HLA alleles
+	int32_t MTry;             //< the number of candidate SNPs per step
+	int32_t Prune;            //< whether to prune the candidate SNPs
+	int32_t EMAccel;          //< whether to accelerate EM algorithm
+	int32_t Racing;           //< whether to race the candidate SNPs
+	int32_t Parallel;         //< whether built by the compute nodes
+	int32_t Padding;          //< 0
+	uint64_t DataHash;        //< the hash of the training data
+	uint64_t Seed;            //< the seed of the random stream
+	double RaceSampFrac;      //< Search_Racing.SampFrac if racing, or 0
+	double RaceKeepFrac;      //< Search_Racing.KeepFrac if racing, or 0
+	double RaceEMRelTol;      //< Search_Racing.EMRelTol if racing, or 0
+};
+
+/// the header of a finished classifier in the checkpoint file
+struct TCheckpointRecord
+{
+	uint32_t Mark;            //< CHECKPOINT_RECORD_MARK
+	int32_t Index;            //< the index of the classifier
+	int32_t NumSNP;           //< the number of SNPs
+	int32_t NumHaplo;         //< the number of haplotypes
+	double Accuracy;          //< the out-of-bag accuracy
+	int64_t Size;             //< the number of bytes following this header
+	uint64_t Checksum;        //< the hash of the bytes following this header
+};
+
+/// FNV-1a hash
+static uint64_t HashBytes(const void *buf, size_t n,
+	uint64_t h = 14695981039346656037ULL)
+{
+	const UINT8 *p = (const UINT8*)buf;
+	for (size_t i=0; i < n; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/// append an int32 array to a buffer
+static void AppendInt32(vector<UINT8> &buf, const int32_t *p, size_t n)
+{
+	const UINT8 *s = (const UINT8*)p;
+	buf.insert(buf.end(), s, s + sizeof(int32_t)*n);
+}
+
+CBuildCheckpoint::CBuildCheckpoint()
+{
+	_File = NULL;
+	_Seed = 0;
+	_NumSNP = _NumSamp = _NumHLA = 0;
+	_End = 0;
+}
+
+CBuildCheckpoint::~CBuildCheckpoint()
+{
+	Close();
+}
+
+void CBuildCheckpoint::Open(const char *fn, const CAttrBag_Model &Model,
+	int mtry, bool prune, uint64_t seed, bool parallel)
+{
+	Close();
+	_FileName = fn;
+	_NumSNP = Model.nSNP();
+	_NumSamp = Model.nSamp();
+	_NumHLA = Model.nHLA();
+
+	// the header of the training data and parameters
+	TCheckpointHeader H;
+	memset(&H, 0, sizeof(H));
+	memcpy(H.Magic, CHECKPOINT_MAGIC, sizeof(H.Magic));
+	H.Version = HIBAG_CHECKPOINT_VERSION;
+	H.ByteOrder = MODEL_FILE_BYTE_ORDER;
+	H.HaploSize = sizeof(THaplotype);
+	H.NumSNP = _NumSNP;
+	H.NumSamp = _NumSamp;
+	H.NumHLA = _NumHLA;
+	H.MTry = mtry;
+	H.Prune = prune ? 1 : 0;
+	H.EMAccel = EM_Accelerate ? 1 : 0;
+	H.Racing = Search_Racing.Enabled ? 1 : 0;
+	H.Parallel = parallel ? 1 : 0;
+	if (Search_Racing.Enabled)
+	{
+		H.RaceSampFrac = Search_Racing.SampFrac;
+		H.RaceKeepFrac = Search_Racing.KeepFrac;
+		H.RaceEMRelTol = Search_Racing.EMRelTol;
+	}
+	H.DataHash = HashBytes(NULL, 0);
+	const CSNPGenoMatrix &Geno = Model._SNPMat;
+	if (Geno.PackedSize() > 0)
+	{
+		H.DataHash = HashBytes(Geno.Packed, sizeof(uint64_t)*Geno.PackedSize(),
+			H.DataHash);
+	}
+	for (int i=0; i < _NumSamp; i++)
+	{
+		const THLAType &T = Model._HLAList.List[i];
+		const int32_t a[2] = { T.Allele1, T.Allele2 };
+		H.DataHash = HashBytes(a, sizeof(a), H.DataHash);
+	}
+	H.Seed = seed;
+	_Offset.clear();
+
+	_File = fopen(fn, "r+b");
+	if (!_File)
+	{
+		// a new file
+		_File = fopen(fn, "w+b");
+		if (!_File)
+			throw ErrHLA("Fail to create the checkpoint file \"%s\".", fn);
+		if (fwrite(&H, sizeof(H), 1, _File) != 1 || fflush(_File) != 0)
+			throw ErrHLA("Fail to write the checkpoint file \"%s\".", fn);
+		_Seed = seed;
+		_End = sizeof(H);
+		return;
+	}
+
+	// check the header
+	TCheckpointHeader F;
+	if (fread(&F, sizeof(F), 1, _File) != 1 ||
+			memcmp(F.Magic, CHECKPOINT_MAGIC, sizeof(F.Magic)) != 0)
+		throw ErrHLA("Invalid checkpoint file \"%s\".", fn);
+	if (F.Version != H.Version || F.ByteOrder != H.ByteOrder ||
+			F.HaploSize != H.HaploSize)
+		throw ErrHLA("The checkpoint file \"%s\" is not supported.", fn);
+	if (F.NumSNP != H.NumSNP || F.NumSamp != H.NumSamp ||
+			F.NumHLA != H.NumHLA || F.DataHash != H.DataHash)
+	{
+		throw ErrHLA("The checkpoint file \"%s\" does not match the training data.",
+			fn);
+	}
+	if (F.MTry != H.MTry || F.Prune != H.Prune || F.EMAccel != H.EMAccel ||
+			F.Racing != H.Racing || F.Parallel != H.Parallel ||
+			F.RaceSampFrac != H.RaceSampFrac ||
+			F.RaceKeepFrac != H.RaceKeepFrac || F.RaceEMRelTol != H.RaceEMRelTol)
+	{
+		throw ErrHLA("The checkpoint file \"%s\" does not match the training parameters.",
+			fn);
+	}
+	_Seed = F.Seed;
+
+	// scan the records, and stop at a record truncated by an interruption
+	_End = sizeof(F);
+	int idx, n_snp, n_haplo;
+	double acc;
+	vector<UINT8> buf;
+	while (_ReadRecord(idx, n_snp, n_haplo, acc, buf))
+	{
+		if (idx >= (int)_Offset.size())
+			_Offset.resize(idx + 1, -1);
+		if (_Offset[idx] < 0)
+			_Offset[idx] = _End;
+		_End += sizeof(TCheckpointRecord) + buf.size();
+	}
+
+	// the next record overwrites the truncated one
+	if (FileSeek(_File, _End, SEEK_SET) != 0)
+		throw ErrHLA("Fail to read the checkpoint file \"%s\".", fn);
+#ifndef _WIN32
+	if (ftruncate(fileno(_File), (off_t)_End) != 0)
+		throw ErrHLA("Fail to write the checkpoint file \"%s\".", fn);
+#endif
+}
+
+void CBuildCheckpoint::Close()
+{
+	if (_File) fclose(_File);
+	_File = NULL;
+	_Offset.clear();
+}
+
+int CBuildCheckpoint::NumClassifier() const
+{
+	int n = 0;
+	for (size_t i=0; i < _Offset.size(); i++)
+		if (_Offset[i] >= 0) n ++;
+	return n;
+}
+
+bool CBuildCheckpoint::Has(int idx) const
+{
+	return (0 <= idx) && (idx < (int)_Offset.size()) && (_Offset[idx] >= 0);
+}
+
+bool CBuildCheckpoint::_ReadRecord(int &idx, int &n_snp, int &n_haplo,
+	double &acc, vector<UINT8> &buf)
+{
+	TCheckpointRecord R;
+	if (fread(&R, sizeof(R), 1, _File) != 1)
+		return false;
+	if (R.Mark != CHECKPOINT_RECORD_MARK || R.Index < 0 ||
+			R.NumSNP <= 0 ||
+			(size_t)R.NumSNP > HIBAG_MAXNUM_SNP_IN_CLASSIFIER ||
+			R.NumHaplo <= 0)
+		return false;
+	const int64_t size = sizeof(int32_t)*int64_t(R.NumSNP + _NumSamp +
+		_NumHLA) + sizeof(THaplotype)*int64_t(R.NumHaplo);
+	if (R.Size != size)
+		return false;
+	buf.resize(size);
+	if (fread(&buf[0], 1, size, _File) != (size_t)size)
+		return false;
+	if (HashBytes(&buf[0], size) != R.Checksum)
+		return false;
+
+	idx = R.Index;
+	n_snp = R.NumSNP;
+	n_haplo = R.NumHaplo;
+	acc = R.Accuracy;
+	return true;
+}
+
+void CBuildCheckpoint::Load(int idx, CAttrBag_Classifier &C)
+{
+	HIBAG_CHECKING(!Has(idx),
+		"CBuildCheckpoint::Load, the classifier is not in the file.");
+
+	static const char *err_fmt = "Invalid checkpoint file \"%s\".";
+	const char *fn = _FileName.c_str();
+	int n_snp, n_haplo;
+	double acc;
+	vector<UINT8> buf;
+	if (FileSeek(_File, _Offset[idx], SEEK_SET) != 0 ||
+			!_ReadRecord(idx, n_snp, n_haplo, acc, buf) ||
+			FileSeek(_File, _End, SEEK_SET) != 0)
+		throw ErrHLA("Fail to read the checkpoint file \"%s\".", fn);
+
+	const int32_t *s = (const int32_t*)&buf[0];
+	C._OutOfBag_Accuracy = acc;
+	// SNP indices
+	C._SNPIndex.assign(s, s + n_snp);
+	for (int k=0; k < n_snp; k++)
+	{
+		if (s[k] < 0 || s[k] >= _NumSNP)
+			throw ErrHLA(err_fmt, fn);
+	}
+	s += n_snp;
+	// bootstrap counts
+	C._BootstrapCount.assign(s, s + _NumSamp);
+	s += _NumSamp;
+	// the numbers of haplotypes per HLA allele
+	C._Haplo.LenPerHLA.assign(s, s + _NumHLA);
+	int64_t n = 0;
+	for (int k=0; k < _NumHLA; k++)
+	{
+		if (s[k] < 0) throw ErrHLA(err_fmt, fn);
+		n += s[k];
+	}
+	if (n != n_haplo)
+		throw ErrHLA(err_fmt, fn);
+	s += _NumHLA;
+	// haplotypes
+	C._Haplo.Num_SNP = n_snp;
+	C._Haplo.ResizeHaplo(n_haplo);
+	memcpy((void*)C._Haplo.List, s, sizeof(THaplotype)*n_haplo);
+	C._Haplo.SetHaploAux();
+}
+
+void CBuildCheckpoint::Append(int idx, const CAttrBag_Classifier &C)
+{
+	// the record
+	vector<UINT8> buf;
+	vector<int32_t> v(C.SNPIndex().begin(), C.SNPIndex().end());
+	AppendInt32(buf, &v[0], v.size());
+	v.assign(C.BootstrapCount().begin(), C.BootstrapCount().end());
+	v.resize(_NumSamp, 0);
+	AppendInt32(buf, &v[0], v.size());
+	v.assign(_NumHLA, 0);
+	const vector<size_t> &Len = C.Haplotype().LenPerHLA;
+	for (size_t k=0; k < Len.size() && (int)k < _NumHLA; k++)
+		v[k] = Len[k];
+	AppendInt32(buf, &v[0], v.size());
+	CHaplotypeList H(C.Haplotype());
+	H.SetHaploAux();
+	const UINT8 *p = (const UINT8*)H.List;
+	buf.insert(buf.end(), p, p + sizeof(THaplotype)*H.Num_Haplo);
+
+	TCheckpointRecord R;
+	memset(&R, 0, sizeof(R));
+	R.Mark = CHECKPOINT_RECORD_MARK;
+	R.Index = idx;
+	R.NumSNP = C.nSNP();
+	R.NumHaplo = C.nHaplo();
+	R.Accuracy = C.OutOfBag_Accuracy();
+	R.Size = buf.size();
+	R.Checksum = HashBytes(&buf[0], buf.size());
+
+	// write and flush to the disk
+	if (fwrite(&R, sizeof(R), 1, _File) != 1 ||
+			fwrite(&buf[0], 1, buf.size(), _File) != buf.size() ||
+			fflush(_File) != 0)
+	{
+		throw ErrHLA("Fail to write the checkpoint file \"%s\".",
+			_FileName.c_str());
+	}
+#ifndef _WIN32
+	fsync(fileno(_File));
+#endif
+
+	if (idx >= (int)_Offset.size())
+		_Offset.resize(idx + 1, -1);
+	_Offset[idx] = _End;
+	_End += sizeof(R) + buf.size();
+}
+
+
+void CAttrBag_Model::BuildClassifiers(int nclassifier, int mtry, bool prune,
+	bool verbose, bool verbose_detail, int nthreads, const char *checkpoint)
+{
+	HIBAG_PROFILE(PROF_TRAIN)
+	// the GPU extension works with a single thread
+	if (GPUExtProcPtr) nthreads = 1;
+	if (checkpoint)
+	{
+		_BuildClassifiersCheckpoint(nclassifier, mtry, prune, verbose,
+			verbose_detail, nthreads, checkpoint);
+		return;
+	}
+	if ((nthreads > 1) && (nclassifier > 1))
+	{
+		_BuildClassifiersParallel(nclassifier, mtry, prune, verbose, nthreads);
+		return;
+	}
+
+	// evaluate candidate SNPs in parallel when growing only one classifier
+	CThreadPool pool;
+	if (nthreads > 1)
+	{
+		pool.SetNumThread(nthreads);
+		_VarSelect.SetThreadPool(&pool);
+	}
+	try {
+		_BuildClassifiers(nclassifier, mtry, prune, verbose, verbose_detail);
+	}
+	catch (...) {
+		_VarSelect.SetThreadPool(NULL);
+		throw;
+	}
+	_VarSelect.SetThreadPool(NULL);
+}
+
+/// show the average number of EM iterations
+static void ShowEMStat(double NumCall, double NumIter)
+{
+	if (NumCall > 0)
+	{
+		Rprintf("[-] EM algorithm%s: %0.1f iterations per call, %.0f calls\n",
+			EM_Accelerate ? " (SQUAREM)" : "", NumIter / NumCall, NumCall);
+	}
+}
+
+void CAttrBag_Model::_BuildClassifiers(int nclassifier, int mtry, bool prune,
+	bool verbose, bool verbose_detail)
+{
+	if (verbose)
+		Rprintf("[-] %s\n", date_text());
+
+	if (GPUExtProcPtr)
+		(*GPUExtProcPtr->build_init)(nHLA(), nSamp());
+
+	CSamplingWithoutReplace VarSampling;
+	double em_call, em_iter;
+	_VarSelect.GetEMStat(em_call, em_iter);
+
+	for (int k=0; k < nclassifier; k++)
+	{
+		VarSampling.Init(nSNP());
+
+		CAttrBag_Classifier *I = NewClassifierBootstrap();
+		if (GPUExtProcPtr)
+			(*GPUExtProcPtr->build_set_bootstrap)(&(I->BootstrapCount()[0]));
+
+		I->Grow(VarSampling, mtry, prune, verbose, verbose_detail);
+		if (verbose)
+		{
+			Rprintf(
+				"[%d] %s, OOB Acc: %0.2f%%, # of SNPs: %d, # of Haplo: %d\n",
+				k+1, date_text(), I->OutOfBag_Accuracy()*100, I->nSNP(),
+				I->nHaplo());
+		}
+	}
+
+	if (GPUExtProcPtr)
+		(*GPUExtProcPtr->build_done)();
+
+	if (verbose)
+	{
+		double n_call, n_iter;
+		_VarSelect.GetEMStat(n_call, n_iter);
+		ShowEMStat(n_call - em_call, n_iter - em_iter);
+	}
+}
+
+/// Growing individual classifiers in parallel
+class CBuildClassifierJob: public CParallelJob
+{
+public:
+	/// the working space of a thread
+	struct TThreadSpace
+	{
+		CVariableSelection VarSelect;
+		CSamplingWithoutReplace VarSampling;
+		TRandomStream Rand;
+	};
+
+	CBuildClassifierJob(vector<CAttrBag_Classifier> &list, int start,
+		const vector<int> &index, const vector<uint64_t> &seed, int nthreads,
+		int ncand_threads, int nsnp, int mtry, bool prune, bool verbose,
+		bool verbose_detail, int num_done, CBuildCheckpoint *checkpoint):
+		ClassifierList(list), Index(index), Seed(seed), Space(nthreads)
+	{
+		Start = start; NumSNP = nsnp; MTry = mtry;
+		Prune = prune; Verbose = verbose; VerboseDetail = verbose_detail;
+		NumDone = num_done;
+		Checkpoint = checkpoint;
+		// each thread evaluates candidate SNPs using its own threads
+		if (ncand_threads > 1)
+		{
+			for (int i=0; i < nthreads; i++)
+			{
+				CThreadPool *pool = new CThreadPool;
+				CandPool.push_back(pool);
+				pool->SetNumThread(ncand_threads);
+				Space[i].VarSelect.SetThreadPool(pool);
+			}
+		}
+	}
+
+	~CBuildClassifierJob()
+	{
+		for (size_t i=0; i < CandPool.size(); i++)
+			delete CandPool[i];
+	}
+
+	virtual void Run(int idx, int thread_idx)
+	{
+		TThreadSpace &S = Space[thread_idx];
+		CAttrBag_Classifier &I = ClassifierList[Start + Index[idx]];
+		if (GPUExtProcPtr)
+			(*GPUExtProcPtr->build_set_bootstrap)(&(I.BootstrapCount()[0]));
+		S.Rand.Seed(Seed[idx]);
+		S.VarSampling.Init(NumSNP, &S.Rand);
+		// no output from a worker thread
+		I.Grow(S.VarSelect, S.VarSampling, MTry, Prune, VerboseDetail,
+			VerboseDetail);
+	}
+
+	virtual void Done(int idx)
+	{
+		const CAttrBag_Classifier &I = ClassifierList[Start + Index[idx]];
+		if (Checkpoint)
+			Checkpoint->Append(Index[idx], I);
+		NumDone ++;
+		if (Verbose)
+		{
+			Rprintf(
+				"[%d] %s, OOB Acc: %0.2f%%, # of SNPs: %d, # of Haplo: %d\n",
+				NumDone, date_text(), I.OutOfBag_Accuracy()*100, I.nSNP(),
+				I.nHaplo());
+		}
+	}
+
+	/// the number of calls and iterations of EM algorithm in all threads
+	void GetEMStat(double &NumCall, double &NumIter) const
+	{
+		NumCall = NumIter = 0;
+		for (size_t i=0; i < Space.size(); i++)
+		{
+			double n_call, n_iter;
+			Space[i].VarSelect.GetEMStat(n_call, n_iter);
+			NumCall += n_call; NumIter += n_iter;
+		}
+	}
+
+private:
+	vector<CAttrBag_Classifier> &ClassifierList;
+	const vector<int> &Index;
+	const vector<uint64_t> &Seed;
+	vector<TThreadSpace> Space;
+	vector<CThreadPool*> CandPool;
+	CBuildCheckpoint *Checkpoint;
+	int Start, NumSNP, MTry, NumDone;
+	bool Prune, Verbose, VerboseDetail;
+};
+
+void CAttrBag_Model::_BuildClassifiersParallel(int nclassifier, int mtry,
+	bool prune, bool verbose, int nthreads)
+{
+	// bootstrap samples and random seeds are generated by R's RNG in order,
+	//   so the model does not depend on the number of threads
+	const int start = _ClassifierList.size();
+	vector<int> index(nclassifier);
+	vector<uint64_t> seed(nclassifier);
+	for (int k=0; k < nclassifier; k++)
+	{
+		NewClassifierBootstrap();
+		index[k] = k;
+		seed[k] = RandomSeed(NULL);
+	}
+
+	_GrowClassifiers(start, index, seed, mtry, prune, verbose, false,
+		nthreads, NULL);
+}
+
+void CAttrBag_Model::_BuildClassifiersCheckpoint(int nclassifier, int mtry,
+	bool prune, bool verbose, bool verbose_detail, int nthreads,
+	const char *checkpoint)
+{
+	// the seed is used if the file is created
+	CBuildCheckpoint File;
+	File.Open(checkpoint, *this, mtry, prune, RandomSeed(NULL));
+
+	// bootstrap samples and random seeds are generated by the random stream
+	//   of the file in order, including the classifiers loaded from the file,
+	//   so the model does not depend on the number of threads or resuming
+	TRandomStream Rand;
+	Rand.Seed(File.Seed());
+	const int start = _ClassifierList.size();
+	_ResetPredict();
+	_ClassifierList.resize(start + nclassifier, CAttrBag_Classifier(*this));
+	vector<int> index, S(nSamp());
+	vector<uint64_t> seed;
+	try {
+		for (int k=0; k < nclassifier; k++)
+		{
+			RandomBootstrap(S, &Rand);
+			const uint64_t s = RandomSeed(&Rand);
+			CAttrBag_Classifier &I = _ClassifierList[start + k];
+			if (File.Has(k))
+			{
+				File.Load(k, I);
+				if (I.BootstrapCount() != S)
+				{
+					throw ErrHLA("The checkpoint file \"%s\" does not match the bootstrap samples.",
+						checkpoint);
+				}
+			} else {
+				I.InitBootstrapCount(&S[0]);
+				index.push_back(k);
+				seed.push_back(s);
+			}
+		}
+	}
+	catch (...) {
+		_ClassifierList.resize(start, CAttrBag_Classifier(*this));
+		throw;
+	}
+
+	if (verbose)
+	{
+		Rprintf("[-] %s, %d of %d classifiers in the checkpoint file\n",
+			date_text(), nclassifier - (int)index.size(), nclassifier);
+	}
+	if (!index.empty())
+	{
+		_GrowClassifiers(start, index, seed, mtry, prune, verbose,
+			verbose_detail, nthreads, &File);
+	}
+}
+
+uint64_t CAttrBag_Model::OpenCheckpoint(const char *fn, int nclassifier,
+	int mtry, bool prune, uint64_t seed, vector<int> &index)
+{
+	CloseCheckpoint();
+	_Checkpoint = new CBuildCheckpoint;
+	index.clear();
+	const int start = _ClassifierList.size();
+	try {
+		_Checkpoint->Open(fn, *this, mtry, prune, seed, true);
+		for (int k=0; k < nclassifier; k++)
+		{
+			if (_Checkpoint->Has(k))
+			{
+				_Checkpoint->Load(k, *NewClassifierAllSamp());
+				index.push_back(k);
+			}
+		}
+	}
+	catch (...) {
+		_ClassifierList.resize(start, CAttrBag_Classifier(*this));
+		CloseCheckpoint();
+		throw;
+	}
+	return _Checkpoint->Seed();
+}
+
+void CAttrBag_Model::AppendCheckpoint(int idx)
+{
+	HIBAG_CHECKING(!_Checkpoint,
+		"CAttrBag_Model::AppendCheckpoint, the checkpoint file is not open.");
+	HIBAG_CHECKING(_ClassifierList.empty(),
+		"CAttrBag_Model::AppendCheckpoint, no classifier.");
+	_Checkpoint->Append(idx, _ClassifierList.back());
+}
+
+void CAttrBag_Model::CloseCheckpoint()
+{
+	if (_Checkpoint) delete _Checkpoint;
+	_Checkpoint = NULL;
+}
+
+void CAttrBag_Model::_GrowClassifiers(int start, const vector<int> &index,
+	const vector<uint64_t> &seed, int mtry, bool prune, bool verbose,
+	bool verbose_detail, int nthreads, CBuildCheckpoint *checkpoint)
+{
+	const int n = index.size();
+	// if there are fewer classifiers than threads, the remaining threads
+	//   are used to evaluate candidate SNPs within each classifier
+	int ncand_threads = 1;
+	if (nthreads > n)
+	{
+		ncand_threads = nthreads / n;
+		nthreads = n;
+	}
+	if (verbose && (nthreads*ncand_threads > 1))
+	{
+		if (ncand_threads > 1)
+		{
+			Rprintf("[-] %s, using %d threads (%d per classifier)\n",
+				date_text(), nthreads*ncand_threads, ncand_threads);
+		} else
+			Rprintf("[-] %s, using %d threads\n", date_text(), nthreads);
+	}
+
+	// the classifiers loaded from the checkpoint file are counted as done
+	CBuildClassifierJob job(_ClassifierList, start, index, seed, nthreads,
+		ncand_threads, nSNP(), mtry, prune, verbose,
+		verbose_detail && (nthreads <= 1),
+		int(_ClassifierList.size()) - start - n, checkpoint);
+	CThreadPool pool;
+	pool.SetNumThread(nthreads);
+	if (GPUExtProcPtr)
+		(*GPUExtProcPtr->build_init)(nHLA(), nSamp());
+	try {
+		pool.Run(job, n);
+	}
+	catch (...) {
+		// remove the classifiers which are not completed
+		_ClassifierList.resize(start, CAttrBag_Classifier(*this));
+		throw;
+	}
+	if (GPUExtProcPtr)
+		(*GPUExtProcPtr->build_done)();
+
+	if (verbose)
+	{
+		double n_call, n_iter;
+		job.GetEMStat(n_call, n_iter);
+		ShowEMStat(n_call, n_iter);
+	}
+}
 
-// -------------------------------------------------------------------------
-// The individual classifier
+void CAttrBag_Model::PredictHLA(const int *genomat, int n_samp, int vote_method,
+	int OutH1[], int OutH2[], double OutMaxProb[], double OutMatching[],
+	double OutProbArray[], bool ShowInfo, TSparsePostProb *OutSparseProb,
+	int nthreads) const
+{
+	_PredictAll(genomat, NULL, NULL, 0, n_samp, vote_method, OutH1, OutH2,
+		OutMaxProb, OutMatching, OutProbArray, ShowInfo, OutSparseProb,
+		nthreads);
+}
 
-CAttrBag_Classifier::CAttrBag_Classifier(CAttrBag_Model &_owner)
+void CAttrBag_Model::PredictHLA(const UINT8 *packed_geno, int n_samp,
+	int vote_method, int OutH1[], int OutH2[], double OutMaxProb[],
+	double OutMatching[], double OutProbArray[], bool ShowInfo,
+	TSparsePostProb *OutSparseProb, int nthreads) const
 {
-	_Owner = &_owner;
-	_OutOfBag_Accuracy = 0;
+	_PredictAll(NULL, packed_geno, NULL, 0, n_samp, vote_method, OutH1, OutH2,
+		OutMaxProb, OutMatching, OutProbArray, ShowInfo, OutSparseProb,
+		nthreads);
 }
 
-void CAttrBag_Classifier::InitBootstrapCount(int SampCnt[])
+void CAttrBag_Model::PredictHLA(CBaseGenoReader &Reader, int n_samp,
+	int chunk_size, int vote_method, int OutH1[], int OutH2[],
+	double OutMaxProb[], double OutMatching[], bool ShowInfo,
+	TSparsePostProb *OutSparseProb, int nthreads) const
 {
-	_BootstrapCount.assign(&SampCnt[0], &SampCnt[_Owner->nSamp()]);
-	_SNPIndex.clear();
-	_OutOfBag_Accuracy = 0;
+	if (Reader.nSNP() != nSNP())
+		throw ErrHLA("The number of SNPs in the genotype reader is invalid.");
+	_PredictAll(NULL, NULL, &Reader, chunk_size, n_samp, vote_method, OutH1,
+		OutH2, OutMaxProb, OutMatching, NULL, ShowInfo, OutSparseProb,
+		nthreads);
 }
 
-void CAttrBag_Classifier::Assign(int n_snp, const int snpidx[],
-	const int samp_num[], int n_haplo, const double *freq, const int *hla,
-	const char *haplo[], double *_acc)
+
+/// the number of samples in a block predicted by a thread at a time
+static const int PRED_BLOCK_SIZE = 64;
+
+class CAttrBag_Model::CPredictJob: public CParallelJob
 {
-	// SNP markers
-	_SNPIndex.assign(&snpidx[0], &snpidx[n_snp]);
-	// The number of samples
-	if (samp_num)
+public:
+	CPredictJob(const CAttrBag_Model &model, int nthreads, int n_samp,
+		int vote_method, bool packed, const TSparsePostProb *sparse,
+		bool show, CPredictLatency *latency=NULL): Model(model), Ctx(nthreads)
 	{
-		const int n = _Owner->nSamp();
-		_BootstrapCount.assign(&samp_num[0], &samp_num[n]);
+		VoteMethod = vote_method; Show = show;
+		Sparse = sparse;
+		// the memory for caching is shared by all threads
+		for (int i=0; i < nthreads; i++)
+		{
+			Model._Init_PredictHLA(Ctx[i], n_samp, vote_method, packed,
+				PredCache_MaxMemory / nthreads);
+		}
+		// a sample at a time if its classifiers are evaluated in parallel
+		BlockSize = latency ? 1 : PRED_BLOCK_SIZE;
+		Ctx[0].Latency = latency;
 	}
-	// The haplotypes
-	_Haplo.Num_SNP = n_snp;
-	_Haplo.ResizeHaplo(n_haplo);
-	_Haplo.LenPerHLA.resize(_Owner->nHLA());
-	for (int i=0; i < n_haplo; i++)
+
+	~CPredictJob()
 	{
-		_Haplo.List[i] = THaplotype(haplo[i], freq[i]);
-		_Haplo.LenPerHLA[hla[i]] ++;
+		for (size_t i=0; i < Ctx.size(); i++)
+			Model._Done_PredictHLA(Ctx[i]);
 	}
-	// Accuracies
-	_OutOfBag_Accuracy = (_acc) ? (*_acc) : 0;
-}
-
-void CAttrBag_Classifier::Grow(CBaseSampling &VarSampling, int mtry,
-	bool prune, bool verbose, bool verbose_detail)
-{
-	_Owner->_VarSelect.InitSelection(_Owner->_SNPMat,
-		_Owner->_HLAList, &_BootstrapCount[0]);
-	_Owner->_VarSelect.Search(VarSampling, _Haplo, _SNPIndex,
-		_OutOfBag_Accuracy, mtry, prune, verbose, verbose_detail);
-}
 
+	/// predict the samples in 'genomat' or 'packed_geno' using the threads
+	void Predict(CThreadPool &pool, const int *genomat,
+		const UINT8 *packed_geno, int n_samp, int OutH1[], int OutH2[],
+		double OutMaxProb[], double OutMatching[], double OutProbArray[],
+		TSparsePostProb *OutSparseProb)
+	{
+		GenoMat = genomat; PackedGeno = packed_geno; NumSamp = n_samp;
+		H1 = OutH1; H2 = OutH2; MaxProb = OutMaxProb;
+		Matching = OutMatching; ProbArray = OutProbArray;
 
-// -------------------------------------------------------------------------
-// the attribute bagging model
+		const int n_block = (n_samp + BlockSize - 1) / BlockSize;
+		// the sparse output of each block is merged in order
+		BlockSparse.resize(OutSparseProb ? n_block : 0);
+		for (size_t i=0; i < BlockSparse.size(); i++)
+			BlockSparse[i].Init(Sparse->TopK, Sparse->MinProb);
 
-CAttrBag_Model::CAttrBag_Model() { }
+		pool.Run(*this, n_block);
 
-void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int n_hla)
-{
-	HIBAG_CHECKING(n_snp < 0, "CAttrBag_Model::InitTraining, n_snp error.")
-	HIBAG_CHECKING(n_samp < 0, "CAttrBag_Model::InitTraining, n_samp error.")
-	HIBAG_CHECKING(n_hla < 0, "CAttrBag_Model::InitTraining, n_hla error.")
+		for (size_t i=0; i < BlockSparse.size(); i++)
+			OutSparseProb->Append(BlockSparse[i]);
+		BlockSparse.clear();
+	}
 
-	_SNPMat.Num_Total_Samp = n_samp;
-	_SNPMat.Num_Total_SNP = n_snp;
-	_SNPMat.pGeno = NULL;
+	virtual void Run(int idx, int thread_idx)
+	{
+		const int start = idx * BlockSize;
+		const int n = min(BlockSize, NumSamp - start);
+		const size_t nn = Model.nHLA()*(Model.nHLA()+1)/2;
+		Model._PredictSamples(Ctx[thread_idx],
+			GenoMat ? (GenoMat + (size_t)start*Model.nSNP()) : NULL,
+			PackedGeno ? (PackedGeno + (size_t)start*((Model.nSNP()+3)/4)) : NULL,
+			n, VoteMethod, H1 + start, H2 + start, MaxProb + start,
+			Matching ? (Matching + start) : NULL,
+			ProbArray ? (ProbArray + start*nn) : NULL,
+			BlockSparse.empty() ? NULL : &BlockSparse[idx]);
+	}
 
-	_HLAList.List.resize(n_samp);
-	_HLAList.Str_HLA_Allele.resize(n_hla);
-}
+	virtual void Done(int idx)
+	{
+		if (Show)
+		{
+			const int start = idx * BlockSize;
+			Progress.Forward(min(BlockSize, NumSamp - start), true);
+		}
+	}
 
-void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int *snp_geno,
-	int n_hla, int *H1, int *H2)
-{
-	HIBAG_CHECKING(n_snp < 0, "CAttrBag_Model::InitTraining, n_snp error.")
-	HIBAG_CHECKING(n_samp < 0, "CAttrBag_Model::InitTraining, n_samp error.")
-	HIBAG_CHECKING(n_hla < 0, "CAttrBag_Model::InitTraining, n_hla error.")
+	/// the numbers of hits and misses of the genotype caches
+	void GetCacheStat(int64_t &NumHit, int64_t &NumMiss) const
+	{
+		NumHit = NumMiss = 0;
+		for (size_t i=0; i < Ctx.size(); i++)
+		{
+			for (size_t j=0; j < Ctx[i].Cache.size(); j++)
+			{
+				NumHit += Ctx[i].Cache[j].NumHit();
+				NumMiss += Ctx[i].Cache[j].NumMiss();
+			}
+		}
+	}
 
-	_SNPMat.Num_Total_Samp = n_samp;
-	_SNPMat.Num_Total_SNP = n_snp;
-	_SNPMat.pGeno = snp_geno;
+private:
+	const CAttrBag_Model &Model;
+	vector<TPredContext> Ctx;  //< the context of each thread
+	vector<TSparsePostProb> BlockSparse;
+	const TSparsePostProb *Sparse;
+	const int *GenoMat;
+	const UINT8 *PackedGeno;
+	int NumSamp, VoteMethod, BlockSize;
+	int *H1, *H2;
+	double *MaxProb, *Matching, *ProbArray;
+	bool Show;
+};
 
-	_HLAList.List.resize(n_samp);
-	_HLAList.Str_HLA_Allele.resize(n_hla);
-	for (int i=0; i < n_samp; i++)
+void CAttrBag_Model::_PredictAll(const int *genomat, const UINT8 *packed_geno,
+	CBaseGenoReader *Reader, int chunk_size, int n_samp, int vote_method,
+	int OutH1[], int OutH2[], double OutMaxProb[], double OutMatching[],
+	double OutProbArray[], bool ShowInfo, TSparsePostProb *OutSparseProb,
+	int nthreads) const
+{
+	HIBAG_PROFILE(PROF_PREDICT)
+	if ((vote_method < 1) || (vote_method > 2))
+		throw ErrHLA("Invalid 'vote_method'.");
+	// the GPU extension works with a single thread
+	if (GPUExtProcPtr) nthreads = 1;
+	const int n_block = (n_samp + PRED_BLOCK_SIZE - 1) / PRED_BLOCK_SIZE;
+
+	// if there are fewer blocks of samples than threads, the classifiers of
+	//   each sample are evaluated in parallel by the warm thread pool, unless
+	//   it is being used by another call
+	if ((n_samp > 0) && (nthreads > n_block) &&
+		(_ClassifierList.size() > 1) && _LatencyMutex.TryLock())
 	{
-		HIBAG_CHECKING(H1[i]<0 || H1[i]>=n_hla,
-			"CAttrBag_Model::InitTraining, H1 error.");
-		HIBAG_CHECKING(H2[i]<0 || H2[i]>=n_hla,
-			"CAttrBag_Model::InitTraining, H2 error.");
-		_HLAList.List[i].Allele1 = H1[i];
-		_HLAList.List[i].Allele2 = H2[i];
+		try {
+			if (!_Latency) _Latency = new CPredictLatency(*this);
+			_Latency->Init(nthreads);
+			_PredictSamplesBy(1, _Latency, genomat, packed_geno, Reader,
+				chunk_size, n_samp, vote_method, OutH1, OutH2, OutMaxProb,
+				OutMatching, OutProbArray, ShowInfo, OutSparseProb);
+		} catch (...) {
+			_LatencyMutex.Unlock();
+			throw;
+		}
+		_LatencyMutex.Unlock();
+		return;
 	}
+
+	if (nthreads > n_block) nthreads = n_block;
+	if (nthreads < 1) nthreads = 1;
+	_PredictSamplesBy(nthreads, NULL, genomat, packed_geno, Reader,
+		chunk_size, n_samp, vote_method, OutH1, OutH2, OutMaxProb,
+		OutMatching, OutProbArray, ShowInfo, OutSparseProb);
 }
 
-CAttrBag_Classifier *CAttrBag_Model::NewClassifierBootstrap()
+void CAttrBag_Model::_PredictSamplesBy(int nthreads, CPredictLatency *latency,
+	const int *genomat, const UINT8 *packed_geno, CBaseGenoReader *Reader,
+	int chunk_size, int n_samp, int vote_method, int OutH1[], int OutH2[],
+	double OutMaxProb[], double OutMatching[], double OutProbArray[],
+	bool ShowInfo, TSparsePostProb *OutSparseProb) const
 {
-	_ClassifierList.push_back(CAttrBag_Classifier(*this));
-	CAttrBag_Classifier *I = &_ClassifierList.back();
-
-	const int n = nSamp();
-	vector<int> S(n);
-	int n_unique;
+	if (ShowInfo)
+	{
+		Progress.Info = "Predicting";
+		Progress.Init(n_samp, true);
+	}
 
-	do {
-		// initialize S
-		for (int i=0; i < n; i++) S[i] = 0;
-		n_unique = 0;
+	CPredictJob job(*this, nthreads, n_samp, vote_method,
+		packed_geno != NULL, OutSparseProb, ShowInfo, latency);
+	CThreadPool pool;
+	pool.SetNumThread(nthreads);
 
-		for (int i=0; i < n; i++)
+	if (Reader)
+	{
+		// read the genotypes in chunks
+		if (chunk_size < 1) chunk_size = 1;
+		if (chunk_size > n_samp) chunk_size = n_samp;
+		vector<int> geno((size_t)chunk_size * nSNP());
+		for (int i=0; i < n_samp; )
 		{
-			int k = RandomNum(n);
-			if (S[k] == 0) n_unique ++;
-			S[k] ++;
+			const int n = (n_samp - i < chunk_size) ? (n_samp - i) : chunk_size;
+			Reader->Read(&geno[0], n);
+			job.Predict(pool, &geno[0], NULL, n, OutH1 + i, OutH2 + i,
+				OutMaxProb + i, OutMatching ? (OutMatching + i) : NULL, NULL,
+				OutSparseProb);
+			i += n;
 		}
-	} while (n_unique >= n); // to avoid the case of no out-of-bag individuals
-
-	I->InitBootstrapCount(&S[0]);
+	} else {
+		job.Predict(pool, genomat, packed_geno, n_samp, OutH1, OutH2,
+			OutMaxProb, OutMatching, OutProbArray, OutSparseProb);
+	}
 
-	return I;
+	if (ShowInfo && (PredCache_MaxMemory > 0) && !GPUExtProcPtr)
+	{
+		int64_t n_hit, n_miss;
+		job.GetCacheStat(n_hit, n_miss);
+		if (n_hit + n_miss > 0)
+		{
+			Rprintf("[-] Genotype cache: %0.1f%% hits (%.0f hits, %.0f misses)\n",
+				100.0 * n_hit / (n_hit + n_miss), (double)n_hit, (double)n_miss);
+		}
+	}
 }
 
-CAttrBag_Classifier *CAttrBag_Model::NewClassifierAllSamp()
+/// extract the bits of 'x' selected by 'mask' to the lowest bits
+static inline uint64_t BitExtract(uint64_t x, uint64_t mask)
 {
-	_ClassifierList.push_back(CAttrBag_Classifier(*this));
-	CAttrBag_Classifier *I = &_ClassifierList.back();
-
-	vector<int> S(nSamp(), 1);
-	I->InitBootstrapCount(&S[0]);
+#ifdef HIBAG_HARDWARE_PEXT
+	return _pext_u64(x, mask);
+#else
+	uint64_t rv = 0;
+	for (uint64_t bit=1; mask; bit <<= 1)
+	{
+		if (x & mask & (~mask + 1)) rv |= bit;
+		mask &= mask - 1;
+	}
+	return rv;
+#endif
+}
 
-	return I;
+/// the even bits of 'x' to the lowest 32 bits
+static inline uint64_t EvenBits(uint64_t x)
+{
+	x &= 0x5555555555555555ULL;
+	x = (x | (x >> 1))  & 0x3333333333333333ULL;
+	x = (x | (x >> 2))  & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x >> 4))  & 0x00FF00FF00FF00FFULL;
+	x = (x | (x >> 8))  & 0x0000FFFF0000FFFFULL;
+	x = (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
+	return x;
 }
 
-void CAttrBag_Model::BuildClassifiers(int nclassifier, int mtry, bool prune,
-	bool verbose, bool verbose_detail)
+/// convert 2-bit packed genotypes (PLINK encoding) to the bit-planes of
+//    allele 1, allele 2 and missing flag, (n_snp+63)/64 words each
+static void PackedToBitPlanes(const UINT8 *geno, int n_snp, uint64_t planes[])
 {
-#ifdef HIBAG_ENABLE_TIMING
-	memset(timing_array, 0, sizeof(timing_array));
-	HIBAG_TIMING(TM_TOTAL)
-#endif
+	const int nw = (n_snp + 63) / 64;
+	uint64_t *S1 = planes, *S2 = planes + nw, *M = planes + 2*nw;
+	const int nbyte = (n_snp + 3) / 4;
 
-	if (verbose)
-		Rprintf("[-] %s\n", date_text());
+	for (int w=0, b=0; w < nw; w++)
+	{
+		uint64_t s1=0, s2=0, m=0;
+		for (int half=0; half < 2; half++, b += 8)
+		{
+			// 32 genotypes
+			uint64_t x = 0;
+			for (int k=0; (k < 8) && (b + k < nbyte); k++)
+				x |= uint64_t(geno[b + k]) << (k << 3);
+			// 00 -- (1, 1, 1), 10 -- (1, 0, 1), 11 -- (0, 0, 1), 01 -- missing
+			const uint64_t lo = EvenBits(x), hi = EvenBits(x >> 1);
+			const int shift = half << 5;
+			s1 |= (~lo & 0xFFFFFFFFULL) << shift;
+			s2 |= (~lo & ~hi & 0xFFFFFFFFULL) << shift;
+			m  |= (~(lo & ~hi) & 0xFFFFFFFFULL) << shift;
+		}
+		if ((w == nw - 1) && (n_snp & 0x3F))
+		{
+			const uint64_t valid = (uint64_t(1) << (n_snp & 0x3F)) - 1;
+			s1 &= valid; s2 &= valid; m &= valid;
+		}
+		S1[w] = s1; S2[w] = s2; M[w] = m;
+	}
+}
 
-	if (GPUExtProcPtr)
-		(*GPUExtProcPtr->build_init)(nHLA(), nSamp());
+/// gather the bits of the words 'Word' with 'Mask' into a packed array
+static inline void BitGather(const uint64_t src[], const vector<int> &Word,
+	const vector<uint64_t> &Mask, UINT8 out[HIBAG_PACKED_UTYPE_MAXNUM])
+{
+	uint64_t w[2] = { 0, 0 };
+	int pos = 0;
+	for (size_t i=0; i < Word.size(); i++)
+	{
+		const uint64_t mask = Mask[i];
+		const uint64_t v = BitExtract(src[Word[i]], mask);
+		int cnt = 0;
+		for (uint64_t m=mask; m; m &= m - 1) cnt ++;
+		if (pos < 64)
+		{
+			w[0] |= v << pos;
+			if (pos + cnt > 64) w[1] |= v >> (64 - pos);
+		} else
+			w[1] |= v << (pos - 64);
+		pos += cnt;
+	}
+	for (size_t b=0; b < HIBAG_PACKED_UTYPE_MAXNUM; b++)
+		out[b] = UINT8(w[b >> 3] >> ((b & 0x07) << 3));
+}
 
-	CSamplingWithoutReplace VarSampling;
+void CAttrBag_Model::_InitPackedGather() const
+{
+	const size_t n_classifier = _ClassifierList.size();
+	_PackedGather.resize(n_classifier);
 
-	for (int k=0; k < nclassifier; k++)
+	for (size_t c_i=0; c_i < n_classifier; c_i++)
 	{
-		VarSampling.Init(nSNP());
+		const CAttrBag_Classifier &c = _ClassifierList[c_i];
+		TPackedGather &g = _PackedGather[c_i];
+		const int n = c.nSNP();
 
-		CAttrBag_Classifier *I = NewClassifierBootstrap();
-		if (GPUExtProcPtr)
-			(*GPUExtProcPtr->build_set_bootstrap)(&(I->BootstrapCount()[0]));
+		// sort the SNPs by their indices in the model
+		vector< pair<int, int> > order(n);
+		for (int i=0; i < n; i++)
+			order[i] = pair<int, int>(c._SNPIndex[i], i);
+		sort(order.begin(), order.end());
 
-		I->Grow(VarSampling, mtry, prune, verbose, verbose_detail);
-		if (verbose)
+		// the haplotypes with the sorted SNPs
+		g.Haplo = c._Haplo;
+		for (size_t h=0; h < g.Haplo.Num_Haplo; h++)
 		{
-			Rprintf(
-				"[%d] %s, OOB Acc: %0.2f%%, # of SNPs: %d, # of Haplo: %d\n",
-				k+1, date_text(), I->OutOfBag_Accuracy()*100, I->nSNP(),
-				I->nHaplo());
+			const THaplotype &src = c._Haplo.List[h];
+			THaplotype &dst = g.Haplo.List[h];
+			memset(dst.PackedHaplo, 0, sizeof(dst.PackedHaplo));
+			for (int i=0; i < n; i++)
+				dst.SetAllele(i, src.GetAllele(order[i].second));
 		}
-	}
 
-	if (GPUExtProcPtr)
-		(*GPUExtProcPtr->build_done)();
-
-#ifdef HIBAG_ENABLE_TIMING
-	tm.Stop();
-	Rprintf("It took %0.2f seconds in total:\n"
-			"    _OutOfBagAccuracy(): %0.2f%%, %0.2fs\n"
-			"    _InBagLogLik(): %0.2f%%, %0.2fs\n"
-			"    PrepareHaplotypes(): %0.2f%%, %0.2fs\n"
-			"    ExpectationMaximization(): %0.2f%%, %0.2fs\n",
-		((double)timing_array[TM_TOTAL]) / CLOCKS_PER_SEC,
-		100.0 * timing_array[TM_ACC_OOB] / timing_array[TM_TOTAL],
-		((double)timing_array[TM_ACC_OOB]) / CLOCKS_PER_SEC,
-		100.0 * timing_array[TM_ACC_IB] / timing_array[TM_TOTAL],
-		((double)timing_array[TM_ACC_IB]) / CLOCKS_PER_SEC,
-		100.0 * timing_array[TM_PRE_HAPLO] / timing_array[TM_TOTAL],
-		((double)timing_array[TM_PRE_HAPLO]) / CLOCKS_PER_SEC,
-		100.0 * timing_array[TM_EM_ALG] / timing_array[TM_TOTAL],
-		((double)timing_array[TM_EM_ALG]) / CLOCKS_PER_SEC
-	);
-#endif
+		// the words and masks
+		g.SNP.resize(n);
+		g.Word.clear(); g.Mask.clear();
+		g.SumWeight = 0;
+		for (int i=0; i < n; i++)
+		{
+			const int k = g.SNP[i] = order[i].first;
+			if (g.Word.empty() || (g.Word.back() != (k >> 6)))
+			{
+				g.Word.push_back(k >> 6);
+				g.Mask.push_back(0);
+			}
+			g.Mask.back() |= uint64_t(1) << (k & 0x3F);
+			g.SumWeight += _SNPWeight[k];
+		}
+	}
 }
 
-void CAttrBag_Model::PredictHLA(const int *genomat, int n_samp, int vote_method,
-	int OutH1[], int OutH2[], double OutMaxProb[], double OutMatching[],
-	double OutProbArray[], bool ShowInfo)
+void CAttrBag_Model::_PredictSamples(TPredContext &Ctx, const int *genomat,
+	const UINT8 *packed_geno, int n_samp, int vote_method, int OutH1[],
+	int OutH2[], double OutMaxProb[], double OutMatching[],
+	double OutProbArray[], TSparsePostProb *OutSparseProb) const
 {
-	if ((vote_method < 1) || (vote_method > 2))
-		throw ErrHLA("Invalid 'vote_method'.");
-
-	_Predict.InitPrediction(nHLA());
-	Progress.Info = "Predicting";
-	Progress.Init(n_samp, ShowInfo);
-
-	vector<int> snp_weight(nSNP());
-	_GetSNPWeights(&snp_weight[0]);
 	const size_t nn = nHLA()*(nHLA()+1)/2;
+	const int nbyte = (nSNP() + 3) / 4;
+	CAlg_Prediction &Predict = Ctx.Predict;
 
-	_Init_PredictHLA();
-	for (int i=0; i < n_samp; i++, genomat+=nSNP())
+	for (int i=0; i < n_samp; i++)
 	{
 		double pb;
-		_PredictHLA(genomat, &snp_weight[0], vote_method, pb);
+		if (!packed_geno)
+		{
+			_PredictHLA(Ctx, genomat, NULL, vote_method, pb);
+			genomat += nSNP();
+		} else if (GPUExtProcPtr)
+		{
+			static const int cvt[4] = { 2, NA_INTEGER, 1, 0 };
+			for (int j=0; j < nSNP(); j++)
+			{
+				Ctx.Geno[j] =
+					cvt[(packed_geno[j >> 2] >> ((j & 0x03) << 1)) & 0x03];
+			}
+			_PredictHLA(Ctx, &Ctx.Geno[0], NULL, vote_method, pb);
+			packed_geno += nbyte;
+		} else {
+			PackedToBitPlanes(packed_geno, nSNP(), &Ctx.Planes[0]);
+			_PredictHLA(Ctx, NULL, &Ctx.Planes[0], vote_method, pb);
+			packed_geno += nbyte;
+		}
 
-		THLAType HLA = _Predict.BestGuessEnsemble();
+		THLAType HLA = Predict.BestGuessEnsemble();
 		OutH1[i] = HLA.Allele1; OutH2[i] = HLA.Allele2;
 
 		if ((HLA.Allele1 != NA_INTEGER) && (HLA.Allele2 != NA_INTEGER))
-			OutMaxProb[i] = _Predict.IndexSumPostProb(HLA.Allele1, HLA.Allele2);
+			OutMaxProb[i] = Predict.IndexSumPostProb(HLA.Allele1, HLA.Allele2);
 		else
 			OutMaxProb[i] = 0;
 
 		if (OutProbArray)
 		{
-			memcpy(OutProbArray, &_Predict.SumPostProb()[0], sizeof(double)*nn);
+			memcpy(OutProbArray, &Predict.SumPostProb()[0], sizeof(double)*nn);
 			OutProbArray += nn;
 		}
+		if (OutSparseProb)
+			OutSparseProb->Append(&Predict.SumPostProb()[0], nn);
 		if (OutMatching) OutMatching[i] = pb;
-
-		Progress.Forward(1, ShowInfo);
 	}
-	_Done_PredictHLA();
 }
 
-void CAttrBag_Model::_PredictHLA(const int geno[], const int snp_weight[],
-	int vote_method, double &OutMatching)
+void CAttrBag_Model::_PredictHLA(TPredContext &Ctx, const int geno[],
+	const uint64_t planes[], int vote_method, double &OutMatching) const
 {
-	// weight for each classifier, based on missing proportion
-	double weight[_ClassifierList.size()];
-	vector<CAttrBag_Classifier>::const_iterator p = _ClassifierList.begin();
-	for (size_t w_i=0; p != _ClassifierList.end(); p++)
+	if (Ctx.Latency)
 	{
-		const int n = p->nSNP();
-		int nw=0, sum=0;
-		for (int i=0; i < n; i++)
-		{
-			int k = p->_SNPIndex[i];
-			sum += snp_weight[k];
-			if ((0 <= geno[k]) && (geno[k] <= 2))
-				nw += snp_weight[k];
-		}
-		weight[w_i++] = double(nw) / sum;
+		Ctx.Latency->Predict(Ctx, geno, planes, vote_method, OutMatching);
+		return;
 	}
 
 	if (GPUExtProcPtr)
 	{
-		p = _ClassifierList.begin();
+		const int *snp_weight = &_SNPWeight[0];
+		// weight for each classifier, based on missing proportion
+		double weight[_ClassifierList.size()];
+		vector<CAttrBag_Classifier>::const_iterator p = _ClassifierList.begin();
 		for (size_t w_i=0; p != _ClassifierList.end(); p++, w_i++)
 		{
-			gpu_geno_buf[w_i].IntToSNP(p->nSNP(), geno, &(p->_SNPIndex[0]));
+			const int n = p->nSNP();
+			int nw=0, sum=0;
+			for (int i=0; i < n; i++)
+			{
+				int k = p->_SNPIndex[i];
+				sum += snp_weight[k];
+				if ((0 <= geno[k]) && (geno[k] <= 2))
+					nw += snp_weight[k];
+			}
+			weight[w_i] = double(nw) / sum;
+			Ctx.GPUGeno[w_i].IntToSNP(n, geno, &(p->_SNPIndex[0]));
 		}
-		(*GPUExtProcPtr->predict_avg_prob)(&gpu_geno_buf[0], weight,
-			&_Predict._SumPostProb[0], &OutMatching);
+		(*GPUExtProcPtr->predict_avg_prob)(&Ctx.GPUGeno[0], weight,
+			&Ctx.Predict._SumPostProb[0], &OutMatching);
 
 	} else {
 		// initialize probability
-		_Predict.InitSumPostProbBuffer();
-		TGenotype Geno;
+		Ctx.Predict.InitSumPostProbBuffer();
 		double sum_pb=0, pb;
 
-		p = _ClassifierList.begin();
-		for (size_t w_i=0; p != _ClassifierList.end(); p++, w_i++)
+		for (size_t c_i=0; c_i < _ClassifierList.size(); c_i++)
 		{
-			if (weight[w_i] <= 0) continue;
-
-			Geno.IntToSNP(p->nSNP(), geno, &(p->_SNPIndex[0]));
-			_Predict.PredictPostProb(p->_Haplo, Geno, pb);
-			sum_pb += pb;
-
-			if (vote_method == 1)
-			{
-				// predicting based on the averaged posterior probabilities
-				_Predict.AddProbToSum(weight[w_i]);
-			} else if (vote_method == 2)
-			{
-				// predicting by class majority voting
-				THLAType pd = _Predict.BestGuess();
-				if ((pd.Allele1 != NA_INTEGER) && (pd.Allele2 != NA_INTEGER))
-				{
-					_Predict.InitPostProbBuffer();  // fill by ZERO
-					_Predict.IndexPostProb(pd.Allele1, pd.Allele2) = 1.0;
-					_Predict.AddProbToSum(1.0);
-				}
-			}
+			if (_AddClassifier(Ctx.Predict, Ctx.Cache[c_i], c_i, geno, planes,
+					vote_method, pb))
+				sum_pb += pb;
 		}
 
 		// normalize the sum of posterior prob
-		_Predict.NormalizeSumPostProb();
+		Ctx.Predict.NormalizeSumPostProb();
 		OutMatching = sum_pb / _ClassifierList.size();
 	}
 }
 
-void CAttrBag_Model::_GetSNPWeights(int OutSNPWeight[])
+bool CAttrBag_Model::_AddClassifier(CAlg_Prediction &Predict,
+	CPredCache &Cache, size_t idx, const int geno[], const uint64_t planes[],
+	int vote_method, double &OutMatching) const
+{
+	TGenotype Geno;
+	if (geno)
+	{
+		const CAttrBag_Classifier &c = _ClassifierList[idx];
+		const int n = c.nSNP();
+		// weight based on missing proportion
+		int nw=0, sum=0;
+		for (int i=0; i < n; i++)
+		{
+			int k = c._SNPIndex[i];
+			sum += _SNPWeight[k];
+			if ((0 <= geno[k]) && (geno[k] <= 2))
+				nw += _SNPWeight[k];
+		}
+		const double weight = double(nw) / sum;
+		if (weight <= 0) return false;
+
+		Geno.IntToSNP(n, geno, &(c._SNPIndex[0]));
+		_AddPostProb(Predict, Cache, c._Haplo, Geno, weight, vote_method,
+			OutMatching);
+	} else {
+		const size_t nw = (nSNP() + 63) / 64;
+		const uint64_t *S1 = planes, *S2 = planes + nw, *M = planes + 2*nw;
+		const TPackedGather &g = _PackedGather[idx];
+
+		// weight based on missing proportion
+		int n = 0;
+		for (vector<int>::const_iterator k=g.SNP.begin(); k != g.SNP.end(); k++)
+		{
+			if ((M[*k >> 6] >> (*k & 0x3F)) & 0x01)
+				n += _SNPWeight[*k];
+		}
+		const double weight = double(n) / g.SumWeight;
+		if (weight <= 0) return false;
+
+		BitGather(S1, g.Word, g.Mask, Geno.PackedSNP1);
+		BitGather(S2, g.Word, g.Mask, Geno.PackedSNP2);
+		BitGather(M, g.Word, g.Mask, Geno.PackedMissing);
+		_AddPostProb(Predict, Cache, g.Haplo, Geno, weight, vote_method,
+			OutMatching);
+	}
+	return true;
+}
+
+void CAttrBag_Model::_AddPostProb(CAlg_Prediction &Predict, CPredCache &Cache,
+	const CHaplotypeList &Haplo, const TGenotype &Geno, double weight,
+	int vote_method, double &OutMatching) const
+{
+	const double *prob = Cache.Find(Geno, OutMatching);
+	if (prob)
+	{
+		memcpy(&Predict._PostProb[0], prob,
+			sizeof(double)*Predict._PostProb.size());
+	} else {
+		Predict.PredictPostProb(Haplo, Geno, OutMatching);
+		Cache.Add(&Predict._PostProb[0], OutMatching);
+	}
+
+	if (vote_method == 1)
+	{
+		// predicting based on the averaged posterior probabilities
+		Predict.AddProbToSum(weight);
+	} else if (vote_method == 2)
+	{
+		// predicting by class majority voting
+		THLAType pd = Predict.BestGuess();
+		if ((pd.Allele1 != NA_INTEGER) && (pd.Allele2 != NA_INTEGER))
+		{
+			Predict.InitPostProbBuffer();  // fill by ZERO
+			Predict.IndexPostProb(pd.Allele1, pd.Allele2) = 1.0;
+			Predict.AddProbToSum(1.0);
+		}
+	}
+}
+
+void CAttrBag_Model::_GetSNPWeights(int OutSNPWeight[]) const
 {
 	// initialize
 	memset(OutSNPWeight, 0, sizeof(int)*nSNP());
@@ -2090,36 +5651,91 @@ void CAttrBag_Model::_GetSNPWeights(int OutSNPWeight[])
 	}
 }
 
-void CAttrBag_Model::_Init_PredictHLA()
+void CAttrBag_Model::_PreparePredict(bool packed) const
 {
-	if (GPUExtProcPtr)
-	{
-		// prepare data structure for GPU
-		const size_t n_classifier = _ClassifierList.size();
-		THaplotype* haplo[n_classifier];
+	_PredMutex.Lock();
+	try {
+		if (!_PredPrepared)
+		{
+			_SNPWeight.resize(nSNP());
+			_GetSNPWeights(&_SNPWeight[0]);
+			_PackedGather.clear();
+			_PredPrepared = true;
+		}
+		if (packed && _PackedGather.empty() && !_ClassifierList.empty())
+			_InitPackedGather();
+	} catch (...) {
+		_PredPrepared = false;
+		_PredMutex.Unlock();
+		throw;
+	}
+	_PredMutex.Unlock();
+}
+
+void CAttrBag_Model::_ResetPredict()
+{
+	_PredMutex.Lock();
+	_PredPrepared = false;
+	_SNPWeight.clear();
+	_PackedGather.clear();
+	_PredMutex.Unlock();
+	// stop the threads of the low-latency prediction
+	_LatencyMutex.Lock();
+	if (_Latency) delete _Latency;
+	_Latency = NULL;
+	_LatencyMutex.Unlock();
+}
+
+void CAttrBag_Model::_Init_PredictHLA(TPredContext &Ctx, int n_samp,
+	int vote_method, bool packed, size_t cache_memory) const
+{
+	if ((vote_method < 1) || (vote_method > 2))
+		throw ErrHLA("Invalid 'vote_method'.");
+
+	// the GPU extension uses the genotypes unpacked
+	_PreparePredict(packed && !GPUExtProcPtr);
+	Ctx.Predict.InitPrediction(nHLA());
 
-		gpu_geno_buf.resize(n_classifier);
-		gpu_num_haplo.resize(n_classifier*2);
-		int *pg = &gpu_num_haplo[0];
+	if (packed)
+	{
+		if (GPUExtProcPtr)
+			Ctx.Geno.resize(nSNP());
+		else
+			Ctx.Planes.resize(3 * ((nSNP() + 63) / 64));
+	}
 
-		vector<CAttrBag_Classifier>::iterator p;
-		p = _ClassifierList.begin();
-		for (size_t c_i=0; p != _ClassifierList.end(); p++, c_i++)
+	const size_t n_classifier = _ClassifierList.size();
+	if (GPUExtProcPtr)
+	{
+		// prepare data structure for GPU, the auxiliary variables of
+		//   haplotypes have been set when the classifiers were created
+		vector<const THaplotype*> haplo(n_classifier);
+		vector<int> num_haplo(n_classifier*2);
+		Ctx.GPUGeno.resize(n_classifier);
+		for (size_t c_i=0; c_i < n_classifier; c_i++)
 		{
-			CHaplotypeList &hl = p->_Haplo;
-			hl.SetHaploAux();
-			haplo[c_i] = hl.List;
-			*pg++ = p->nHaplo();
-			*pg++ = p->nSNP();
+			const CAttrBag_Classifier &c = _ClassifierList[c_i];
+			haplo[c_i] = c._Haplo.List;
+			num_haplo[2*c_i] = c.nHaplo();
+			num_haplo[2*c_i+1] = c.nSNP();
+		}
+		(*GPUExtProcPtr->predict_init)(nHLA(), n_classifier, &haplo[0],
+			&num_haplo[0]);
+	} else {
+		// the cache of posterior probabilities for each classifier
+		const size_t nn = nHLA()*(nHLA()+1)/2;
+		Ctx.Cache.resize(n_classifier);
+		for (size_t i=0; i < n_classifier; i++)
+		{
+			Ctx.Cache[i].Init(_ClassifierList[i].nSNP(), nn, n_samp,
+				cache_memory / n_classifier);
 		}
-
-		(*GPUExtProcPtr->predict_init)(nHLA(), n_classifier, haplo,
-			&gpu_num_haplo[0]);
 	}
 }
 
-void CAttrBag_Model::_Done_PredictHLA()
+void CAttrBag_Model::_Done_PredictHLA(TPredContext &Ctx) const
 {
+	Ctx.Cache.clear();
 	if (GPUExtProcPtr)
 	{
 		(*GPUExtProcPtr->predict_done)();
@@ -32,6 +32,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdarg>
+#include <climits>
 #include <ctime>
 #include <cmath>
 #include <vector>
@@ -39,8 +40,31 @@
 #include <string>
 #include <algorithm>
 
-#include <R.h>
-#include <Rmath.h>
+#include <pthread.h>
+
+#ifndef HIBAG_STANDALONE
+#   include <R.h>
+#   include <Rmath.h>
+#else
+#   include <cstdio>
+#   include <cfloat>
+
+// Building without R: the functions of R used by the library are forwarded
+//   to HLA_LIB::HostHooks, which can be replaced by the host application
+
+/// the missing value of integer genotypes and HLA alleles, R's value by default
+#   ifndef NA_INTEGER
+#       define NA_INTEGER    INT_MIN
+#   endif
+
+/// print a formatted message with HLA_LIB::HostHooks.Print
+void Rprintf(const char *fmt, ...);
+/// a random number in [0, 1) from HLA_LIB::HostHooks.UnifRand
+double unif_rand();
+/// whether 'x' is neither infinite nor NaN
+inline int R_finite(double x) { return (x == x) && (x - x == 0); }
+
+#endif
 
 
 // Streaming SIMD Extensions, SSE, SSE2, SSE4_2 (POPCNT)
@@ -73,6 +97,14 @@
 #endif
 
 
+// Bit Manipulation Instruction Set 2 (PEXT)
+
+#if defined(__BMI2__) && defined(__x86_64__)
+#   define HIBAG_HARDWARE_PEXT
+#   include <immintrin.h>
+#endif
+
+
 // 32-bit or 64-bit registers
 
 #ifdef __LP64__
@@ -91,6 +123,15 @@ namespace HLA_LIB
 	/// Kernel Version, Major Number (0x01) / Minor Number (0x04)
 	#define HIBAG_KERNEL_VERSION    0x0104
 
+	/// the version of the binary model file format
+	#define HIBAG_MODEL_FILE_VERSION    1
+
+	/// the version of the preprocessed training file format
+	#define HIBAG_TRAINING_FILE_VERSION    1
+
+	/// the version of the checkpoint file format
+	#define HIBAG_CHECKPOINT_VERSION    1
+
 	/// Define unsigned integers
 	typedef uint8_t     UINT8;
 
@@ -109,6 +150,22 @@ namespace HLA_LIB
 	#define HIBAG_CHECKING(x, msg)	{ if (x) throw ErrHLA(msg); }
 
 
+#ifdef HIBAG_STANDALONE
+	/// The functions of the host application used without R
+	struct THostHooks
+	{
+		/// return a random number uniformly distributed in [0, 1)
+		double (*UnifRand)();
+		/// output a message
+		void (*Print)(const char *msg);
+	};
+
+	/// the hooks, a xorshift128+ stream with a fixed seed and the standard
+	//    output by default; replace them before calling the library
+	extern THostHooks HostHooks;
+#endif
+
+
 
 	// ===================================================================== //
 	// ========                     Description                     ========
@@ -190,6 +247,10 @@ namespace HLA_LIB
 
 		/// resize the number of haplotypes, no initialization
 		void ResizeHaplo(size_t num);
+		/// use an external buffer (e.g., a memory-mapped file) as the storage
+		//    of haplotypes without copying, and the buffer is not freed;
+		//    resizing or assigning copies the haplotypes to an own buffer
+		void AssignExternal(THaplotype *ptr, size_t num);
 
 		/// initialize haplotypes for EM algorithm
 		void DoubleHaplos(CHaplotypeList &OutHaplos) const;
@@ -197,6 +258,10 @@ namespace HLA_LIB
 		void DoubleHaplosInitFreq(CHaplotypeList &OutHaplos, double AFreq) const;
 		/// remove rare haplotypes
 		void EraseDoubleHaplos(double RareProb, CHaplotypeList &OutHaplos) const;
+		/// remove rare haplotypes, and save the index of source haplotype
+		//    for each output haplotype in 'OutSrcIdx'
+		void EraseDoubleHaplos(double RareProb, CHaplotypeList &OutHaplos,
+			vector<int> &OutSrcIdx) const;
 		/// save frequency to old.frequency, and set current freq. to be 0
 		void SaveClearFrequency();
 		/// scale the haplotype frequencies by a factor
@@ -224,6 +289,8 @@ namespace HLA_LIB
 		void *base_ptr;
 
 		inline void alloc_mem(size_t num);
+		void _EraseDoubleHaplos(double RareProb, CHaplotypeList &OutHaplos,
+			vector<int> *OutSrcIdx) const;
 	};
 
 
@@ -242,6 +309,7 @@ namespace HLA_LIB
 		friend class CGenotypeList;
 		friend class CAlg_EM;
 		friend class CAlg_Prediction;
+		friend class CParentDistCache;
 
 		/// packed SNP genotypes, allele 1
 		UINT8 PackedSNP1[HIBAG_PACKED_UTYPE_MAXNUM];
@@ -286,23 +354,67 @@ namespace HLA_LIB
 	};
 
 
-	/// SNP genotype container
+	/// The bootstrap-weighted allele counts of a SNP
+	struct TSNPAlleleCnt
+	{
+		int Allele;  //< the number of A alleles
+		int Valid;   //< the number of non-missing alleles
+	};
+
+	/// SNP genotype container, 2-bit packed in the SNP-major mode, so the
+	//    genotypes of a SNP across all samples are contiguous
 	class CSNPGenoMatrix
 	{
 	public:
 		CSNPGenoMatrix();
 
-		/// get SNP genotype of 'IdxSamp' individual and 'IdxSNP' SNP
-		const int Get(const int IdxSamp, const int IdxSNP) const;
-		/// get the pointer to SNP genotypes of 'IdxSamp' individual
-		int *Get(const int IdxSamp);
+		/// initialize with the genotypes of 'n_samp' individuals (the number
+		//    of A alleles, otherwise missing) each with 'n_snp' SNPs, no
+		//    genotype if 'geno' is NULL
+		void Init(int n_snp, int n_samp, const int *geno);
+		/// initialize with the packed genotypes 'packed' (n_snp SNPs each with
+		//    (n_samp+31)/32 words) owned by the caller, e.g., a mapped file
+		void InitPacked(int n_snp, int n_samp, const uint64_t *packed);
+
+		/// get SNP genotype of 'IdxSamp' individual and 'IdxSNP' SNP,
+		//    -1 if missing
+		inline int Get(int IdxSamp, int IdxSNP) const
+			{ return PackedGet(PackedSNP(IdxSNP), IdxSamp); }
+		/// the packed genotypes of 'IdxSNP' SNP
+		inline const uint64_t *PackedSNP(int IdxSNP) const
+			{ return &Packed[size_t(IdxSNP) * Num_Packed_Word]; }
+		/// get SNP genotype of 'IdxSamp' individual from the packed genotypes
+		//    of a SNP, -1 if missing
+		static inline int PackedGet(const uint64_t *snp, int IdxSamp)
+		{
+			int g = (snp[IdxSamp >> 5] >> ((IdxSamp & 0x1F) << 1)) & 0x03;
+			return (g < 3) ? g : -1;
+		}
+
+		/// the allele counts of all SNPs weighted by the bootstrap counts
+		void AlleleCount(const int BootstrapCnt[],
+			vector<TSNPAlleleCnt> &Out) const;
 
 		/// the total number of SNPs
 		int Num_Total_SNP;
 		/// the total number of samples
 		int Num_Total_Samp;
-		/// the pointer to SNP genotypes
-		int *pGeno;
+		/// the number of 64-bit words per SNP
+		int Num_Packed_Word;
+		/// 32 samples per word from the lowest bits: 0, 1, 2 (the number of
+		//    A alleles) and 3 (missing), the bits beyond the samples are ZERO,
+		//    pointing to 'PackedBuf' or the external genotypes
+		const uint64_t *Packed;
+		/// the genotypes owned by the matrix, empty if external
+		vector<uint64_t> PackedBuf;
+
+		/// the number of 64-bit words of all SNPs
+		inline size_t PackedSize() const
+			{ return Packed ? size_t(Num_Total_SNP) * Num_Packed_Word : 0; }
+
+	private:
+		CSNPGenoMatrix(const CSNPGenoMatrix &);
+		CSNPGenoMatrix &operator=(const CSNPGenoMatrix &);
 	};
 
 
@@ -357,6 +469,168 @@ namespace HLA_LIB
 
 
 
+	// ===================================================================== //
+	// ========                   multithreading                    ========
+
+	/// Mutex object
+	class CMutex
+	{
+	public:
+		CMutex();
+		~CMutex();
+		/// lock the mutex
+		inline void Lock() { pthread_mutex_lock(&_mutex); }
+		/// unlock the mutex
+		inline void Unlock() { pthread_mutex_unlock(&_mutex); }
+		/// lock the mutex if it is not locked, return true if locked
+		inline bool TryLock() { return pthread_mutex_trylock(&_mutex) == 0; }
+	private:
+		friend class CThreadPool;
+		pthread_mutex_t _mutex;
+	};
+
+
+	/// A set of independent tasks executed by a thread pool
+	class CParallelJob
+	{
+	public:
+		virtual ~CParallelJob() {}
+		/// run the 'idx'-th task in the 'thread_idx'-th thread
+		virtual void Run(int idx, int thread_idx) = 0;
+		/// called in the calling thread after the 'idx'-th task is finished
+		virtual void Done(int /*idx*/) {}
+	};
+
+
+	/// Thread pool, the threads are kept alive until it is destroyed
+	class CThreadPool
+	{
+	public:
+		CThreadPool();
+		~CThreadPool();
+
+		/// set the number of worker threads, no worker thread if n <= 1
+		void SetNumThread(int n);
+		/// the number of threads executing the tasks
+		inline int NumThread() const
+			{ return _Threads.empty() ? 1 : (int)_Threads.size(); }
+
+		/// run 'n' tasks, and return when all tasks are finished
+		/** the calling thread waits and calls job.Done() if there are worker
+		 *  threads, otherwise it runs all tasks by itself; an exception
+		 *  raised in a task is thrown again in the calling thread
+		**/
+		void Run(CParallelJob &job, int n);
+
+	protected:
+		/// worker threads
+		vector<pthread_t> _Threads;
+		/// the mutex for all variables below
+		CMutex _Mutex;
+		/// signaled when new tasks are available or the pool is stopping
+		pthread_cond_t _CondTask;
+		/// signaled when a task is finished
+		pthread_cond_t _CondDone;
+
+		CParallelJob *_Job;  //< the current job
+		int _NumTask;        //< the total number of tasks
+		int _NextTask;       //< the index of next task
+		int _NumRunning;     //< the number of running tasks
+		vector<int> _Finished;  //< the finished tasks for calling Done()
+		string _ErrMsg;      //< the error message
+		bool _HasError;      //< whether an error occurs
+		bool _Stop;          //< if true, the threads should exit
+
+		void _StopThreads();
+		void _WorkerLoop(int thread_idx);
+		static void *_ThreadEntry(void *param);
+
+	private:
+		// non-copyable
+		CThreadPool(const CThreadPool &);
+		CThreadPool& operator= (const CThreadPool &);
+	};
+
+
+	/// Pseudo-random number stream (xorshift128+) used in a worker thread
+	struct TRandomStream
+	{
+		uint64_t State[2];  //< the internal state
+
+		/// initialize the state from a seed
+		void Seed(uint64_t seed);
+		/// return a random number in [0, 1)
+		double Unif();
+	};
+
+
+
+	// ===================================================================== //
+	// ========                 profiling counters                  ========
+
+	/// Whether to update the profiling counters, false by default
+	extern bool Profile_Enabled;
+
+	/// The phases timed by the profiling counters
+	enum TProfilePhase
+	{
+		PROF_TRAIN = 0,     //< building individual classifiers
+		PROF_PRE_HAPLO,     //< CAlg_EM::PrepareHaplotypes()
+		PROF_NEW_SNP,       //< CAlg_EM::PrepareNewSNP()
+		PROF_EM_ALG,        //< CAlg_EM::ExpectationMaximization()
+		PROF_ERASE_HAPLO,   //< CHaplotypeList::EraseDoubleHaplos()
+		PROF_PARENT_DIST,   //< CParentDistCache::Init()
+		PROF_ACC_OOB,       //< out-of-bag accuracy
+		PROF_ACC_IB,        //< in-bag log likelihood
+		PROF_PREDICT,       //< predicting samples
+		PROF_NUM_PHASE
+	};
+
+	/// The events counted by the profiling counters
+	enum TProfileEvent
+	{
+		PROF_EM_ITER = 0,   //< EM iterations
+		PROF_HAPLO_PAIR,    //< haplotype pairs enumerated
+		PROF_HAMMING_DIST,  //< Hamming distances between genotypes and pairs
+		PROF_OOB_EXIT,      //< out-of-bag evaluations stopped early
+		PROF_ALLOC_BYTES,   //< bytes of haplotype lists, pairs and caches
+		PROF_NUM_EVENT
+	};
+
+	/// A snapshot of the profiling counters
+	struct TProfileStat
+	{
+		/// the number of calls of each phase
+		int64_t NumCall[PROF_NUM_PHASE];
+		/// wall-clock time in seconds, summed over threads
+		double WallTime[PROF_NUM_PHASE];
+		/// CPU time in seconds of the threads running the phase, or the
+		//    process for training and prediction in total
+		double CPUTime[PROF_NUM_PHASE];
+		/// the counts of events
+		int64_t Event[PROF_NUM_EVENT];
+	};
+
+	/// Reset all profiling counters to zero
+	void ProfileReset();
+	/// Get a snapshot of the profiling counters
+	void ProfileGet(TProfileStat &Out);
+	/// Add to an event counter (thread-safe), used if 'Profile_Enabled'
+	void ProfileAdd(TProfileEvent Event, int64_t Value);
+
+	/// Timing a phase from the constructor to the destructor
+	class CProfileTiming
+	{
+	public:
+		CProfileTiming(TProfilePhase phase);
+		~CProfileTiming();
+	private:
+		int _Phase;  //< -1 if the counters are disabled
+		int64_t _Wall, _CPU;  //< the start time in nanoseconds
+	};
+
+
+
 	// ===================================================================== //
 	// ========                      algorithm                      ========
 
@@ -368,6 +642,95 @@ namespace HLA_LIB
 	/// The reltol convergence tolerance, sqrt(machine.epsilon) by default, used in EM algorithm
 	extern double EM_FuncRelTol;  // = sqrt(DBL_EPSILON)
 
+	/// Whether to use the SQUAREM extrapolation to accelerate EM algorithm
+	extern bool EM_Accelerate;  // = false
+
+	/// The successive-halving racing of candidate SNPs in each step of the
+	//    forward variable selection: the candidates are scored on a random
+	//    subset of out-of-bag samples with a loose EM tolerance, and only the
+	//    best of them move on to larger subsets and the full evaluation
+	struct TSearchRacing
+	{
+		bool Enabled;     //< false by default
+		double SampFrac;  //< the fraction of out-of-bag samples in the first round
+		double KeepFrac;  //< the fraction of candidates kept after a round
+		double EMRelTol;  //< the reltol of EM algorithm in the racing rounds
+	};
+	extern TSearchRacing Search_Racing;
+
+	/// The max number of bytes used by the distances of parent haplotype pairs
+	extern size_t ParentDist_MaxMemory;  // = 64MB
+
+
+	/// The distances between a genotype and haplotype pairs, derived from
+	//    the pairs of parent haplotypes (without the last SNP)
+	struct TParentDist
+	{
+		/// the distances between the genotype and the parent pairs
+		const UINT8 *Dist;
+		/// the offset in 'Dist' of the parent of each haplotype
+		const size_t *Offset;
+		/// the parent of each haplotype
+		const int *Parent;
+		/// the allele of the last SNP in each haplotype
+		const UINT8 *Allele;
+		/// the distance on the last SNP given the alleles (a1*2 + a2)
+		int NewDist[4];
+
+		/// set 'NewDist' by the genotype at the last SNP 'idx'
+		void SetNewSNP(const TGenotype &Geno, size_t idx);
+		/// the distance between the genotype and haplotypes (h1, h2), h1 <= h2
+		inline int Get(size_t h1, size_t h2) const
+		{
+			return Dist[Offset[h1] + Parent[h2]] +
+				NewDist[(Allele[h1] << 1) | Allele[h2]];
+		}
+	};
+
+
+	/// The distances between genotypes and all pairs of parent haplotypes,
+	//    which are shared by all candidate SNPs in a step of forward selection
+	class CParentDistCache
+	{
+	public:
+		CParentDistCache();
+
+		/// compute the distances for as many samples as the memory limit
+		//    allows, out-of-bag samples first
+		void Init(const CHaplotypeList &Parent, const CGenotypeList &GenoList);
+		/// release the distances
+		void Clear();
+
+		/// set the haplotypes with a new SNP, 'SrcIdx' is the output of
+		//    CHaplotypeList::EraseDoubleHaplos()
+		void SetChild(const vector<int> &SrcIdx, vector<size_t> &OutOffset,
+			vector<int> &OutParent, vector<UINT8> &OutAllele) const;
+
+		/// the distances of a sample, or NULL if not cached
+		inline const UINT8 *SampDist(int IdxSamp) const
+		{
+			if (_SampPos.empty()) return NULL;
+			int i = _SampPos[IdxSamp];
+			return (i >= 0) ? &_Dist[_NumPair * i] : NULL;
+		}
+		/// whether there are cached distances
+		inline bool Empty() const { return _NumCached <= 0; }
+
+	protected:
+		/// the number of parent haplotypes
+		size_t _NumParent;
+		/// the number of parent pairs (upper triangle with diagonal)
+		size_t _NumPair;
+		/// the number of cached samples
+		int _NumCached;
+		/// the offset of the row of each parent haplotype
+		vector<size_t> _RowOffset;
+		/// the position of each sample in '_Dist', -1 if not cached
+		vector<int> _SampPos;
+		/// the distances
+		vector<UINT8> _Dist;
+	};
+
 
 	/// variable sampling
 	class CBaseSampling
@@ -395,7 +758,8 @@ namespace HLA_LIB
 	{
 	public:
 		CSamplingWithoutReplace();
-		CBaseSampling *Init(int m_total);
+		/// initialize, using 'rand' instead of R's RNG if it is not NULL
+		CBaseSampling *Init(int m_total, TRandomStream *rand=NULL);
 
 		/// the total number of candidate SNPs
 		virtual int TotalNum() const;
@@ -417,6 +781,8 @@ namespace HLA_LIB
 		vector<int> _IdxArray;
 		/// the number of selected SNPs
 		int _m_try;
+		/// the random number stream, R's RNG is used if NULL
+		TRandomStream *_Rand;
 	};
 
 
@@ -433,37 +799,55 @@ namespace HLA_LIB
 			const CGenotypeList &GenoList, const CHLATypeList &HLAList,
 			CHaplotypeList &NextHaplo);
 
-		/// , return true if the new SNP is not monomorphic
+		/// , return true if the new SNP is not monomorphic; the allele
+		//    counts are computed from 'GenoList' if 'AlleleCnt' is NULL
 		bool PrepareNewSNP(const int NewSNP, const CHaplotypeList &CurHaplo,
 			const CSNPGenoMatrix &SNPMat, CGenotypeList &GenoList,
-			CHaplotypeList &NextHaplo);
+			CHaplotypeList &NextHaplo, const TSNPAlleleCnt *AlleleCnt=NULL);
 
-		/// call EM algorithm to estimate haplotype frequencies
-		void ExpectationMaximization(CHaplotypeList &NextHaplo);
+		/// call EM algorithm to estimate haplotype frequencies, with the
+		//    convergence tolerance 'RelTol' instead of EM_FuncRelTol if >= 0
+		void ExpectationMaximization(CHaplotypeList &NextHaplo,
+			double RelTol=-1);
 
-	protected:
-		/// A pair of haplotypes
-		struct THaploPair
-		{
-			bool Flag;       //< if true, the haplotype pair exists in the sample
-			THaplotype *H1;  //< the first haplotype
-			THaplotype *H2;  //< the second haplotype
-			double GenoFreq;     //< genotype frequency
+		/// copy the haplotype pairs of 'src' which point to 'SrcHaplo',
+		//    and make them point to 'DstHaplo' (a copy of 'SrcHaplo')
+		void AssignPairs(const CAlg_EM &src, const CHaplotypeList &SrcHaplo,
+			CHaplotypeList &DstHaplo);
 
-			THaploPair() { Flag = true; H1 = H2 = NULL; }
-			THaploPair(THaplotype *i1, THaplotype *i2) { Flag = true; H1 = i1; H2 = i2; }
-		};
+		/// the number of calls of ExpectationMaximization()
+		inline double NumCall() const { return _NumCall; }
+		/// the total number of EM iterations in ExpectationMaximization()
+		inline double NumIter() const { return _NumIter; }
 
-		/// A list of haplotype pairs
-		struct THaploPairList
-		{
-			int BootstrapCount;           //< the count in the bootstrapped data
-			int SampIndex;                //< the sample index in the source data
-			vector<THaploPair> PairList;  //< a list of haplotype pairs
-		};
+	protected:
+		// the haplotype pairs of all bootstrapped samples are stored in the
+		//   compressed sparse row format, the pairs of the i-th sample are
+		//   [_SampPairStart[i], _SampPairStart[i+1])
 
-		/// pairs of haplotypes for individuals
-		vector<THaploPairList> _SampHaploPair;
+		/// the count in the bootstrapped data
+		vector<int> _SampBootstrap;
+		/// the sample index in the source data
+		vector<int> _SampIndex;
+		/// the start of the haplotype pairs of each sample, plus the end
+		vector<size_t> _SampPairStart;
+		/// the indices of the first and second haplotypes in the pairs
+		vector<int> _PairH1, _PairH2;
+		/// the bit flags, if 1, the haplotype pair exists in the sample
+		vector<uint64_t> _PairFlag;
+		/// the genotype frequencies of the haplotype pairs
+		vector<double> _PairFreq;
+		/// the old and new haplotype frequencies in EM iterations
+		vector<double> _OldFreq, _NewFreq;
+		/// the statistics of ExpectationMaximization()
+		double _NumCall, _NumIter;
+		/// the haplotype frequencies used in the accelerated EM algorithm
+		vector<double> _Theta0, _Theta1, _Theta2;
+
+		/// one EM iteration, return the log likelihood of the input frequencies
+		double _EMStep(CHaplotypeList &Haplo);
+		/// EM algorithm with SQUAREM extrapolation, return # of iterations
+		int _AcceleratedEM(CHaplotypeList &Haplo, double RelTol);
 	};
 
 
@@ -473,6 +857,7 @@ namespace HLA_LIB
 	public:
 		friend class CVariableSelection;
 		friend class CAttrBag_Model;
+		friend class CPredictLatency;
 
 		CAlg_Prediction();
 
@@ -530,9 +915,209 @@ namespace HLA_LIB
 		//    without saving posterior probabilities in '_PostProb'
 		double _PredPostProb(const CHaplotypeList &Haplo, const TGenotype &Geno,
 			const THLAType &HLA);
+
+		/// the upper bound of the probability of an HLA pair (H1 <= H2)
+		struct TPairBound
+		{
+			double Bound;   //< the sum of 2*f_i*f_j over the haplotype pairs
+			int Index;      //< the index in the triangular HLA pair space
+			int H1, H2;     //< the HLA pair
+			size_t Start1, Len1;  //< the haplotypes of H1
+			size_t Start2, Len2;  //< the haplotypes of H2
+		};
+
+		/// the upper bounds of all HLA pairs sorted in decreasing order,
+		//    which do not depend on genotypes
+		void _InitPairBound(const CHaplotypeList &Haplo,
+			vector<TPairBound> &OutBound) const;
+		/// the best-guess HLA type, skipping the HLA pairs with small bounds
+		THLAType _PredBestGuess(const CHaplotypeList &Haplo,
+			const TGenotype &Geno, const vector<TPairBound> &Bound);
+		/// the best-guess HLA type using the distances from parent haplotypes,
+		//    skipping the HLA pairs with small bounds
+		THLAType _PredBestGuess(const CHaplotypeList &Haplo,
+			const TParentDist &Dist, const vector<TPairBound> &Bound);
+		/// the prob of the given HLA type using the distances from parent haplotypes
+		double _PredPostProb(const CHaplotypeList &Haplo,
+			const TParentDist &Dist, const THLAType &HLA);
+
+	private:
+		/// the probability of an HLA pair
+		inline double _PairProb(const CHaplotypeList &Haplo,
+			const TGenotype &Geno, const TPairBound &B);
+		inline double _PairProb(const CHaplotypeList &Haplo,
+			const TParentDist &Dist, const TPairBound &B);
+		/// sort the upper bounds in decreasing order
+		static bool _PairBoundGreater(const TPairBound &a, const TPairBound &b);
+		/// branch and bound
+		template<typename TGENO> THLAType _PredBestGuessBound(
+			const CHaplotypeList &Haplo, const TGENO &Geno,
+			const vector<TPairBound> &Bound);
+	};
+
+
+	/// The posterior probabilities of HLA genotypes in a sparse format
+	//    (compressed sparse row), keeping the top-K pairs and/or the pairs
+	//    above a cutoff for each sample in decreasing order of probability
+	struct TSparsePostProb
+	{
+	public:
+		/// the max number of HLA pairs per sample, no limit if <= 0
+		int TopK;
+		/// the min posterior probability of an HLA pair to be kept
+		double MinProb;
+		/// the start of each sample in 'Index' and 'Prob', n_samp + 1 elements
+		vector<size_t> SampStart;
+		/// the index of an HLA pair in the triangular space (h1 <= h2)
+		vector<int> Index;
+		/// the posterior probability of an HLA pair
+		vector<double> Prob;
+
+		TSparsePostProb();
+
+		/// initialize with no sample
+		void Init(int topk, double min_prob);
+		/// append the posterior probabilities of a sample
+		void Append(const double prob[], size_t n);
+		/// append all samples in another object
+		void Append(const TSparsePostProb &src);
+
+	private:
+		vector<int> _Work;
+		struct TGreater;
+	};
+
+
+	/// The max number of bytes used by the posterior probabilities of the
+	//    genotype patterns cached in prediction, shared by all classifiers
+	extern size_t PredCache_MaxMemory;  // = 256MB
+
+
+	/// The posterior probabilities of the genotype patterns already predicted
+	//    by a classifier, since many samples share the same SNP profile
+	class CPredCache
+	{
+	public:
+		CPredCache();
+
+		/// initialize
+		/** \param n_snp       the number of SNPs in the classifier
+		 *  \param n_prob      the number of posterior probabilities
+		 *  \param n_samp      the number of samples to be predicted
+		 *  \param max_memory  the max number of bytes
+		**/
+		void Init(int n_snp, size_t n_prob, int n_samp, size_t max_memory);
+		/// release the memory
+		void Clear();
+
+		/// the cached posterior probabilities of 'Geno', or NULL if not found
+		const double *Find(const TGenotype &Geno, double &OutSumProb);
+		/// add the posterior probabilities of the genotype not found in the
+		//    last call of Find(), ignored if the cache is full
+		void Add(const double Prob[], double SumProb);
+
+		/// the number of genotypes found in the cache
+		inline int64_t NumHit() const { return _NumHit; }
+		/// the number of genotypes not found in the cache
+		inline int64_t NumMiss() const { return _NumMiss; }
+
+	protected:
+		/// the number of bytes of each packed array in a key
+		size_t _NumByte;
+		/// the number of posterior probabilities per genotype
+		size_t _NumProb;
+		/// the max number of genotypes
+		size_t _MaxEntry;
+		/// the open-addressing hash table, storing the indices of entries or -1
+		vector<int> _Table;
+		/// the packed SNP1, SNP2 and missing flags of each entry
+		vector<UINT8> _Key;
+		/// the sum of prior probabilities of each entry
+		vector<double> _SumProb;
+		/// the posterior probabilities of each entry
+		vector<double> _Prob;
+		/// the key and the empty slot of the last call of Find()
+		vector<UINT8> _LastKey;
+		size_t _LastSlot;
+		/// the numbers of hits and misses
+		int64_t _NumHit, _NumMiss;
 	};
 
 
+	class CPredictLatency;
+
+	/// The state of a prediction call: the posterior probabilities and the
+	//    caches, so that concurrent calls can share a model
+	struct TPredContext
+	{
+		TPredContext(): Latency(NULL) { }
+
+		/// the posterior probabilities of a classifier and their sum
+		CAlg_Prediction Predict;
+		/// the cached posterior probabilities of each classifier
+		vector<CPredCache> Cache;
+		/// the bit-planes of a sample with 2-bit packed genotypes
+		vector<uint64_t> Planes;
+		/// the genotypes of a sample unpacked for the GPU extension
+		vector<int> Geno;
+		/// the genotypes of each classifier for the GPU extension
+		vector<TGenotype> GPUGeno;
+		/// if not NULL, the classifiers of a sample are evaluated in parallel
+		CPredictLatency *Latency;
+	};
+
+
+	/// The record of a candidate SNP in a step of the forward selection
+	struct TTrainingTraceRecord
+	{
+		int Classifier;  //< the index of the classifier, starting from ZERO
+		int Step;        //< the step, starting from ONE
+		int NumSNP;      //< the number of SNPs in the classifier before the step
+		int NumHaplo;    //< the number of haplotypes before the step
+		int SNP;         //< the candidate SNP, starting from ZERO
+		bool Valid;      //< false if the SNP is monomorphic in the bootstrap
+		int EMIter;      //< the number of EM iterations
+		int NumHaploEM;  //< the number of haplotypes after EM algorithm
+		int NumHaploErase;  //< the number of haplotypes without rare ones
+		double OOBAcc;   //< the out-of-bag accuracy, a bound if stopped early
+		double OOBTime;  //< the time of the out-of-bag accuracy in seconds
+		double InBagLoss;   //< the in-bag loss, NaN if not computed
+		double InBagTime;   //< the time of the in-bag loss in seconds
+		bool Pruned;     //< whether the SNP is removed from the candidates
+		int Winner;      //< the SNP added in this step, -1 if no SNP is added
+		int Raced;       //< the racing round eliminating the SNP, 0 if not
+	};
+
+	/// The sink of the training trace, thread-safe
+	class CTrainingTrace
+	{
+	public:
+		CTrainingTrace();
+		virtual ~CTrainingTrace();
+		/// write the records of a step
+		void Write(const vector<TTrainingTraceRecord> &Rec);
+	protected:
+		CMutex _Mutex;
+		/// write the records with the mutex locked
+		virtual void _Write(const vector<TTrainingTraceRecord> &Rec) = 0;
+	};
+
+	/// The training trace written to a CSV file, one line per candidate SNP
+	class CTrainingTraceCSV: public CTrainingTrace
+	{
+	public:
+		/// create the file, the indices of classifiers and SNPs start from ONE
+		CTrainingTraceCSV(const char *fn);
+		virtual ~CTrainingTraceCSV();
+	protected:
+		FILE *_File;
+		virtual void _Write(const vector<TTrainingTraceRecord> &Rec);
+	};
+
+	/// The training trace of CVariableSelection::Search(), no trace if NULL
+	extern CTrainingTrace *TrainingTrace;  // = NULL
+
+
 	/// variable selection algorithm
 	class CVariableSelection
 	{
@@ -547,6 +1132,13 @@ namespace HLA_LIB
 			vector<int> &OutSNPIndex, double &Out_Global_Max_OutOfBagAcc,
 			int mtry, bool prune, bool verbose, bool verbose_detail);
 
+		/// evaluate the candidate SNPs in parallel using 'pool' if not NULL
+		void SetThreadPool(CThreadPool *pool);
+		/// the number of calls and iterations of EM algorithm
+		void GetEMStat(double &NumCall, double &NumIter) const;
+		/// the index of the classifier in the training trace
+		void SetTraceIndex(int idx);
+
 		/// the number of samples
 		inline int nSamp() const { return _SNPMat->Num_Total_Samp; }
 		/// the number of SNPs
@@ -567,17 +1159,128 @@ namespace HLA_LIB
 		/// the prediction algorithm
 		CAlg_Prediction _Predict;
 
+		/// the working space of a thread for evaluating candidate SNPs
+		struct TCandidateSpace
+		{
+			CGenotypeList GenoList;  //< genotypes with the candidate SNP
+			CAlg_EM EM;              //< haplotype pairs and their flags
+			CHaplotypeList NextHaplo;
+			CHaplotypeList NextReducedHaplo;
+			/// the source of each haplotype in NextReducedHaplo
+			vector<int> SrcIdx;
+			/// for the distances derived from the parent haplotypes
+			vector<size_t> Offset;
+			vector<int> Parent;
+			vector<UINT8> Allele;
+		};
+
+		/// the evaluation of a candidate SNP
+		struct TCandidateEval
+		{
+			bool Valid;   //< false if the SNP is monomorphic in the bootstrap
+			int Acc;      //< the out-of-bag accuracy
+			double Loss;  //< the in-bag loss, computed if Acc >= the bound
+			// for the training trace
+			int SNP;         //< the candidate SNP
+			bool HasLoss;    //< whether 'Loss' is computed
+			bool Pruned;     //< whether the SNP is removed by pruning
+			int EMIter;      //< the number of EM iterations
+			int NumHaploEM;  //< the number of haplotypes after EM algorithm
+			int NumHaplo;    //< the number of haplotypes without rare ones
+			double OOBTime, InBagTime;  //< in seconds
+			int Raced;       //< the racing round eliminating the SNP, 0 if not
+			int NumSamp;     //< the number of out-of-bag samples if raced
+
+			void Init(int snp);
+		};
+
+		/// the thread pool for evaluating candidate SNPs
+		CThreadPool *_ThreadPool;
+		/// the working space for each thread
+		vector<TCandidateSpace> _CandSpace;
+		/// the working space in the calling thread
+		TCandidateSpace _MainSpace;
+		/// the distances from the parent haplotypes in the current step
+		CParentDistCache _ParentDist;
+		/// the out-of-bag samples, mispredicted by the current haplotypes first
+		vector<int> _OutOfBagOrder;
+		/// the allele counts of all SNPs in the bootstrap sample
+		vector<TSNPAlleleCnt> _AlleleCnt;
+		/// the index of the classifier in the training trace
+		int _TraceIdx;
+		/// the records of a step in the training trace
+		vector<TTrainingTraceRecord> _TraceRecord;
+		/// the parameters of the current step used by the worker threads
+		const int *_CandSNP;
+		const CHaplotypeList *_CandCurHaplo;
+		double _CandRareProb;
+		int _CandMinAcc;
+		TCandidateEval *_CandEval;
+		/// the random stream of the racing, seeded by the bootstrap sample
+		TRandomStream _RaceRand;
+		/// the out-of-bag samples in a random order for the racing
+		vector<int> _RaceSamp;
+		/// the number of samples in '_RaceSamp' used in the current round
+		int _RaceSampNum;
+		/// the candidates in the current racing round
+		const int *_RaceAlive;
+
 		/// initialize the haplotype list
 		void _InitHaplotype(CHaplotypeList &Haplo);
 
+		/// evaluate the candidate SNPs of one step in parallel
+		void _EvalCandidates(CBaseSampling &VarSampling,
+			const CHaplotypeList &CurHaplo, const CHaplotypeList &NextHaplo,
+			double RareProb, int MinAcc, vector<TCandidateEval> &OutEval);
+		/// evaluate a candidate SNP using the working space
+		void _EvalCandidate(TCandidateSpace &Space, int NewSNP,
+			const CHaplotypeList &CurHaplo, double RareProb, int MinAcc,
+			TCandidateEval &OutEval);
+		/// the task of evaluating the 'idx'-th candidate in a worker thread
+		void _EvalCandidateTask(int idx, int thread_idx);
+		/// copy the haplotype pairs and genotypes to the working space
+		void _InitCandSpace(TCandidateSpace &Space,
+			const CHaplotypeList &NextHaplo);
+
+		/// race the candidate SNPs by successive halving, and set 'Raced' of
+		//    the eliminated candidates in 'OutEval'
+		void _RaceCandidates(CBaseSampling &VarSampling,
+			const CHaplotypeList &CurHaplo, const CHaplotypeList &NextHaplo,
+			double RareProb, vector<TCandidateEval> &OutEval);
+		/// score a candidate SNP on the first '_RaceSampNum' samples
+		void _RaceCandidate(TCandidateSpace &Space, int NewSNP,
+			const CHaplotypeList &CurHaplo, double RareProb,
+			TCandidateEval &OutEval);
+		/// the task of scoring the 'idx'-th alive candidate in a worker thread
+		void _RaceCandidateTask(int idx, int thread_idx);
+
 		/// initialize the evaluation of in-bag and out-of-bag accuracy
 		void _Init_EvalAcc(CHaplotypeList &Haplo, CGenotypeList& Geno);
 		/// finalize the evaluation of in-bag and out-of-bag accuracy
 		void _Done_EvalAcc();
 		/// compute the out-of-bag accuracy (the number of correct alleles)
 		int _OutOfBagAccuracy(CHaplotypeList &Haplo);
+		/// compute the out-of-bag accuracy using the genotypes 'Geno', and
+		//    return a value less than 'MinAcc' as soon as it cannot reach 'MinAcc'
+		int _OutOfBagAccuracy(CHaplotypeList &Haplo, CGenotypeList &Geno,
+			TCandidateSpace *Space=NULL, int MinAcc=0);
+		/// compute the accuracy (the number of correct alleles) of the
+		//    'n_samp' out-of-bag samples in 'Samp'
+		int _SubsetAccuracy(CHaplotypeList &Haplo, CGenotypeList &Geno,
+			TCandidateSpace *Space, const int Samp[], int n_samp);
+		/// order the out-of-bag samples by the accuracy of the haplotypes 'Haplo'
+		void _InitOutOfBagOrder(CHaplotypeList &Haplo);
 		/// compute the in-bag log likelihood using the haplotypes 'Haplo'
 		double _InBagLogLik(CHaplotypeList &Haplo);
+		/// compute the in-bag log likelihood using the genotypes 'Geno'
+		double _InBagLogLik(CHaplotypeList &Haplo, CGenotypeList &Geno,
+			TCandidateSpace *Space=NULL);
+		/// prepare the distances derived from the parent haplotypes
+		bool _InitParentDist(const CHaplotypeList &Haplo,
+			TCandidateSpace *Space, TParentDist &Dist);
+		/// write the candidates of a step to the training trace
+		void _WriteTrace(int step, int n_snp, int n_haplo, int NumOOB,
+			const vector<TCandidateEval> &Eval, int winner);
 	};
 
 
@@ -586,13 +1289,162 @@ namespace HLA_LIB
 	// ===================================================================== //
 	// ========                   HIBAG -- model                    ========
 
+	/// The source of the SNP genotypes used in a model for prediction,
+	//    read in chunks of samples
+	class CBaseGenoReader
+	{
+	public:
+		virtual ~CBaseGenoReader() {}
+		/// the number of SNPs per sample
+		virtual int nSNP() const = 0;
+		/// read the genotypes (0, 1, 2, or missing otherwise) of the next
+		//    'n_samp' samples, one sample after another
+		virtual void Read(int OutGeno[], int n_samp) = 0;
+	};
+
+
+	/// A read-only memory-mapped file
+	class CMappedFile
+	{
+	public:
+		CMappedFile();
+		~CMappedFile();
+
+		/// map the whole file into memory, the pages are private to the
+		//    process and writable if 'copy_on_write' is true
+		void Open(const char *fn, bool copy_on_write=false);
+		/// unmap the file
+		void Close();
+
+		/// the content of the file
+		inline const UINT8 *Data() const { return _Data; }
+		/// the number of bytes in the file
+		inline int64_t Size() const { return _Size; }
+
+	private:
+		const UINT8 *_Data;
+		int64_t _Size;
+		void *_Handle;  //< the file mapping object on Windows
+
+		CMappedFile(const CMappedFile &);
+		CMappedFile &operator=(const CMappedFile &);
+	};
+
+
+	/// Read the SNP genotypes used in a model from a PLINK BED file, which is
+	//    memory-mapped, and only the records of the selected SNPs are visited
+	//    in the SNP-major mode
+	class CBEDGenoReader: public CBaseGenoReader
+	{
+	public:
+		CBEDGenoReader();
+
+		/// open a PLINK BED file
+		/** \param fn         the file name
+		 *  \param n_samp     the number of samples in the file
+		 *  \param n_snp      the number of SNPs in the file
+		 *  \param n_sel      the number of SNPs to be read
+		 *  \param SNPIndex   the indices of the SNPs to be read (starting from
+		 *                    ZERO), or -1 for a SNP not in the file (missing)
+		 *  \param Flip       if not NULL and Flip[i] != 0, the i-th genotype is
+		 *                    replaced by 2 - genotype
+		**/
+		void Open(const char *fn, int n_samp, int n_snp, int n_sel,
+			const int SNPIndex[], const int Flip[]);
+		/// close the file
+		void Close();
+
+		virtual int nSNP() const { return _SNPIndex.size(); }
+		virtual void Read(int OutGeno[], int n_samp);
+
+		/// the number of samples in the file
+		inline int nSamp() const { return _NumSamp; }
+		/// the position of the next sample to be read
+		inline int Position() const { return _Position; }
+		/// whether it is in the SNP-major mode
+		inline bool SNPMajor() const { return _SNPMajor; }
+
+	protected:
+		/// the input file
+		CMappedFile _File;
+		/// the numbers of samples and SNPs in the file
+		int _NumSamp, _NumSNP;
+		/// the SNP-major or individual-major mode
+		bool _SNPMajor;
+		/// the number of bytes per record
+		int64_t _RecordSize;
+		/// the position of the next sample
+		int _Position;
+		/// the selected SNPs and whether to flip their genotypes
+		vector<int> _SNPIndex;
+		vector<UINT8> _Flip;
+		/// the decoded genotypes of a tile of SNPs and samples
+		vector<int> _Tile;
+	};
+
+
 	class CAttrBag_Model;
+	class CAttrBag_Classifier;
+
+	/// The append-only checkpoint file of building individual classifiers
+	/** a header with the training data and parameters is followed by one
+	 *  record per finished classifier (the index, SNPs, bootstrap counts,
+	 *  out-of-bag accuracy and haplotypes); the bootstrap samples and the
+	 *  random seeds of all classifiers are drawn in order from a random
+	 *  stream seeded in the header, so a build can be resumed after any
+	 *  finished classifier, and a truncated record at the end is ignored
+	**/
+	class CBuildCheckpoint
+	{
+	public:
+		CBuildCheckpoint();
+		~CBuildCheckpoint();
+
+		/// open the file to resume, or create it with 'seed' if not existing,
+		//    'parallel' if the classifiers are built by the compute nodes with
+		//    their own seeds instead of the random stream
+		void Open(const char *fn, const CAttrBag_Model &Model, int mtry,
+			bool prune, uint64_t seed, bool parallel=false);
+		/// close the file
+		void Close();
+
+		/// the seed of the random stream
+		inline uint64_t Seed() const { return _Seed; }
+		/// the number of classifiers in the file
+		int NumClassifier() const;
+		/// whether the 'idx'-th classifier is in the file
+		bool Has(int idx) const;
+		/// load the 'idx'-th classifier from the file
+		void Load(int idx, CAttrBag_Classifier &C);
+		/// append the 'idx'-th classifier, and flush it to the disk
+		void Append(int idx, const CAttrBag_Classifier &C);
+
+	private:
+		FILE *_File;
+		string _FileName;
+		uint64_t _Seed;
+		int _NumSNP, _NumSamp, _NumHLA;
+		/// the offset of the record of each classifier, -1 if not in the file
+		vector<int64_t> _Offset;
+		/// the end of the last valid record
+		int64_t _End;
+
+		/// read the record at the current position, return false if it is
+		//    truncated or invalid
+		bool _ReadRecord(int &idx, int &n_snp, int &n_haplo, double &acc,
+			vector<UINT8> &buf);
+
+		CBuildCheckpoint(const CBuildCheckpoint &);
+		CBuildCheckpoint &operator=(const CBuildCheckpoint &);
+	};
+
 
 	/// the individual classifier of HIBAG
 	class CAttrBag_Classifier
 	{
 	public:
 		friend class CAttrBag_Model;
+		friend class CBuildCheckpoint;
 
 		CAttrBag_Classifier(CAttrBag_Model &_owner);
 
@@ -605,6 +1457,9 @@ namespace HLA_LIB
 		/// grow this classifier by adding SNPs
 		void Grow(CBaseSampling &VarSampling, int mtry, bool prune,
 			bool verbose, bool verbose_detail);
+		/// grow this classifier by adding SNPs with a specified selection object
+		void Grow(CVariableSelection &VarSelect, CBaseSampling &VarSampling,
+			int mtry, bool prune, bool verbose, bool verbose_detail);
 
 		/// the owner
 		inline CAttrBag_Model &Owner() { return *_Owner; }
@@ -640,8 +1495,10 @@ namespace HLA_LIB
 	{
 	public:
 		friend class CAttrBag_Classifier;
+		friend class CBuildCheckpoint;
 
 		CAttrBag_Model();
+		~CAttrBag_Model();
 
 		/// initialize the training model
 		void InitTraining(int n_snp, int n_samp, int n_hla);
@@ -654,10 +1511,31 @@ namespace HLA_LIB
 		CAttrBag_Classifier *NewClassifierAllSamp();
 
 		/// build n individual classifiers with the specified parameters
+		/** if nthreads > 1, the classifiers are grown in parallel, and each
+		 *  classifier uses its own random number stream seeded by R's RNG;
+		 *  if nclassifier = 1, the candidate SNPs are evaluated in parallel;
+		 *  if 'checkpoint' is not NULL, each finished classifier is appended
+		 *  to the checkpoint file, and the classifiers in an existing file
+		 *  are loaded instead of being built again (see CBuildCheckpoint)
+		**/
 		void BuildClassifiers(int nclassifier, int mtry, bool prune,
-			bool verbose, bool verbose_detail=false);
-
-		/** get the best-guess HLA types
+			bool verbose, bool verbose_detail=false, int nthreads=1,
+			const char *checkpoint=NULL);
+
+		/// open the checkpoint file of the classifiers built by the compute
+		//    nodes (see CBuildCheckpoint), and add the first 'nclassifier'
+		//    classifiers in the file to the model, return the seed of the
+		//    file, and the indices of the loaded classifiers in 'index'
+		uint64_t OpenCheckpoint(const char *fn, int nclassifier, int mtry,
+			bool prune, uint64_t seed, vector<int> &index);
+		/// append the last classifier as the 'idx'-th to the checkpoint file
+		void AppendCheckpoint(int idx);
+		/// close the checkpoint file
+		void CloseCheckpoint();
+
+		/** get the best-guess HLA types, the model is not modified, and
+		 *    concurrent calls are allowed if ShowInfo = false and the GPU
+		 *    extension is not used
 		 *  \param genomat       genotype matrix
 		 *  \param n_samp        the number of samples in genomat
 		 *  \param vote_method   1: average posterior prob, 2: majority voting
@@ -667,10 +1545,70 @@ namespace HLA_LIB
 		 *  \param OutProbArray  the posterior prob. of all HLA genotypes per sample
 		 *  \param OutMatching   the sum of prior prob. per sample
 		 *  \param ShowInfo      if true, show information
+		 *  \param OutSparseProb the posterior prob. in a sparse format,
+		 *                       appended per sample if not NULL
+		 *  \param nthreads      the number of threads sharing the model, each
+		 *                       predicting a block of samples at a time; if
+		 *                       there are fewer blocks than threads, the
+		 *                       classifiers of each sample are evaluated in
+		 *                       parallel by a thread pool kept in the model
 		**/
 		void PredictHLA(const int *genomat, int n_samp, int vote_method,
 			int OutH1[], int OutH2[], double OutMaxProb[],
-			double OutMatching[], double OutProbArray[], bool ShowInfo);
+			double OutMatching[], double OutProbArray[], bool ShowInfo,
+			TSparsePostProb *OutSparseProb=NULL, int nthreads=1) const;
+
+		/** get the best-guess HLA types from 2-bit packed genotypes
+		 *  \param packed_geno   (nSNP()+3)/4 bytes per sample, four SNPs per
+		 *                       byte from the lowest bits, using the PLINK
+		 *                       encoding: 00 -- genotype 2, 10 -- 1,
+		 *                       11 -- 0, 01 -- missing
+		 *  other parameters are the same as above
+		**/
+		void PredictHLA(const UINT8 *packed_geno, int n_samp, int vote_method,
+			int OutH1[], int OutH2[], double OutMaxProb[],
+			double OutMatching[], double OutProbArray[], bool ShowInfo,
+			TSparsePostProb *OutSparseProb=NULL, int nthreads=1) const;
+
+		/** get the best-guess HLA types with the genotypes read in chunks,
+		 *    the memory usage does not depend on the number of samples
+		 *  \param Reader        the source of genotypes
+		 *  \param n_samp        the number of samples to be read
+		 *  \param chunk_size    the number of samples in a chunk
+		 *  other parameters are the same as above
+		**/
+		void PredictHLA(CBaseGenoReader &Reader, int n_samp, int chunk_size,
+			int vote_method, int OutH1[], int OutH2[], double OutMaxProb[],
+			double OutMatching[], bool ShowInfo,
+			TSparsePostProb *OutSparseProb=NULL, int nthreads=1) const;
+
+		/** save the model to a binary file
+		 *  \param fn           the file name
+		 *  \param meta         an opaque block of metadata stored in the file
+		 *  \param meta_size    the number of bytes in 'meta'
+		**/
+		void SaveBinary(const char *fn, const void *meta,
+			size_t meta_size) const;
+		/** load a model from a binary file created by SaveBinary(), the file
+		 *    is memory-mapped and the haplotypes are used in place without
+		 *    parsing, so the processes loading the same file share the pages
+		 *  \param fn           the file name
+		**/
+		void LoadBinary(const char *fn);
+		/// the metadata block in the binary file, NULL if not loaded from a file
+		const UINT8 *BinaryMeta(size_t &OutSize) const;
+
+		/** save the training set (the packed genotypes and the HLA types of
+		 *    training samples, no allele names) to a file for LoadTraining()
+		 *  \param fn           the file name
+		**/
+		void SaveTraining(const char *fn) const;
+		/** load the training set from a file created by SaveTraining(), the
+		 *    file is memory-mapped read-only and the genotypes are used in
+		 *    place, so the worker processes share the pages
+		 *  \param fn           the file name
+		**/
+		void LoadTraining(const char *fn);
 
 		/// the number of samples
 		inline int nSamp() const { return _SNPMat.Num_Total_Samp; }
@@ -695,21 +1633,114 @@ namespace HLA_LIB
 		vector<CAttrBag_Classifier> _ClassifierList;
 		/// variable selection algorithm
 		CVariableSelection _VarSelect;
-		/// prediction algorithm
-		CAlg_Prediction _Predict;
 
-		/// prediction HLA types internally
-		void _PredictHLA(const int geno[], const int snp_weight[],
-			int vote_method, double &OutMatching);
+		/// gathering the SNPs of a classifier from the bit-planes of all SNPs
+		struct TPackedGather
+		{
+			/// the haplotypes with SNPs sorted by their indices in the model
+			CHaplotypeList Haplo;
+			/// the sorted indices of SNPs in the model
+			vector<int> SNP;
+			/// the 64-bit words in the bit-planes and the bits of the SNPs
+			vector<int> Word;
+			vector<uint64_t> Mask;
+			/// the sum of SNP weights
+			int SumWeight;
+		};
+		/// the data derived from the classifiers for prediction, which are
+		//    prepared by the first prediction call and shared by later calls
+		mutable vector<int> _SNPWeight;  //< the weight of each SNP
+		/// the gathering of each classifier for 2-bit packed genotypes
+		mutable vector<TPackedGather> _PackedGather;
+		mutable bool _PredPrepared;  //< whether '_SNPWeight' is prepared
+		mutable CMutex _PredMutex;   //< the mutex for preparing
+
+		/// prepare '_SNPWeight', and '_PackedGather' if 'packed' is true
+		void _PreparePredict(bool packed) const;
+		/// the data for prediction should be prepared again
+		void _ResetPredict();
+
+		/// prediction HLA types internally from the genotypes 'geno', or from
+		//    the bit-planes of all SNPs if 'geno' is NULL (allele 1, allele 2
+		//    and missing flag, (nSNP()+63)/64 words each)
+		void _PredictHLA(TPredContext &Ctx, const int geno[],
+			const uint64_t planes[], int vote_method, double &OutMatching) const;
+		/// add the posterior probabilities of the 'idx'-th classifier to the
+		//    sum, return false if all SNPs in the classifier are missing
+		bool _AddClassifier(CAlg_Prediction &Predict, CPredCache &Cache,
+			size_t idx, const int geno[], const uint64_t planes[],
+			int vote_method, double &OutMatching) const;
+		/// add the posterior probabilities of a classifier to the sum
+		void _AddPostProb(CAlg_Prediction &Predict, CPredCache &Cache,
+			const CHaplotypeList &Haplo, const TGenotype &Geno, double weight,
+			int vote_method, double &OutMatching) const;
+		/// predicting blocks of samples with multiple threads
+		class CPredictJob;
+		friend class CPredictJob;
+		/// evaluating the classifiers of a sample with multiple threads
+		friend class CPredictLatency;
+		/// the warm thread pool for the low-latency prediction, kept alive
+		//    between calls, NULL if not used yet
+		mutable CPredictLatency *_Latency;
+		mutable CMutex _LatencyMutex;  //< locked by the call using '_Latency'
+
+		/// predict the HLA types of the samples in 'genomat', 'packed_geno'
+		//    or read from 'Reader' with 'nthreads' threads
+		void _PredictAll(const int *genomat, const UINT8 *packed_geno,
+			CBaseGenoReader *Reader, int chunk_size, int n_samp,
+			int vote_method, int OutH1[], int OutH2[], double OutMaxProb[],
+			double OutMatching[], double OutProbArray[], bool ShowInfo,
+			TSparsePostProb *OutSparseProb, int nthreads) const;
+		/// predict the HLA types with 'nthreads' threads for blocks of
+		//    samples, or a sample at a time with 'latency' if not NULL
+		void _PredictSamplesBy(int nthreads, CPredictLatency *latency,
+			const int *genomat, const UINT8 *packed_geno,
+			CBaseGenoReader *Reader, int chunk_size, int n_samp,
+			int vote_method, int OutH1[], int OutH2[], double OutMaxProb[],
+			double OutMatching[], double OutProbArray[], bool ShowInfo,
+			TSparsePostProb *OutSparseProb) const;
+		/// predict the HLA types of the samples in 'genomat' or 'packed_geno'
+		void _PredictSamples(TPredContext &Ctx, const int *genomat,
+			const UINT8 *packed_geno, int n_samp, int vote_method,
+			int OutH1[], int OutH2[], double OutMaxProb[],
+			double OutMatching[], double OutProbArray[],
+			TSparsePostProb *OutSparseProb) const;
+		/// initialize '_PackedGather'
+		void _InitPackedGather() const;
 		/// get weight with respect to the SNP frequencies in the model for missing SNPs
-		void _GetSNPWeights(int OutSNPWeight[]);
+		void _GetSNPWeights(int OutSNPWeight[]) const;
+
+		/// initialize a context, with at most 'cache_memory' bytes for caching
+		void _Init_PredictHLA(TPredContext &Ctx, int n_samp, int vote_method,
+			bool packed, size_t cache_memory) const;
+		void _Done_PredictHLA(TPredContext &Ctx) const;
 
-		void _Init_PredictHLA();
-		void _Done_PredictHLA();
+		/// build n individual classifiers in the calling thread
+		void _BuildClassifiers(int nclassifier, int mtry, bool prune,
+			bool verbose, bool verbose_detail);
+		/// build n individual classifiers using multiple threads
+		void _BuildClassifiersParallel(int nclassifier, int mtry, bool prune,
+			bool verbose, int nthreads);
+		/// build n individual classifiers with a checkpoint file
+		void _BuildClassifiersCheckpoint(int nclassifier, int mtry,
+			bool prune, bool verbose, bool verbose_detail, int nthreads,
+			const char *checkpoint);
+		/// grow the classifiers 'start + index[i]' with their random seeds,
+		//    and append each finished classifier to 'checkpoint' if not NULL
+		void _GrowClassifiers(int start, const vector<int> &index,
+			const vector<uint64_t> &seed, int mtry, bool prune, bool verbose,
+			bool verbose_detail, int nthreads, CBuildCheckpoint *checkpoint);
 
 	private:
-		vector<TGenotype> gpu_geno_buf;
-		vector<int> gpu_num_haplo;
+		/// the memory-mapped binary model file, NULL if not loaded from a file
+		CMappedFile *_ModelFile;
+		/// the memory-mapped training file, NULL if not loaded from a file
+		CMappedFile *_TrainingFile;
+		/// the checkpoint file opened by OpenCheckpoint(), or NULL
+		CBuildCheckpoint *_Checkpoint;
+
+		CAttrBag_Model(const CAttrBag_Model &);
+		CAttrBag_Model &operator=(const CAttrBag_Model &);
 	};
 
 
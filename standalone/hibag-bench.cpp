@@ -0,0 +1,1029 @@
+// ===============================================================
+//
+// HIBAG R package (HLA Genotype Imputation with Attribute Bagging)
+// Copyright (C) 2020   Xiuwen Zheng (zhengx@u.washington.edu)
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// ===============================================================
+// Name           : hibag-bench
+// Author         : Xiuwen Zheng
+// Copyright      : Xiuwen Zheng (GPL v3)
+// Description    : Micro-benchmarks of the LibHLA kernels on synthetic
+//                  haplotype lists
+// ===============================================================
+
+#include "LibHLA.h"
+
+#include <time.h>
+#include <algorithm>
+
+using namespace std;
+using namespace HLA_LIB;
+
+
+// ========================================================================= //
+
+/// the number of genotypes to be predicted in a benchmark, used in turn
+static const size_t NUM_TEST_GENO = 64;
+
+/// the mutation rate of the haplotypes of an HLA allele from its founder
+static const double HAPLO_MUTATION = 0.1;
+/// the genotyping error rate and the missing rate of the synthetic genotypes
+static const double GENO_ERROR = 0.01;
+static const double GENO_MISSING = 0.01;
+
+/// the options of command line
+struct TOption
+{
+	vector<int> NumSNP, NumAllele, NumHaplo;
+	int MaxHaplo, NumSamp, Repeat;
+	double MinTime;
+	uint64_t Seed;
+	vector<string> Kernel;
+	int NumCheck;
+
+	TOption()
+	{
+		MaxHaplo = 4000; NumSamp = 500; Repeat = 3;
+		MinTime = 0.2; Seed = 1000; NumCheck = 0;
+	}
+};
+
+/// the wall-clock time in seconds
+static double Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/// parse a comma-separated list of integers
+static bool ParseIntList(const char *s, vector<int> &out)
+{
+	out.clear();
+	while (*s)
+	{
+		char *end;
+		long v = strtol(s, &end, 10);
+		if (end == s) return false;
+		out.push_back(v);
+		s = end;
+		if (*s == ',') s ++;
+		else if (*s) return false;
+	}
+	return !out.empty();
+}
+
+/// split a comma-separated list of strings
+static void ParseStrList(const char *s, vector<string> &out)
+{
+	out.clear();
+	const char *st = s;
+	for (;; s++)
+	{
+		if ((*s == ',') || (*s == 0))
+		{
+			if (s > st) out.push_back(string(st, s));
+			if (*s == 0) break;
+			st = s + 1;
+		}
+	}
+}
+
+
+// ========================================================================= //
+// the synthetic data of a classifier
+
+/// haplotypes, genotypes and HLA types with a fixed random seed
+struct TBenchData
+{
+	/// the haplotypes with all SNPs (prediction)
+	CHaplotypeList Haplo;
+	/// the haplotypes without the last SNP (EM algorithm)
+	CHaplotypeList CurHaplo;
+	/// the genotypes of training samples without the last SNP
+	CGenotypeList TrainGeno;
+	/// the HLA types of training samples
+	CHLATypeList TrainHLA;
+	/// the genotypes of training samples at the last SNP
+	vector<int> TrainNewSNP;
+	/// the genotypes to be predicted with all SNPs
+	vector<TGenotype> TestGeno;
+	/// the HLA types of the genotypes to be predicted
+	vector<THLAType> TestHLA;
+
+	void Init(int n_snp, int n_allele, int n_haplo, int n_samp,
+		uint64_t seed);
+
+private:
+	TRandomStream _Rand;
+	vector<double> _CumAllele;
+
+	int _RandAllele();
+	const string &_RandHaplo(const vector<string> &str, int allele,
+		int n_haplo);
+	int _RandGeno(int g);
+};
+
+int TBenchData::_RandAllele()
+{
+	double u = _Rand.Unif() * _CumAllele.back();
+	return upper_bound(_CumAllele.begin(), _CumAllele.end(), u) -
+		_CumAllele.begin();
+}
+
+const string &TBenchData::_RandHaplo(const vector<string> &str, int allele,
+	int n_haplo)
+{
+	int k = int(_Rand.Unif() * n_haplo);
+	return str[allele*n_haplo + std::min(k, n_haplo-1)];
+}
+
+int TBenchData::_RandGeno(int g)
+{
+	double u = _Rand.Unif();
+	if (u < GENO_MISSING) return -1;
+	if (u < GENO_MISSING + GENO_ERROR) return (g + 1) % 3;
+	return g;
+}
+
+void TBenchData::Init(int n_snp, int n_allele, int n_haplo, int n_samp,
+	uint64_t seed)
+{
+	_Rand.Seed(seed);
+
+	// the frequencies of HLA alleles are skewed as in real data
+	_CumAllele.resize(n_allele);
+	for (int i=0; i < n_allele; i++)
+		_CumAllele[i] = (i ? _CumAllele[i-1] : 0) + 1.0 / (i + 1);
+
+	// the haplotypes of an HLA allele are mutated from a founder, and the
+	//   founder has a larger frequency
+	vector<string> str(n_allele * n_haplo);
+	vector<double> freq(n_allele * n_haplo);
+	double sum = 0;
+	for (int i=0; i < n_allele; i++)
+	{
+		string founder(n_snp, '0');
+		for (int j=0; j < n_snp; j++)
+			if (_Rand.Unif() < 0.5) founder[j] = '1';
+		for (int k=0; k < n_haplo; k++)
+		{
+			string &s = str[i*n_haplo + k];
+			s = founder;
+			if (k > 0)
+			{
+				for (int j=0; j < n_snp; j++)
+					if (_Rand.Unif() < HAPLO_MUTATION) s[j] ^= 1;
+			}
+			double f = (_Rand.Unif() + 0.05) * ((k == 0) ? 5 : 1) / (i + 1);
+			freq[i*n_haplo + k] = f;
+			sum += f;
+		}
+	}
+
+	// haplotype lists
+	CHaplotypeList *HL[2] = { &Haplo, &CurHaplo };
+	for (int m=0; m < 2; m++)
+	{
+		CHaplotypeList &H = *HL[m];
+		H.Num_SNP = n_snp - m;
+		H.ResizeHaplo(str.size());
+		H.LenPerHLA.assign(n_allele, n_haplo);
+		for (size_t i=0; i < str.size(); i++)
+		{
+			memset(H.List[i].PackedHaplo, 0, sizeof(H.List[i].PackedHaplo));
+			H.List[i].StrToHaplo(str[i].substr(0, H.Num_SNP));
+			H.List[i].Freq = freq[i] / sum;
+			H.List[i].aux.OldFreq = 0;
+		}
+	}
+
+	// training samples with bootstrap counts
+	TrainGeno.List.assign(n_samp, TGenotype());
+	TrainGeno.Num_SNP = n_snp - 1;
+	TrainHLA.List.resize(n_samp);
+	TrainHLA.Str_HLA_Allele.resize(n_allele);
+	for (int i=0; i < n_allele; i++)
+	{
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%02d:01", i+1);
+		TrainHLA.Str_HLA_Allele[i] = buf;
+	}
+	TrainNewSNP.resize(n_samp);
+	for (int i=0; i < n_samp; i++)
+	{
+		TGenotype &G = TrainGeno.List[i];
+		THLAType &T = TrainHLA.List[i];
+		T.Allele1 = _RandAllele(); T.Allele2 = _RandAllele();
+		if (T.Allele1 > T.Allele2) std::swap(T.Allele1, T.Allele2);
+		const string &s1 = _RandHaplo(str, T.Allele1, n_haplo);
+		const string &s2 = _RandHaplo(str, T.Allele2, n_haplo);
+		memset(G.PackedSNP1, 0, sizeof(G.PackedSNP1));
+		memset(G.PackedSNP2, 0, sizeof(G.PackedSNP2));
+		memset(G.PackedMissing, 0, sizeof(G.PackedMissing));
+		for (int j=0; j < n_snp-1; j++)
+			G.SetSNP(j, _RandGeno((s1[j]-'0') + (s2[j]-'0')));
+		TrainNewSNP[i] = _RandGeno((s1[n_snp-1]-'0') + (s2[n_snp-1]-'0'));
+	}
+	for (int i=0; i < n_samp; i++)
+		TrainGeno.List[int(_Rand.Unif() * n_samp)].BootstrapCount ++;
+
+	// genotypes to be predicted
+	TestGeno.assign(NUM_TEST_GENO, TGenotype());
+	TestHLA.resize(NUM_TEST_GENO);
+	for (size_t i=0; i < NUM_TEST_GENO; i++)
+	{
+		TGenotype &G = TestGeno[i];
+		THLAType &T = TestHLA[i];
+		T.Allele1 = _RandAllele(); T.Allele2 = _RandAllele();
+		if (T.Allele1 > T.Allele2) std::swap(T.Allele1, T.Allele2);
+		const string &s1 = _RandHaplo(str, T.Allele1, n_haplo);
+		const string &s2 = _RandHaplo(str, T.Allele2, n_haplo);
+		memset(G.PackedSNP1, 0, sizeof(G.PackedSNP1));
+		memset(G.PackedSNP2, 0, sizeof(G.PackedSNP2));
+		memset(G.PackedMissing, 0, sizeof(G.PackedMissing));
+		for (int j=0; j < n_snp; j++)
+			G.SetSNP(j, _RandGeno((s1[j]-'0') + (s2[j]-'0')));
+	}
+}
+
+
+// ========================================================================= //
+// the kernels
+
+/// a benchmark kernel, Run() is one operation
+class CBenchKernel
+{
+public:
+	CBenchKernel() { Pairs = 0; Check = 0; }
+	virtual ~CBenchKernel() {}
+
+	/// the name shown in the output
+	virtual const char *Name() const = 0;
+	/// set up with the data
+	virtual void Init(TBenchData &Data) = 0;
+	/// the i-th operation
+	virtual void Run(size_t i) = 0;
+
+	/// the number of haplotype pairs enumerated by the operations
+	double Pairs;
+	/// a fingerprint of the results, independent of timing
+	uint64_t Check;
+
+protected:
+	TBenchData *_Data;
+	inline void _AddCheck(uint64_t v) { Check = Check*31 + v; }
+};
+
+/// the access to the protected prediction kernels
+class CBenchPrediction: public CAlg_Prediction
+{
+public:
+	using CAlg_Prediction::TPairBound;
+	using CAlg_Prediction::_PredBestGuess;
+	using CAlg_Prediction::_PredPostProb;
+	using CAlg_Prediction::_InitPairBound;
+};
+
+/// the access to the haplotype pairs of EM algorithm
+class CBenchEM: public CAlg_EM
+{
+public:
+	inline size_t NumPair() const { return _PairH1.size(); }
+	/// the log likelihood of the haplotype frequencies
+	double LogLik(CHaplotypeList &Haplo)
+	{
+		vector<double> f(Haplo.Num_Haplo);
+		for (size_t i=0; i < Haplo.Num_Haplo; i++) f[i] = Haplo.List[i].Freq;
+		double rv = _EMStep(Haplo);
+		for (size_t i=0; i < Haplo.Num_Haplo; i++) Haplo.List[i].Freq = f[i];
+		return rv;
+	}
+};
+
+/// TGenotype::_HamDist() via TGenotype::HammingDistance(), a call per op
+class CBench_HamDist: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "hamdist"; }
+	virtual void Init(TBenchData &Data) { _Data = &Data; }
+	virtual void Run(size_t i)
+	{
+		const CHaplotypeList &H = _Data->Haplo;
+		const TGenotype &G = _Data->TestGeno[i % NUM_TEST_GENO];
+		size_t k = i % H.Num_Haplo;
+		size_t m = (i * 7919) % H.Num_Haplo;
+		_AddCheck(G.HammingDistance(H.Num_SNP, H.List[k], H.List[m]));
+		Pairs ++;
+	}
+};
+
+/// CAlg_Prediction::PredictPostProb(), a genotype per op
+class CBench_PostProb: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "pred.postprob"; }
+	virtual void Init(TBenchData &Data)
+	{
+		_Data = &Data;
+		_Pred.InitPrediction(Data.Haplo.nHLA());
+		_NPair = double(Data.Haplo.Num_Haplo) * (Data.Haplo.Num_Haplo+1) / 2;
+	}
+	virtual void Run(size_t i)
+	{
+		double sum;
+		_Pred.PredictPostProb(_Data->Haplo,
+			_Data->TestGeno[i % NUM_TEST_GENO], sum);
+		THLAType T = _Pred.BestGuess();
+		_AddCheck(T.Allele1); _AddCheck(T.Allele2);
+		Pairs += _NPair;
+	}
+private:
+	CBenchPrediction _Pred;
+	double _NPair;
+};
+
+/// CAlg_Prediction::_PredBestGuess() enumerating all HLA pairs
+class CBench_BestGuess: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "pred.bestguess"; }
+	virtual void Init(TBenchData &Data)
+	{
+		_Data = &Data;
+		_Pred.InitPrediction(Data.Haplo.nHLA());
+		_NPair = double(Data.Haplo.Num_Haplo) * (Data.Haplo.Num_Haplo+1) / 2;
+	}
+	virtual void Run(size_t i)
+	{
+		THLAType T = _Pred._PredBestGuess(_Data->Haplo,
+			_Data->TestGeno[i % NUM_TEST_GENO]);
+		_AddCheck(T.Allele1); _AddCheck(T.Allele2);
+		Pairs += _NPair;
+	}
+protected:
+	CBenchPrediction _Pred;
+	double _NPair;
+};
+
+/// CAlg_Prediction::_PredBestGuess() with the upper bounds of HLA pairs,
+//    the pairs are counted as in the enumeration of all HLA pairs
+class CBench_BestGuessBound: public CBench_BestGuess
+{
+public:
+	virtual const char *Name() const { return "pred.bestguess.bound"; }
+	virtual void Init(TBenchData &Data)
+	{
+		CBench_BestGuess::Init(Data);
+		_Pred._InitPairBound(Data.Haplo, _Bound);
+	}
+	virtual void Run(size_t i)
+	{
+		THLAType T = _Pred._PredBestGuess(_Data->Haplo,
+			_Data->TestGeno[i % NUM_TEST_GENO], _Bound);
+		_AddCheck(T.Allele1); _AddCheck(T.Allele2);
+		Pairs += _NPair;
+	}
+private:
+	vector<CBenchPrediction::TPairBound> _Bound;
+};
+
+/// CAlg_Prediction::_PredPostProb() of the true HLA type, a genotype per op,
+//    enumerating all HLA pairs for the normalization
+class CBench_PredPostProb: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "pred.hlaprob"; }
+	virtual void Init(TBenchData &Data)
+	{
+		_Data = &Data;
+		_Pred.InitPrediction(Data.Haplo.nHLA());
+		_NPair = double(Data.Haplo.Num_Haplo) * (Data.Haplo.Num_Haplo+1) / 2;
+	}
+	virtual void Run(size_t i)
+	{
+		double p = _Pred._PredPostProb(_Data->Haplo,
+			_Data->TestGeno[i % NUM_TEST_GENO], _Data->TestHLA[i % NUM_TEST_GENO]);
+		_AddCheck(uint64_t(p * 1e6 + 0.5));
+		Pairs += _NPair;
+	}
+private:
+	CBenchPrediction _Pred;
+	double _NPair;
+};
+
+/// CAlg_EM::PrepareHaplotypes() with all training samples
+class CBench_EMPrepare: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "em.prepare"; }
+	virtual void Init(TBenchData &Data)
+	{
+		_Data = &Data;
+		// the pairs enumerated for each bootstrapped sample
+		_NPair = 0;
+		const CHaplotypeList &H = Data.CurHaplo;
+		for (int i=0; i < Data.TrainGeno.nSamp(); i++)
+		{
+			if (Data.TrainGeno.List[i].BootstrapCount > 0)
+			{
+				const THLAType &T = Data.TrainHLA.List[i];
+				double n1 = 2*H.LenPerHLA[T.Allele1];
+				double n2 = 2*H.LenPerHLA[T.Allele2];
+				_NPair += (T.Allele1 == T.Allele2) ? n1*(n1+1)/2 : n1*n2;
+			}
+		}
+	}
+	virtual void Run(size_t)
+	{
+		_EM.PrepareHaplotypes(_Data->CurHaplo, _Data->TrainGeno,
+			_Data->TrainHLA, _Next);
+		_AddCheck(_EM.NumPair());
+		Pairs += _NPair;
+	}
+private:
+	CBenchEM _EM;
+	CHaplotypeList _Next;
+	double _NPair;
+};
+
+/// CAlg_EM::ExpectationMaximization() after adding the last SNP, the pairs
+//    are counted once per EM iteration
+class CBench_EM: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "em.iterate"; }
+	virtual void Init(TBenchData &Data)
+	{
+		_Data = &Data;
+		CSNPGenoMatrix Mat;
+		Mat.Init(1, Data.TrainNewSNP.size(), &Data.TrainNewSNP[0]);
+		_EM.PrepareHaplotypes(Data.CurHaplo, Data.TrainGeno, Data.TrainHLA,
+			_Next);
+		_Valid = _EM.PrepareNewSNP(0, Data.CurHaplo, Mat, Data.TrainGeno,
+			_Next);
+		_Freq.resize(_Next.Num_Haplo);
+		for (size_t i=0; i < _Next.Num_Haplo; i++)
+			_Freq[i] = _Next.List[i].Freq;
+	}
+	virtual void Run(size_t)
+	{
+		if (!_Valid) return;
+		for (size_t k=0; k < _Next.Num_Haplo; k++)
+			_Next.List[k].Freq = _Freq[k];
+		double n_iter = _EM.NumIter();
+		_EM.ExpectationMaximization(_Next);
+		n_iter = _EM.NumIter() - n_iter;
+		_AddCheck(uint64_t(n_iter));
+		Pairs += n_iter * _EM.NumPair();
+	}
+	/// the haplotypes after the last call of Run()
+	const CHaplotypeList &Next() const { return _Next; }
+	/// whether the last SNP is polymorphic in the training samples
+	bool Valid() const { return _Valid; }
+private:
+	CBenchEM _EM;
+	CHaplotypeList _Next;
+	vector<double> _Freq;
+	bool _Valid;
+};
+
+/// CHaplotypeList::EraseDoubleHaplos() on the haplotypes estimated by EM
+//    algorithm, with the threshold of rare haplotypes used in training
+class CBench_Erase: public CBenchKernel
+{
+public:
+	virtual const char *Name() const { return "erase"; }
+	virtual void Init(TBenchData &Data)
+	{
+		_Data = &Data;
+		CBench_EM em;
+		em.Init(Data);
+		em.Run(0);
+		_Haplo = em.Next();
+		const int n_samp = Data.TrainGeno.nSamp();
+		_RareProb = std::max(0.1 / (2*n_samp), 1e-5);
+	}
+	virtual void Run(size_t)
+	{
+		_Haplo.EraseDoubleHaplos(_RareProb, _Out);
+		_AddCheck(_Out.Num_Haplo);
+	}
+private:
+	CHaplotypeList _Haplo, _Out;
+	double _RareProb;
+};
+
+
+// ========================================================================= //
+// the checks of the bounded best guess and the accelerated EM algorithm
+
+/// the number of uniformly random genotypes in a check, in addition to
+//    the genotypes simulated from the haplotypes
+static const size_t NUM_CHECK_GENO = 64;
+
+/// the result of a check
+struct TCheckResult
+{
+	int NumHaplo, NumGeno, NumCached, NumMismatch;
+	/// the EM iterations without and with the SQUAREM extrapolation, with
+	//    the tolerance in training and to the fixed points
+	double EMIter, SquaremIter, FixedEMIter, FixedSquaremIter;
+	/// the differences of the log likelihood relative to the convergence
+	//    tolerance of EM algorithm, and the max difference of frequencies
+	//    at the fixed points
+	double LogLikDiff, FixedLogLikDiff, FixedFreqDiff;
+	/// the number of failed comparisons of EM algorithm
+	int NumEMFail;
+};
+
+/// compare the best guess with the upper bounds of HLA pairs, on genotypes
+//    and on the distances from the parent haplotypes, to the enumeration of
+//    all HLA pairs, using the haplotypes of a training step as in
+//    CVariableSelection::_OutOfBagAccuracy()
+static bool CheckBestGuess(TBenchData &Data, int n_snp, int n_samp,
+	uint64_t seed, TCheckResult &Out)
+{
+	// the haplotypes with the last SNP after EM algorithm and the removal
+	//   of rare haplotypes, and their parents in 'Data.CurHaplo'
+	CBench_EM em;
+	em.Init(Data);
+	if (!em.Valid()) return false;
+	em.Run(0);
+	CHaplotypeList Haplo[2];
+	vector<int> SrcIdx;
+	em.Next().EraseDoubleHaplos(std::max(0.1 / (2*n_samp), 1e-5), Haplo[0],
+		SrcIdx);
+	// the same frequency for all haplotypes to have ties of HLA pairs
+	Haplo[1] = Haplo[0];
+	for (size_t i=0; i < Haplo[1].Num_Haplo; i++)
+		Haplo[1].List[i].Freq = 1.0 / Haplo[1].Num_Haplo;
+
+	// the genotypes simulated from the haplotypes, and random genotypes
+	CGenotypeList Geno;
+	Geno.List = Data.TestGeno;
+	Geno.Num_SNP = n_snp;
+	TRandomStream rand;
+	rand.Seed(seed + 1);
+	for (size_t i=0; i < NUM_CHECK_GENO; i++)
+	{
+		TGenotype G;
+		for (int j=0; j < n_snp; j++)
+		{
+			int g = int(rand.Unif() * 4);
+			G.SetSNP(j, (g < 3) ? g : -1);
+		}
+		Geno.List.push_back(G);
+	}
+
+	// the distances between the genotypes without the last SNP and the
+	//   parent haplotype pairs
+	CGenotypeList ParentGeno = Geno;
+	ParentGeno.SetMissing(n_snp - 1);
+	ParentGeno.Num_SNP = n_snp - 1;
+	CParentDistCache Cache;
+	Cache.Init(Data.CurHaplo, ParentGeno);
+	vector<size_t> Offset;
+	vector<int> Parent;
+	vector<UINT8> Allele;
+	Cache.SetChild(SrcIdx, Offset, Parent, Allele);
+	TParentDist Dist;
+	Dist.Offset = &Offset[0];
+	Dist.Parent = &Parent[0];
+	Dist.Allele = &Allele[0];
+
+	Out.NumHaplo = Haplo[0].Num_Haplo;
+	Out.NumGeno = Geno.nSamp();
+	Out.NumCached = Out.NumMismatch = 0;
+	for (int k=0; k < 2; k++)
+	{
+		CBenchPrediction Pred;
+		Pred.InitPrediction(Haplo[k].nHLA());
+		vector<CBenchPrediction::TPairBound> Bound;
+		Pred._InitPairBound(Haplo[k], Bound);
+		for (int i=0; i < Geno.nSamp(); i++)
+		{
+			const TGenotype &G = Geno.List[i];
+			THLAType T0 = Pred._PredBestGuess(Haplo[k], G);
+			THLAType T1 = Pred._PredBestGuess(Haplo[k], G, Bound);
+			if ((T0.Allele1 != T1.Allele1) || (T0.Allele2 != T1.Allele2))
+				Out.NumMismatch ++;
+			if ((Dist.Dist = Cache.SampDist(i)))
+			{
+				Dist.SetNewSNP(G, n_snp - 1);
+				THLAType T2 = Pred._PredBestGuess(Haplo[k], Dist, Bound);
+				if ((T0.Allele1 != T2.Allele1) || (T0.Allele2 != T2.Allele2))
+					Out.NumMismatch ++;
+				if (k == 0) Out.NumCached ++;
+			}
+		}
+	}
+	return true;
+}
+
+/// the max difference of haplotype frequencies between the fixed points of
+//    EM algorithm and the accelerated EM algorithm, relative to EM_FuncRelTol
+static const double CHECK_EM_FREQ_TOL = 100;
+/// the max number of iterations to reach the fixed points
+static const int CHECK_EM_MAX_ITER = 100000;
+
+/// compare the accelerated EM algorithm (SQUAREM) to EM algorithm from the
+//    same haplotype frequencies after adding the last SNP, with the tolerance
+//    EM_FuncRelTol as in training, and with the tolerance EM_FuncRelTol^2 to
+//    reach the fixed points, return false if the last SNP is monomorphic
+static bool CheckEM(TBenchData &Data, TCheckResult &Out)
+{
+	CBenchEM EM;
+	CHaplotypeList Init;
+	CSNPGenoMatrix Mat;
+	Mat.Init(1, Data.TrainNewSNP.size(), &Data.TrainNewSNP[0]);
+	EM.PrepareHaplotypes(Data.CurHaplo, Data.TrainGeno, Data.TrainHLA, Init);
+	if (!EM.PrepareNewSNP(0, Data.CurHaplo, Mat, Data.TrainGeno, Init))
+		return false;
+
+	// [tolerance][accelerated], the haplotype pairs are stored by indices,
+	//   so they are shared by the copies of 'Init'
+	CHaplotypeList Haplo[2][2];
+	double n_iter[2][2], loglik[2][2];
+	const bool accel = EM_Accelerate;
+	const int max_iter = EM_MaxNum_Iterations;
+	for (int t=0; t < 2; t++)
+	{
+		const double reltol = (t == 0) ? EM_FuncRelTol :
+			EM_FuncRelTol * EM_FuncRelTol;
+		for (int k=0; k < 2; k++)
+		{
+			// the accelerated EM algorithm is given twice the iterations of
+			//   EM algorithm to reach the fixed point
+			if (t == 0)
+				EM_MaxNum_Iterations = max_iter;
+			else
+				EM_MaxNum_Iterations = (k == 0) ? CHECK_EM_MAX_ITER :
+					int(2*n_iter[1][0] + 100);
+			Haplo[t][k] = Init;
+			EM_Accelerate = (k == 1);
+			const double st = EM.NumIter();
+			EM.ExpectationMaximization(Haplo[t][k], reltol);
+			n_iter[t][k] = EM.NumIter() - st;
+			loglik[t][k] = EM.LogLik(Haplo[t][k]);
+		}
+	}
+	EM_Accelerate = accel;
+	EM_MaxNum_Iterations = max_iter;
+
+	// the convergence tolerance of the log likelihood in training
+	const double tol = EM_FuncRelTol * (fabs(loglik[1][0]) + EM_FuncRelTol);
+	Out.EMIter = n_iter[0][0];
+	Out.SquaremIter = n_iter[0][1];
+	Out.FixedEMIter = n_iter[1][0];
+	Out.FixedSquaremIter = n_iter[1][1];
+	Out.LogLikDiff = (loglik[0][0] - loglik[0][1]) / tol;
+	Out.FixedLogLikDiff = (loglik[1][0] - loglik[1][1]) / tol;
+	Out.FixedFreqDiff = 0;
+	for (size_t i=0; i < Init.Num_Haplo; i++)
+	{
+		double d = fabs(Haplo[1][0].List[i].Freq - Haplo[1][1].List[i].Freq);
+		if (d > Out.FixedFreqDiff) Out.FixedFreqDiff = d;
+	}
+
+	// the accelerated EM algorithm should stop no earlier than EM algorithm,
+	//   and reach the same fixed point
+	Out.NumEMFail = 0;
+	if (Out.LogLikDiff > 1) Out.NumEMFail ++;
+	if (fabs(Out.FixedLogLikDiff) > 1) Out.NumEMFail ++;
+	if (Out.FixedFreqDiff > CHECK_EM_FREQ_TOL * EM_FuncRelTol)
+		Out.NumEMFail ++;
+	return true;
+}
+
+/// run the checks on 'NumCheck' data sets per setting, return 0 if passed
+static int RunCheck(const TOption &Opt)
+{
+	printf("# hibag-bench: check the bounded best guess and the accelerated EM algorithm, %d training samples, seeds %llu-%llu\n",
+		Opt.NumSamp, (unsigned long long)Opt.Seed,
+		(unsigned long long)(Opt.Seed + Opt.NumCheck - 1));
+	printf("n.snp\tn.allele\tn.haplo.allele\tseed\tn.haplo\tn.geno\tn.cached\tmismatch\tem.iter\tsquarem.iter\tloglik.diff\tfixed.loglik.diff\tfixed.freq.diff\n");
+	fflush(stdout);
+
+	int n_mismatch = 0, n_em_fail = 0, n_check = 0;
+	double n_em_iter[2] = { 0, 0 }, n_squarem_iter[2] = { 0, 0 };
+	for (size_t i1=0; i1 < Opt.NumSNP.size(); i1++)
+	for (size_t i2=0; i2 < Opt.NumAllele.size(); i2++)
+	for (size_t i3=0; i3 < Opt.NumHaplo.size(); i3++)
+	{
+		const int n_snp = Opt.NumSNP[i1];
+		const int n_allele = Opt.NumAllele[i2];
+		const int n_haplo = Opt.NumHaplo[i3];
+		if ((Opt.MaxHaplo > 0) && (n_allele*n_haplo > Opt.MaxHaplo))
+			continue;
+		for (int k=0; k < Opt.NumCheck; k++)
+		{
+			const uint64_t seed = Opt.Seed + k;
+			TBenchData Data;
+			Data.Init(n_snp, n_allele, n_haplo, Opt.NumSamp, seed);
+			TCheckResult r;
+			memset(&r, 0, sizeof(r));
+			printf("%d\t%d\t%d\t%llu\t", n_snp, n_allele, n_haplo,
+				(unsigned long long)seed);
+			if (CheckBestGuess(Data, n_snp, Opt.NumSamp, seed, r) &&
+				CheckEM(Data, r))
+			{
+				printf("%d\t%d\t%d\t%d\t%g\t%g\t%.3g\t%.3g\t%.3g\n",
+					r.NumHaplo, r.NumGeno, r.NumCached, r.NumMismatch,
+					r.EMIter, r.SquaremIter, r.LogLikDiff, r.FixedLogLikDiff,
+					r.FixedFreqDiff);
+				n_mismatch += r.NumMismatch;
+				n_em_fail += r.NumEMFail;
+				n_em_iter[0] += r.EMIter;
+				n_squarem_iter[0] += r.SquaremIter;
+				n_em_iter[1] += r.FixedEMIter;
+				n_squarem_iter[1] += r.FixedSquaremIter;
+				n_check ++;
+			} else
+				printf("NA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\n");
+			fflush(stdout);
+		}
+	}
+
+	if (n_check <= 0)
+	{
+		fprintf(stderr, "Error: no data set is checked.\n");
+		return 1;
+	}
+	for (int t=0; t < 2; t++)
+	{
+		printf("# EM iterations%s: %.0f, with SQUAREM: %.0f (%.1f%% saved)\n",
+			(t == 0) ? "" : " to the fixed points", n_em_iter[t],
+			n_squarem_iter[t], 100 * (1 - n_squarem_iter[t] / n_em_iter[t]));
+	}
+	if (n_mismatch > 0)
+	{
+		fprintf(stderr, "Error: %d mismatches of the bounded best guess.\n",
+			n_mismatch);
+	}
+	if (n_em_fail > 0)
+	{
+		fprintf(stderr, "Error: %d differences between EM algorithm and the accelerated EM algorithm.\n",
+			n_em_fail);
+	}
+	return ((n_mismatch > 0) || (n_em_fail > 0)) ? 1 : 0;
+}
+
+
+// ========================================================================= //
+
+/// the timing of a kernel
+struct TTiming
+{
+	double Time, NumOp, Pairs;
+};
+
+static bool TimingLess(const TTiming &a, const TTiming &b)
+{
+	return a.Time/a.NumOp < b.Time/b.NumOp;
+}
+
+/// run the kernel until 'min_time' seconds have elapsed
+static TTiming Measure(CBenchKernel &K, double min_time)
+{
+	TTiming rv;
+	size_t n = 1;
+	for (;;)
+	{
+		const double pairs = K.Pairs;
+		const double st = Now();
+		for (size_t i=0; i < n; i++) K.Run(i);
+		rv.Time = Now() - st;
+		rv.NumOp = n;
+		rv.Pairs = K.Pairs - pairs;
+		if (rv.Time >= min_time) break;
+		// increase the number of operations
+		double r = (rv.Time > 0) ? 1.5 * min_time / rv.Time : 10;
+		n = size_t(n * std::min(std::max(r, 2.0), 100.0));
+	}
+	return rv;
+}
+
+static CBenchKernel *NewKernel(int i)
+{
+	switch (i)
+	{
+		case 0: return new CBench_HamDist;
+		case 1: return new CBench_PostProb;
+		case 2: return new CBench_BestGuess;
+		case 3: return new CBench_BestGuessBound;
+		case 4: return new CBench_PredPostProb;
+		case 5: return new CBench_EMPrepare;
+		case 6: return new CBench_EM;
+		case 7: return new CBench_Erase;
+	}
+	return NULL;
+}
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage: hibag-bench [options]\n"
+		"Micro-benchmarks of the LibHLA kernels on synthetic haplotype lists\n\n"
+		"  --snp LIST           the numbers of SNPs, 2-128 (8,32,128 by default)\n"
+		"  --allele LIST        the numbers of HLA alleles (20,60,200 by default)\n"
+		"  --haplo LIST         the numbers of haplotypes per HLA allele\n"
+		"                       (1,20,200 by default)\n"
+		"  --max-haplo N        skip the haplotype lists larger than N, no limit\n"
+		"                       if 0 (4000 by default)\n"
+		"  --samp N             the number of training samples (500 by default)\n"
+		"  --kernel LIST        hamdist, pred.postprob, pred.bestguess,\n"
+		"                       pred.bestguess.bound, pred.hlaprob, em.prepare,\n"
+		"                       em.iterate and/or erase (all by default)\n"
+		"  --min-time SEC       the min time of a measurement (0.2 by default)\n"
+		"  --repeat N           the median of N measurements (3 by default)\n"
+		"  --seed N             the random seed of synthetic data (1000 by default)\n"
+		"  --check N            instead of timing, compare the best guess with the\n"
+		"                       upper bounds of HLA pairs to the enumeration of all\n"
+		"                       HLA pairs, and the accelerated EM algorithm to EM\n"
+		"                       algorithm, on N data sets per setting (seeds from\n"
+		"                       --seed), and exit with 1 if any differs\n");
+}
+
+static void PrintStderr(const char *msg)
+{
+	fputs(msg, stderr);
+}
+
+
+int main(int argc, char *argv[])
+{
+	TOption Opt;
+	ParseIntList("8,32,128", Opt.NumSNP);
+	ParseIntList("20,60,200", Opt.NumAllele);
+	ParseIntList("1,20,200", Opt.NumHaplo);
+
+	for (int i=1; i < argc; i++)
+	{
+		const string a = argv[i];
+		const char *v = (i+1 < argc) ? argv[i+1] : NULL;
+		if ((a == "-h") || (a == "--help"))
+			{ Usage(); return 0; }
+		bool ok = true;
+		if (!v)
+			ok = false;
+		else if (a == "--snp")
+			ok = ParseIntList(v, Opt.NumSNP);
+		else if (a == "--allele")
+			ok = ParseIntList(v, Opt.NumAllele);
+		else if (a == "--haplo")
+			ok = ParseIntList(v, Opt.NumHaplo);
+		else if (a == "--max-haplo")
+			Opt.MaxHaplo = atoi(v);
+		else if (a == "--samp")
+			Opt.NumSamp = atoi(v);
+		else if (a == "--kernel")
+			ParseStrList(v, Opt.Kernel);
+		else if (a == "--min-time")
+			Opt.MinTime = atof(v);
+		else if (a == "--repeat")
+			Opt.Repeat = atoi(v);
+		else if (a == "--seed")
+			Opt.Seed = strtoull(v, NULL, 10);
+		else if (a == "--check")
+			Opt.NumCheck = atoi(v);
+		else
+			ok = false;
+		if (!ok)
+		{
+			fprintf(stderr, "Error: invalid argument '%s'.\n\n", a.c_str());
+			Usage(); return 1;
+		}
+		i ++;
+	}
+	for (size_t i=0; i < Opt.NumSNP.size(); i++)
+	{
+		if ((Opt.NumSNP[i] < 2) ||
+			(Opt.NumSNP[i] > (int)HIBAG_MAXNUM_SNP_IN_CLASSIFIER))
+		{
+			fprintf(stderr, "Error: the number of SNPs should be 2-128.\n");
+			return 1;
+		}
+	}
+	for (size_t i=0; i < Opt.NumAllele.size(); i++)
+		if (Opt.NumAllele[i] < 1) Opt.NumAllele[i] = 1;
+	for (size_t i=0; i < Opt.NumHaplo.size(); i++)
+		if (Opt.NumHaplo[i] < 1) Opt.NumHaplo[i] = 1;
+	if (Opt.NumSamp < 1) Opt.NumSamp = 1;
+	if (Opt.Repeat < 1) Opt.Repeat = 1;
+
+	// the messages of the library are written to the standard error
+	HostHooks.Print = PrintStderr;
+
+	if (Opt.NumCheck > 0)
+	{
+		try {
+			return RunCheck(Opt);
+		}
+		catch (exception &E) {
+			fprintf(stderr, "Error: %s\n", E.what());
+		}
+		catch (const char *E) {
+			fprintf(stderr, "Error: %s\n", E);
+		}
+		return 1;
+	}
+
+	// the kernels to be run
+	vector<int> kernel;
+	for (int k=0; ; k++)
+	{
+		CBenchKernel *K = NewKernel(k);
+		if (!K) break;
+		if (Opt.Kernel.empty() || (find(Opt.Kernel.begin(), Opt.Kernel.end(),
+				string(K->Name())) != Opt.Kernel.end()))
+			kernel.push_back(k);
+		delete K;
+	}
+	if (kernel.empty())
+	{
+		fprintf(stderr, "Error: no kernel is selected.\n");
+		return 1;
+	}
+
+	printf("# hibag-bench: %d training samples, seed %llu, the median of %d measurements (>= %gs)\n",
+		Opt.NumSamp, (unsigned long long)Opt.Seed, Opt.Repeat, Opt.MinTime);
+	printf("# CPU flags:"
+	#ifdef HIBAG_SIMD_OPTIMIZE_HAMMING_DISTANCE
+		" SSE2"
+	#endif
+	#ifdef HIBAG_HARDWARE_POPCNT
+		" POPCNT"
+	#endif
+	#ifdef HIBAG_REG_BIT64
+		" 64-bit"
+	#endif
+		"\n");
+	printf("kernel\tn.snp\tn.allele\tn.haplo.allele\tn.haplo\tns.op\tpairs.op\tpairs.s\tcheck\n");
+	fflush(stdout);
+
+	try {
+		for (size_t i1=0; i1 < Opt.NumSNP.size(); i1++)
+		for (size_t i2=0; i2 < Opt.NumAllele.size(); i2++)
+		for (size_t i3=0; i3 < Opt.NumHaplo.size(); i3++)
+		{
+			const int n_snp = Opt.NumSNP[i1];
+			const int n_allele = Opt.NumAllele[i2];
+			const int n_haplo = Opt.NumHaplo[i3];
+			if ((Opt.MaxHaplo > 0) && (n_allele*n_haplo > Opt.MaxHaplo))
+				continue;
+
+			TBenchData Data;
+			Data.Init(n_snp, n_allele, n_haplo, Opt.NumSamp, Opt.Seed);
+
+			for (size_t k=0; k < kernel.size(); k++)
+			{
+				CBenchKernel *K = NewKernel(kernel[k]);
+				K->Init(Data);
+				// warm up, and the fingerprint of a fixed number of operations
+				for (size_t i=0; i < NUM_TEST_GENO; i++) K->Run(i);
+				const uint64_t check = K->Check;
+				vector<TTiming> tm(Opt.Repeat);
+				for (int r=0; r < Opt.Repeat; r++)
+					tm[r] = Measure(*K, Opt.MinTime);
+				sort(tm.begin(), tm.end(), TimingLess);
+				const TTiming &t = tm[tm.size() / 2];
+
+				printf("%s\t%d\t%d\t%d\t%d\t%.1f\t", K->Name(), n_snp,
+					n_allele, n_haplo, n_allele*n_haplo, 1e9*t.Time/t.NumOp);
+				if (t.Pairs > 0)
+				{
+					printf("%.0f\t%.4g\t", t.Pairs/t.NumOp, t.Pairs/t.Time);
+				} else
+					printf("NA\tNA\t");
+				printf("%016llx\n", (unsigned long long)check);
+				fflush(stdout);
+				delete K;
+			}
+		}
+	}
+	catch (exception &E) {
+		fprintf(stderr, "Error: %s\n", E.what());
+		return 1;
+	}
+	catch (const char *E) {
+		fprintf(stderr, "Error: %s\n", E);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,545 @@
+// ===============================================================
+//
+// HIBAG R package (HLA Genotype Imputation with Attribute Bagging)
+// Copyright (C) 2020   Xiuwen Zheng (zhengx@u.washington.edu)
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// ===============================================================
+// Name           : hibag-predict
+// Author         : Xiuwen Zheng
+// Copyright      : Xiuwen Zheng (GPL v3)
+// Description    : HLA imputation from the command line without R
+// ===============================================================
+
+#include "LibHLA.h"
+
+#include <cctype>
+#include <fstream>
+#include <map>
+
+using namespace std;
+using namespace HLA_LIB;
+
+
+// ========================================================================= //
+
+/// the SNP and HLA information of a model, see hlaModelExport() in R
+struct TModelInfo
+{
+	string Locus, Assembly;
+	int NumSamp;
+	vector<string> HLAAllele;
+	vector<string> SNPID, SNPPos, SNPAllele;
+
+	TModelInfo() { NumSamp = 0; }
+};
+
+/// split a line by tabs
+static void SplitTab(const string &line, vector<string> &out)
+{
+	out.clear();
+	size_t n = line.size();
+	if ((n > 0) && (line[n-1] == '\r')) n --;
+	size_t st = 0;
+	for (size_t i=0; i <= n; i++)
+	{
+		if ((i == n) || (line[i] == '\t'))
+		{
+			out.push_back(line.substr(st, i - st));
+			st = i + 1;
+		}
+	}
+}
+
+/// split a line by spaces or tabs
+static void SplitSpace(const string &line, vector<string> &out)
+{
+	out.clear();
+	size_t i = 0, n = line.size();
+	while (i < n)
+	{
+		while ((i < n) && isspace((unsigned char)line[i])) i ++;
+		size_t st = i;
+		while ((i < n) && !isspace((unsigned char)line[i])) i ++;
+		if (i > st) out.push_back(line.substr(st, i - st));
+	}
+}
+
+/// parse a line of the model information, return false if it is not
+static bool ParseInfo(TModelInfo &Info, const vector<string> &s, int line_no)
+{
+	const string &key = s[0];
+	if (key == "HIBAG.model")
+	{
+		if ((s.size() < 2) || (s[1] != "1"))
+			throw ErrHLA("Line %d: unsupported format version.", line_no);
+	} else if (key == "locus")
+	{
+		if (s.size() > 1) Info.Locus = s[1];
+	} else if (key == "assembly")
+	{
+		if (s.size() > 1) Info.Assembly = s[1];
+	} else if (key == "n.samp")
+	{
+		if (s.size() > 1) Info.NumSamp = atoi(s[1].c_str());
+	} else if (key == "hla.allele")
+	{
+		Info.HLAAllele.assign(s.begin() + 1, s.end());
+	} else if (key == "snp")
+	{
+		if (s.size() < 4)
+			throw ErrHLA("Line %d: invalid SNP information.", line_no);
+		Info.SNPID.push_back(s[1]);
+		Info.SNPPos.push_back(s[2]);
+		Info.SNPAllele.push_back(s[3]);
+	} else
+		return false;
+	return true;
+}
+
+/// check the model information
+static void CheckInfo(const TModelInfo &Info)
+{
+	if (Info.HLAAllele.empty())
+		throw ErrHLA("There is no HLA allele in the model information.");
+	if (Info.SNPID.empty())
+		throw ErrHLA("There is no SNP in the model information.");
+}
+
+
+/// the haplotypes of a classifier in the text model
+struct TClassifierText
+{
+	double Accuracy;
+	vector<int> SNPIndex;
+	vector<double> Freq;
+	vector<int> HLA;
+	vector<string> Haplo;
+};
+
+static void AddClassifier(CAttrBag_Model &Model, const TClassifierText &C)
+{
+	if (C.SNPIndex.empty() || C.Freq.empty()) return;
+	vector<const char*> haplo(C.Haplo.size());
+	for (size_t i=0; i < haplo.size(); i++)
+		haplo[i] = C.Haplo[i].c_str();
+	double acc = C.Accuracy;
+	Model.NewClassifierAllSamp()->Assign(C.SNPIndex.size(), &C.SNPIndex[0],
+		NULL, C.Freq.size(), &C.Freq[0], &C.HLA[0], &haplo[0], &acc);
+}
+
+/// load a model exported by hlaModelExport()
+static void LoadTextModel(const char *fn, TModelInfo &Info,
+	CAttrBag_Model &Model)
+{
+	ifstream f(fn);
+	if (!f) throw ErrHLA("Fails to open \"%s\".", fn);
+
+	map<string, int> hla_idx;
+	TClassifierText C;
+	bool in_classifier = false;
+	string line;
+	vector<string> s;
+
+	for (int line_no=1; getline(f, line); line_no++)
+	{
+		SplitTab(line, s);
+		if (s[0].empty()) continue;
+
+		if (s[0] == "classifier")
+		{
+			if (!in_classifier)
+			{
+				CheckInfo(Info);
+				Model.InitTraining(Info.SNPID.size(), Info.NumSamp,
+					Info.HLAAllele.size());
+				for (size_t i=0; i < Info.HLAAllele.size(); i++)
+					hla_idx[Info.HLAAllele[i]] = i;
+				in_classifier = true;
+			} else
+				AddClassifier(Model, C);
+			C = TClassifierText();
+			C.Accuracy = (s.size() > 1) ? atof(s[1].c_str()) : 0;
+		} else if (in_classifier && (s[0] == "snp.index"))
+		{
+			for (size_t i=1; i < s.size(); i++)
+			{
+				int k = atoi(s[i].c_str()) - 1;
+				if ((k < 0) || (k >= (int)Info.SNPID.size()))
+					throw ErrHLA("Line %d: invalid SNP index.", line_no);
+				C.SNPIndex.push_back(k);
+			}
+		} else if (in_classifier && (s[0] == "haplo"))
+		{
+			map<string, int>::iterator it;
+			if ((s.size() < 4) || ((it = hla_idx.find(s[2])) == hla_idx.end()))
+				throw ErrHLA("Line %d: invalid haplotype.", line_no);
+			if (s[3].size() != C.SNPIndex.size())
+				throw ErrHLA("Line %d: invalid length of haplotype.", line_no);
+			C.Freq.push_back(atof(s[1].c_str()));
+			C.HLA.push_back(it->second);
+			C.Haplo.push_back(s[3]);
+		} else if (in_classifier || !ParseInfo(Info, s, line_no))
+			throw ErrHLA("Line %d: unknown key \"%s\".", line_no, s[0].c_str());
+	}
+
+	if (!in_classifier)
+		throw ErrHLA("There is no individual classifier in \"%s\".", fn);
+	AddClassifier(Model, C);
+}
+
+/// load a binary model created by hlaModelSaveBinary()
+static void LoadBinaryModel(const char *fn, TModelInfo &Info,
+	CAttrBag_Model &Model)
+{
+	Model.LoadBinary(fn);
+	size_t size;
+	const UINT8 *meta = Model.BinaryMeta(size);
+	// the information in text is ended by a zero byte
+	const char *p = (const char*)meta;
+	const char *end = p + size;
+	if (!meta || (size < 11) || (strncmp(p, "HIBAG.model", 11) != 0))
+		throw ErrHLA("There is no model information in \"%s\".", fn);
+
+	vector<string> s;
+	for (int line_no=1; (p < end) && *p; line_no++)
+	{
+		const char *e = p;
+		while ((e < end) && (*e != '\n') && *e) e ++;
+		SplitTab(string(p, e), s);
+		if (!s[0].empty() && !ParseInfo(Info, s, line_no))
+			throw ErrHLA("Line %d: unknown key \"%s\".", line_no, s[0].c_str());
+		p = (e < end && *e == '\n') ? (e + 1) : e;
+	}
+	CheckInfo(Info);
+	if ((int)Info.SNPID.size() != Model.nSNP() ||
+			(int)Info.HLAAllele.size() != Model.nHLA())
+		throw ErrHLA("The model information in \"%s\" is inconsistent.", fn);
+}
+
+/// whether it is a binary model file
+static bool IsBinaryModel(const char *fn)
+{
+	char buf[8] = { 0 };
+	FILE *f = fopen(fn, "rb");
+	if (!f) throw ErrHLA("Fails to open \"%s\".", fn);
+	size_t n = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	return (n == sizeof(buf)) && (memcmp(buf, "HIBAGMOD", 8) == 0);
+}
+
+
+// ========================================================================= //
+
+/// the key of a SNP for matching
+static string SNPKey(const string &match_type, const string &id,
+	const string &pos)
+{
+	if (match_type == "RefSNP")
+		return id;
+	else if (match_type == "RefSNP+Position")
+		return id + "-" + pos;
+	else
+		return pos;
+}
+
+static char Complement(char c)
+{
+	switch (toupper(c))
+	{
+		case 'A': return 'T';
+		case 'T': return 'A';
+		case 'C': return 'G';
+		case 'G': return 'C';
+	}
+	return c;
+}
+
+static string Complement(const string &s)
+{
+	string rv(s);
+	for (size_t i=0; i < rv.size(); i++) rv[i] = Complement(rv[i]);
+	return rv;
+}
+
+/// compare the alleles "A/B" in the model with the alleles in the file,
+//    return 0 if the same, 1 if switched, -1 if not matched; the same strand
+//    is assumed for A/T and C/G SNPs
+static int AlleleFlip(const string &model_allele, const string &a1,
+	const string &a2)
+{
+	size_t k = model_allele.find('/');
+	if (k == string::npos) return 0;  // unknown alleles
+	const string A = model_allele.substr(0, k), B = model_allele.substr(k+1);
+	if ((A == a1) && (B == a2)) return 0;
+	if ((A == a2) && (B == a1)) return 1;
+	const string cA = Complement(A), cB = Complement(B);
+	if ((cA == a1) && (cB == a2)) return 0;
+	if ((cA == a2) && (cB == a1)) return 1;
+	return -1;
+}
+
+
+/// the options of command line
+struct TOption
+{
+	const char *ModelFn, *BFile, *GenoFn, *OutFn;
+	string MatchType;
+	int VoteMethod, NumThread, ChunkSize;
+
+	TOption()
+	{
+		ModelFn = BFile = GenoFn = OutFn = NULL;
+		MatchType = "Position";
+		VoteMethod = 1; NumThread = 1; ChunkSize = 10000;
+	}
+};
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage: hibag-predict -m MODEL (-b PREFIX | -g GENO) [options]\n"
+		"HLA imputation with a HIBAG model without R\n\n"
+		"  -m, --model FILE     the model from hlaModelSaveBinary() or hlaModelExport()\n"
+		"  -b, --bfile PREFIX   PLINK files: PREFIX.bed, PREFIX.bim and PREFIX.fam\n"
+		"  -g, --geno FILE      tab-delimited genotypes: a header 'sample.id' followed\n"
+		"                       by SNP keys, and then a sample per line with the\n"
+		"                       numbers of the first alleles in the model (0, 1, 2,\n"
+		"                       or missing otherwise)\n"
+		"  -o, --out FILE       the output file (standard output by default)\n"
+		"  --match TYPE         Position (default), RefSNP or RefSNP+Position\n"
+		"  --vote TYPE          prob (default) or majority\n"
+		"  --threads N          the number of threads (1 by default)\n"
+		"  --chunk N            the number of samples read at a time from the\n"
+		"                       PLINK BED file (10000 by default)\n");
+}
+
+static void PrintStderr(const char *msg)
+{
+	fputs(msg, stderr);
+}
+
+
+int main(int argc, char *argv[])
+{
+	TOption Opt;
+	for (int i=1; i < argc; i++)
+	{
+		const string a = argv[i];
+		const char *v = (i+1 < argc) ? argv[i+1] : NULL;
+		if ((a == "-h") || (a == "--help"))
+			{ Usage(); return 0; }
+		if (!v)
+		{
+			fprintf(stderr, "Error: invalid argument '%s'.\n\n", a.c_str());
+			Usage(); return 1;
+		}
+		if ((a == "-m") || (a == "--model"))
+			Opt.ModelFn = v;
+		else if ((a == "-b") || (a == "--bfile"))
+			Opt.BFile = v;
+		else if ((a == "-g") || (a == "--geno"))
+			Opt.GenoFn = v;
+		else if ((a == "-o") || (a == "--out"))
+			Opt.OutFn = v;
+		else if (a == "--match")
+			Opt.MatchType = v;
+		else if (a == "--vote")
+			Opt.VoteMethod = (strcmp(v, "majority") == 0) ? 2 :
+				((strcmp(v, "prob") == 0) ? 1 : 0);
+		else if (a == "--threads")
+			Opt.NumThread = atoi(v);
+		else if (a == "--chunk")
+			Opt.ChunkSize = atoi(v);
+		else {
+			fprintf(stderr, "Error: invalid argument '%s'.\n\n", a.c_str());
+			Usage(); return 1;
+		}
+		i ++;
+	}
+	if (!Opt.ModelFn || (!Opt.BFile == !Opt.GenoFn) || (Opt.VoteMethod == 0) ||
+		((Opt.MatchType != "Position") && (Opt.MatchType != "RefSNP") &&
+		(Opt.MatchType != "RefSNP+Position")))
+	{
+		Usage(); return 1;
+	}
+	if (Opt.NumThread < 1) Opt.NumThread = 1;
+	if (Opt.ChunkSize < 1) Opt.ChunkSize = 1;
+
+	// the messages of the library are written to the standard error
+	HostHooks.Print = PrintStderr;
+
+	try {
+		// load the model
+		TModelInfo Info;
+		CAttrBag_Model Model;
+		if (IsBinaryModel(Opt.ModelFn))
+			LoadBinaryModel(Opt.ModelFn, Info, Model);
+		else
+			LoadTextModel(Opt.ModelFn, Info, Model);
+		const int n_snp = Model.nSNP();
+		fprintf(stderr,
+			"HIBAG model (%s): %d individual classifiers, %d SNPs, %d unique HLA alleles.\n",
+			Info.Locus.c_str(), (int)Model.ClassifierList().size(), n_snp,
+			Model.nHLA());
+
+		map<string, int> model_snp;
+		for (int i=0; i < n_snp; i++)
+			model_snp[SNPKey(Opt.MatchType, Info.SNPID[i], Info.SNPPos[i])] = i;
+
+		vector<string> sample_id;
+		vector<int> H1, H2;
+		vector<double> Prob, Matching;
+		int n_missing = 0;
+		string line;
+		vector<string> s;
+
+		if (Opt.BFile)
+		{
+			const string prefix = Opt.BFile;
+			// samples
+			ifstream fam((prefix + ".fam").c_str());
+			if (!fam) throw ErrHLA("Fails to open \"%s.fam\".", Opt.BFile);
+			vector<string> fid, iid;
+			while (getline(fam, line))
+			{
+				SplitSpace(line, s);
+				if (s.size() < 2) continue;
+				fid.push_back(s[0]); iid.push_back(s[1]);
+			}
+			map<string, int> uniq;
+			for (size_t i=0; i < iid.size(); i++) uniq[iid[i]] = i;
+			for (size_t i=0; i < iid.size(); i++)
+			{
+				sample_id.push_back((uniq.size() == iid.size()) ? iid[i] :
+					(fid[i] + "-" + iid[i]));
+			}
+
+			// SNPs
+			ifstream bim((prefix + ".bim").c_str());
+			if (!bim) throw ErrHLA("Fails to open \"%s.bim\".", Opt.BFile);
+			vector<int> snp_idx(n_snp, -1), snp_flip(n_snp, 0);
+			int n_bim = 0;
+			for (; getline(bim, line); n_bim++)
+			{
+				SplitSpace(line, s);
+				if (s.size() < 6)
+					throw ErrHLA("Invalid line %d in \"%s.bim\".", n_bim+1, Opt.BFile);
+				map<string, int>::iterator it =
+					model_snp.find(SNPKey(Opt.MatchType, s[1], s[3]));
+				if ((it != model_snp.end()) && (snp_idx[it->second] < 0))
+				{
+					int flip = AlleleFlip(Info.SNPAllele[it->second], s[4], s[5]);
+					if (flip >= 0)
+					{
+						snp_idx[it->second] = n_bim;
+						snp_flip[it->second] = flip;
+					}
+				}
+			}
+			for (int i=0; i < n_snp; i++) if (snp_idx[i] < 0) n_missing ++;
+			if (n_missing == n_snp)
+				throw ErrHLA("There is no overlapping of SNPs!");
+
+			const int n_samp = sample_id.size();
+			fprintf(stderr, "Open \"%s.bed\" with %d samples and %d SNPs, %d missing SNPs in the model.\n",
+				Opt.BFile, n_samp, n_bim, n_missing);
+			CBEDGenoReader Reader;
+			Reader.Open((prefix + ".bed").c_str(), n_samp, n_bim, n_snp,
+				&snp_idx[0], &snp_flip[0]);
+			H1.resize(n_samp); H2.resize(n_samp);
+			Prob.resize(n_samp); Matching.resize(n_samp);
+			if (n_samp > 0)
+			{
+				Model.PredictHLA(Reader, n_samp, Opt.ChunkSize, Opt.VoteMethod,
+					&H1[0], &H2[0], &Prob[0], &Matching[0], false, NULL,
+					Opt.NumThread);
+			}
+
+		} else {
+			ifstream f(Opt.GenoFn);
+			if (!f) throw ErrHLA("Fails to open \"%s\".", Opt.GenoFn);
+			if (!getline(f, line))
+				throw ErrHLA("There is no header in \"%s\".", Opt.GenoFn);
+			SplitTab(line, s);
+			// the columns of SNPs in the model
+			vector<int> col(s.size(), -1);
+			vector<bool> found(n_snp, false);
+			for (size_t j=1; j < s.size(); j++)
+			{
+				map<string, int>::iterator it = model_snp.find(s[j]);
+				if ((it != model_snp.end()) && !found[it->second])
+					{ col[j] = it->second; found[it->second] = true; }
+			}
+			for (int i=0; i < n_snp; i++) if (!found[i]) n_missing ++;
+			if (n_missing == n_snp)
+				throw ErrHLA("There is no overlapping of SNPs!");
+
+			vector<int> geno;
+			for (int line_no=2; getline(f, line); line_no++)
+			{
+				SplitTab(line, s);
+				if (s[0].empty()) continue;
+				if (s.size() != col.size())
+					throw ErrHLA("Invalid number of columns at line %d.", line_no);
+				sample_id.push_back(s[0]);
+				const size_t st = geno.size();
+				geno.resize(st + n_snp, NA_INTEGER);
+				for (size_t j=1; j < s.size(); j++)
+				{
+					if ((col[j] >= 0) && (s[j].size() == 1) &&
+							(s[j][0] >= '0') && (s[j][0] <= '2'))
+						geno[st + col[j]] = s[j][0] - '0';
+				}
+			}
+
+			const int n_samp = sample_id.size();
+			fprintf(stderr, "Read \"%s\" with %d samples, %d missing SNPs in the model.\n",
+				Opt.GenoFn, n_samp, n_missing);
+			H1.resize(n_samp); H2.resize(n_samp);
+			Prob.resize(n_samp); Matching.resize(n_samp);
+			if (n_samp > 0)
+			{
+				Model.PredictHLA(&geno[0], n_samp, Opt.VoteMethod, &H1[0],
+					&H2[0], &Prob[0], &Matching[0], NULL, false, NULL,
+					Opt.NumThread);
+			}
+		}
+
+		// output
+		FILE *out = Opt.OutFn ? fopen(Opt.OutFn, "wt") : stdout;
+		if (!out) throw ErrHLA("Fails to create \"%s\".", Opt.OutFn);
+		fprintf(out, "sample.id\tallele1\tallele2\tprob\tmatching\n");
+		for (size_t i=0; i < sample_id.size(); i++)
+		{
+			const bool na = (H1[i] == NA_INTEGER) || (H2[i] == NA_INTEGER);
+			fprintf(out, "%s\t%s\t%s\t%.6g\t%.6g\n", sample_id[i].c_str(),
+				na ? "NA" : Info.HLAAllele[H1[i]].c_str(),
+				na ? "NA" : Info.HLAAllele[H2[i]].c_str(), Prob[i], Matching[i]);
+		}
+		if (out != stdout) fclose(out);
+	}
+	catch (exception &E) {
+		fprintf(stderr, "Error: %s\n", E.what());
+		return 1;
+	}
+	catch (const char *E) {
+		fprintf(stderr, "Error: %s\n", E);
+		return 1;
+	}
+
+	return 0;
+}